@@ -41,6 +41,29 @@
 #include <iostream>
 #include <functional>
 #include <format>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
+#include <thread>
+#include <atomic>
+#include <string_view>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <map>
+#include <set>
+#include <iterator>
+#include <vector>
+#include <list>
+#include <array>
+#include <span>
+#include <variant>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <cctype>
+#include <bit>
 
 /// @brief The nlohmann.json provides for the primary interface for this class. While this may not be the most efficient, it is the
 /// cleanest to use as a client.
@@ -60,9 +83,298 @@
 
 #include "siddiqsoft/TimeThis.hpp"
 
+/// @brief The SSSE3 kernels for CosmosCodec are available on x86/x64 and selected at runtime
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define COSMOSCLIENT_SSSE3
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define COSMOSCLIENT_TARGET_SSSE3
+#else
+#include <cpuid.h>
+#define COSMOSCLIENT_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
+
 
 namespace siddiqsoft
 {
+#pragma region CosmosCodec
+    /// @brief Base64, URL-escape and character search kernels for the key decoding, the token generation performed on every
+    /// request and the newline scan of the import.
+    /// The SSSE3 kernels process 16 characters (12 bytes) per step and are selected at runtime when the processor supports
+    /// them; the scalar kernels handle the remainder, the padding and the processors without SSSE3.
+    struct CosmosCodec
+    {
+        /// @brief Checks if the processor supports SSSE3 (determined once)
+        /// @return true if the vectorized kernels are used
+        static bool vectorized()
+        {
+#if defined(COSMOSCLIENT_SSSE3)
+            static const bool supported = [] {
+#if defined(_MSC_VER)
+                int info[4] {};
+                __cpuid(info, 1);
+                return (info[2] & (1 << 9)) != 0;
+#else
+                unsigned int eax {}, ebx {}, ecx {}, edx {};
+                return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSSE3) != 0;
+#endif
+            }();
+            return supported;
+#else
+            return false;
+#endif
+        }
+
+
+        /// @brief Base64 encode (RFC 4648 with padding)
+        /// @param src The binary data
+        /// @param simd Use the vectorized kernel if supported; `false` forces the scalar kernel
+        /// @return The encoded string
+        static std::string base64Encode(std::string_view src, bool simd = true)
+        {
+            std::string dest((src.size() + 2) / 3 * 4, '\0');
+            size_t      i = 0, o = 0;
+#if defined(COSMOSCLIENT_SSSE3)
+            if (simd && vectorized()) encodeSsse3(src, dest, i, o);
+#endif
+            static constexpr char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            for (; i + 3 <= src.size(); i += 3) {
+                uint32_t v = (uint8_t(src[i]) << 16) | (uint8_t(src[i + 1]) << 8) | uint8_t(src[i + 2]);
+                dest[o++]  = alphabet[(v >> 18) & 0x3f];
+                dest[o++]  = alphabet[(v >> 12) & 0x3f];
+                dest[o++]  = alphabet[(v >> 6) & 0x3f];
+                dest[o++]  = alphabet[v & 0x3f];
+            }
+            if (auto rest = src.size() - i; rest > 0) {
+                uint32_t v = (uint8_t(src[i]) << 16) | (rest > 1 ? uint8_t(src[i + 1]) << 8 : 0);
+                dest[o++]  = alphabet[(v >> 18) & 0x3f];
+                dest[o++]  = alphabet[(v >> 12) & 0x3f];
+                dest[o++]  = rest > 1 ? alphabet[(v >> 6) & 0x3f] : '=';
+                dest[o++]  = '=';
+            }
+            return dest;
+        }
+
+
+        /// @brief Base64 decode (RFC 4648; the padding is optional)
+        /// @param src The encoded string
+        /// @param simd Use the vectorized kernel if supported; `false` forces the scalar kernel
+        /// @return The binary data or an empty string if the source contains invalid characters
+        static std::string base64Decode(std::string_view src, bool simd = true)
+        {
+            std::string dest(src.size() / 4 * 3 + 16, '\0');
+            size_t      i = 0, o = 0;
+#if defined(COSMOSCLIENT_SSSE3)
+            if (simd && vectorized()) decodeSsse3(src, dest, i, o);
+#endif
+            // Strip the padding
+            auto size = src.size();
+            while (size > i && src[size - 1] == '=') --size;
+
+            uint32_t v {}, bits {};
+            for (; i < size; ++i) {
+                auto c = uint8_t(src[i]);
+                int  d = (c >= 'A' && c <= 'Z')   ? c - 'A'
+                         : (c >= 'a' && c <= 'z') ? c - 'a' + 26
+                         : (c >= '0' && c <= '9') ? c - '0' + 52
+                         : c == '+'               ? 62
+                         : c == '/'               ? 63
+                                                  : -1;
+                if (d < 0) return {};
+                v = (v << 6) | uint32_t(d);
+                if ((bits += 6) >= 8) {
+                    bits -= 8;
+                    dest[o++] = char((v >> bits) & 0xff);
+                }
+            }
+            dest.resize(o);
+            return dest;
+        }
+
+
+        /// @brief Percent-encode everything except the unreserved characters (RFC 3986 `ALPHA DIGIT - . _ ~`)
+        /// @param src The source string
+        /// @param simd Use the vectorized kernel if supported; `false` forces the scalar kernel
+        /// @return The escaped string
+        static std::string urlEscape(std::string_view src, bool simd = true)
+        {
+            std::string dest;
+            dest.reserve(src.size() + src.size() / 2);
+            size_t i = 0;
+#if defined(COSMOSCLIENT_SSSE3)
+            if (simd && vectorized()) escapeSsse3(src, dest, i);
+#endif
+            for (; i < src.size(); ++i)
+                escape(src[i], dest);
+            return dest;
+        }
+
+
+        /// @brief Find the first occurrence of the character (the newline scanner of the import)
+        /// @param src The source string
+        /// @param c The character
+        /// @param pos The position to start the search
+        /// @param simd Use the vectorized kernel if supported; `false` forces the scalar kernel
+        /// @return The position of the character or `std::string_view::npos`
+        static size_t find(std::string_view src, char c, size_t pos = 0, bool simd = true)
+        {
+            size_t i = pos;
+#if defined(COSMOSCLIENT_SSSE3)
+            if (simd && vectorized() && findSsse3(src, c, i)) return i;
+#endif
+            for (; i < src.size(); ++i)
+                if (src[i] == c) return i;
+            return std::string_view::npos;
+        }
+
+
+        /// @brief Builds the Cosmos master key authorization token
+        /// https://docs.microsoft.com/en-us/rest/api/cosmos-db/access-control-on-cosmosdb-resources
+        /// @param key The decoded key
+        /// @param verb The HTTP verb
+        /// @param type The resource type
+        /// @param resourceLink The resource link
+        /// @param date The RFC 7231 date sent as `x-ms-date`
+        /// @return The url-escaped token for the `Authorization` header
+        static std::string cosmosToken(const std::string& key,
+                                       const std::string& verb,
+                                       const std::string& type,
+                                       const std::string& resourceLink,
+                                       const std::string& date)
+        {
+            // ASCII only; the result must not depend on the global locale
+            auto lower = [](std::string s) {
+                std::transform(s.begin(), s.end(), s.begin(), [](char c) { return (c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : c; });
+                return s;
+            };
+
+            auto signature = EncryptionUtils::HMAC(std::format("{}\n{}\n{}\n{}\n\n", lower(verb), lower(type), resourceLink, lower(date)), key);
+            return std::format("type%3dmaster%26ver%3d1.0%26sig%3d{}", urlEscape(base64Encode(signature)));
+        }
+
+    private:
+        static void escape(char c, std::string& dest)
+        {
+            static constexpr char hex[] = "0123456789ABCDEF";
+            // The unreserved set is ASCII; `std::isalnum` would also accept the locale's letters above 0x7f
+            if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
+                c == '~') {
+                dest += c;
+            }
+            else {
+                dest += '%';
+                dest += hex[uint8_t(c) >> 4];
+                dest += hex[uint8_t(c) & 0x0f];
+            }
+        }
+
+#if defined(COSMOSCLIENT_SSSE3)
+        /// @brief Map the sextets to their characters by adding the offset for each range of the alphabet
+        COSMOSCLIENT_TARGET_SSSE3 static __m128i encodeLookup(__m128i sextets)
+        {
+            __m128i index = _mm_subs_epu8(sextets, _mm_set1_epi8(51));
+            index         = _mm_or_si128(index, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), sextets), _mm_set1_epi8(13)));
+            const __m128i offsets =
+                    _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                  '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+            return _mm_add_epi8(_mm_shuffle_epi8(offsets, index), sextets);
+        }
+
+        /// @brief Encode 12 bytes into 16 characters per step; each step reads 16 bytes
+        COSMOSCLIENT_TARGET_SSSE3 static void encodeSsse3(std::string_view src, std::string& dest, size_t& i, size_t& o)
+        {
+            for (; i + 16 <= src.size(); i += 12, o += 16) {
+                __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src.data() + i));
+                // Each 3 byte group [a b c] becomes [b a c b] so the sextets can be shifted into place per 16-bit lane
+                in               = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+                const __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)), _mm_set1_epi32(0x04000040));
+                const __m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)), _mm_set1_epi32(0x01000010));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dest.data() + o), encodeLookup(_mm_or_si128(t0, t1)));
+            }
+        }
+
+        /// @brief Decode 16 characters into 12 bytes per step; stops at the first block with padding or an invalid
+        /// character which is left for the scalar kernel. Each step writes 16 bytes.
+        COSMOSCLIENT_TARGET_SSSE3 static void decodeSsse3(std::string_view src, std::string& dest, size_t& i, size_t& o)
+        {
+            // Valid characters by low nibble (row) and high nibble (bit)
+            const __m128i valid = _mm_setr_epi8(char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+                                                char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf0), 0x54, 0x50, 0x50,
+                                                0x50, 0x54);
+            const __m128i bits   = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80), 0, 0, 0, 0, 0, 0, 0, 0);
+            const __m128i shifts = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+
+            for (; i + 16 <= src.size(); i += 16, o += 12) {
+                const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src.data() + i));
+                const __m128i hi = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+                const __m128i lo = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+
+                const __m128i invalid =
+                        _mm_cmpeq_epi8(_mm_and_si128(_mm_shuffle_epi8(valid, lo), _mm_shuffle_epi8(bits, hi)), _mm_setzero_si128());
+                if (_mm_movemask_epi8(invalid) != 0) break;
+
+                // '/' shares the high nibble with '+'
+                const __m128i slash = _mm_cmpeq_epi8(in, _mm_set1_epi8('/'));
+                const __m128i shift = _mm_or_si128(_mm_andnot_si128(slash, _mm_shuffle_epi8(shifts, hi)),
+                                                   _mm_and_si128(slash, _mm_set1_epi8(16)));
+                const __m128i sextets = _mm_add_epi8(in, shift);
+
+                // Merge the sextets into 24-bit groups and pack them into 12 bytes
+                const __m128i pairs  = _mm_maddubs_epi16(sextets, _mm_set1_epi32(0x01400140));
+                const __m128i groups = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dest.data() + o),
+                                 _mm_shuffle_epi8(groups, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1)));
+            }
+        }
+
+        /// @brief Copy the runs of unreserved characters 16 at a time and escape the rest
+        COSMOSCLIENT_TARGET_SSSE3 static void escapeSsse3(std::string_view src, std::string& dest, size_t& i)
+        {
+            // Unreserved characters by low nibble (row) and high nibble (bit)
+            const __m128i unreserved = _mm_setr_epi8(char(0xa8), char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf8),
+                                                     char(0xf8), char(0xf8), char(0xf8), char(0xf8), char(0xf0), 0x50, 0x50,
+                                                     0x54, char(0xd4), 0x70);
+            const __m128i bits = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, char(0x80), 0, 0, 0, 0, 0, 0, 0, 0);
+
+            for (; i + 16 <= src.size(); i += 16) {
+                const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src.data() + i));
+                const __m128i hi = _mm_and_si128(_mm_srli_epi32(in, 4), _mm_set1_epi8(0x0f));
+                const __m128i lo = _mm_and_si128(in, _mm_set1_epi8(0x0f));
+
+                auto reserved = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                        _mm_and_si128(_mm_shuffle_epi8(unreserved, lo), _mm_shuffle_epi8(bits, hi)), _mm_setzero_si128()));
+                if (reserved == 0) {
+                    dest.append(src.data() + i, 16);
+                }
+                else {
+                    for (size_t j = 0; j < 16; ++j)
+                        escape(src[i + j], dest);
+                }
+            }
+        }
+
+        /// @brief Compare 16 characters per step; stops at the block with the match and leaves the tail for the scalar kernel
+        /// @return true if the character was found at `i`
+        COSMOSCLIENT_TARGET_SSSE3 static bool findSsse3(std::string_view src, char c, size_t& i)
+        {
+            const __m128i needle = _mm_set1_epi8(c);
+
+            for (; i + 16 <= src.size(); i += 16) {
+                const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src.data() + i));
+                if (auto match = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(in, needle))); match != 0) {
+                    i += std::countr_zero(match);
+                    return true;
+                }
+            }
+            return false;
+        }
+#endif
+    };
+#pragma endregion
+
+
 #pragma region CosmosEndpoint
     /// @brief Cosmos Connection String as available in the Azure Portal
     struct CosmosEndpoint
@@ -120,7 +432,7 @@ namespace siddiqsoft
                     // Make sure to strip off the trailing ; if present
                     if (EncodedKey.ends_with(";")) EncodedKey.resize(EncodedKey.length() - 1);
                     // Store the decoded key (only for std::string)
-                    Key = Base64Utils::decode(EncodedKey);
+                    Key = CosmosCodec::base64Decode(EncodedKey);
                 }
             }
 
@@ -341,180 +653,1179 @@ namespace siddiqsoft
 #pragma endregion
 
 
-#pragma region CosmosClient
-    /// @brief The CosmosResponseType contains status code and the json content returned by the server.
-    /// - `uint32_t` - Status Code from the server
-    /// - `nlohmann::json` - Json contents from the server
-    struct CosmosResponseType
+#pragma region CosmosBoundedQueue
+    /// @brief Simple blocking fifo with an upper bound on the number of queued items.
+    /// Producers block when the queue is full and consumers block when the queue is empty. Used by the long-running operations
+    /// such as `exportDocuments` to decouple the readers from the writer without unbounded memory growth.
+    /// @tparam T The item type; must be move constructible
+    template <typename T>
+        requires std::move_constructible<T>
+    class CosmosBoundedQueue
     {
-        /// @brief Status Code from the server
-        uint32_t statusCode {};
+        std::deque<T>           items {};
+        std::mutex              itemsMutex {};
+        std::condition_variable notEmpty {};
+        std::condition_variable notFull {};
+        size_t                  capacity {};
+        bool                    closed {false};
 
-        /// @brief Document from the server
-        nlohmann::json document;
+    public:
+        /// @brief Construct the queue with the given capacity
+        /// @param cap Maximum number of items held before the producers are blocked. Must be at least 1.
+        explicit CosmosBoundedQueue(size_t cap)
+            : capacity(cap < 1 ? 1 : cap)
+        {
+        }
 
-        /// @brief Represents the total time
-        std::chrono::microseconds ttx {};
+        CosmosBoundedQueue(const CosmosBoundedQueue&) = delete;
+        CosmosBoundedQueue& operator=(const CosmosBoundedQueue&) = delete;
 
-        /// @brief Checks if the response is successful based on the HTTP status code
-        /// @return true iff the statusCode < 300
-        bool success() const
+        /// @brief Add an item to the queue; blocks while the queue is full
+        /// @param item The item is moved into the queue
+        /// @return false if the queue has been closed and the item was discarded
+        bool push(T&& item)
         {
-            return statusCode < 300;
+            std::unique_lock<std::mutex> l(itemsMutex);
+            notFull.wait(l, [&]() { return closed || (items.size() < capacity); });
+            if (closed) return false;
+            items.push_back(std::move(item));
+            l.unlock();
+            notEmpty.notify_one();
+            return true;
+        }
+
+        /// @brief Remove the next item from the queue; blocks while the queue is empty and not closed
+        /// @return The next item or empty if the queue has been closed and drained
+        std::optional<T> pop()
+        {
+            std::unique_lock<std::mutex> l(itemsMutex);
+            notEmpty.wait(l, [&]() { return closed || !items.empty(); });
+            if (items.empty()) return std::nullopt;
+            std::optional<T> item {std::move(items.front())};
+            items.pop_front();
+            l.unlock();
+            notFull.notify_one();
+            return item;
+        }
+
+        /// @brief Close the queue. Pending items may still be popped; further pushes are rejected.
+        void close()
+        {
+            {
+                std::unique_lock<std::mutex> l(itemsMutex);
+                closed = true;
+            }
+            notEmpty.notify_all();
+            notFull.notify_all();
         }
     };
+#pragma endregion
 
-    /// @brief Serializer for CosmosResponseType
-    /// @param dest Destination json object
-    /// @param src CosmosResponseType
-    static void to_json(nlohmann::json& dest, CosmosResponseType const& src)
+#pragma region CosmosConcurrencyLimit
+    /// @brief Adaptive limit on the number of in-flight requests using additive-increase/multiplicative-decrease (AIMD).
+    /// Each sample within the latency target grows the limit by `1/limit` while the limit is in use (so the limit grows by about
+    /// one per round trip of a full window) and the limit shrinks by the backoff
+    /// ratio when a sample is throttled, times out or exceeds the latency target. The decrease is applied at most once per
+    /// latency target so a burst of failures from the same window does not collapse the limit.
+    class CosmosConcurrencyLimit
     {
-        dest["statusCode"] = src.statusCode;
-        dest["document"]   = src.document;
-        dest["ttx"]        = src.ttx.count();
-    }
+        mutable std::mutex                    limitMutex {};
+        double                                current {8};
+        size_t                                minimum {1};
+        size_t                                maximum {64};
+        std::chrono::microseconds             latencyTarget {std::chrono::milliseconds(1000)};
+        double                                backoff {0.75};
+        std::chrono::steady_clock::time_point lastDecrease {};
+        size_t                                inflight {0};
+        size_t                                peak {0};
 
-    /// @brief Azure Cosmos Operations
-    enum class CosmosOperation : uint16_t
-    {
-        discoverRegions = 0xA0,
-        listDatabases   = 0xB1,
-        listCollections = 0xB2,
-        listDocuments   = 0xB3,
-        create          = 0xC0,
-        upsert          = 0xC1,
-        update          = 0xC2,
-        remove          = 0xC3,
-        find            = 0xC4,
-        query           = 0xE0,
-        notset          = 0
-    };
+    public:
+        CosmosConcurrencyLimit() = default;
 
-    NLOHMANN_JSON_SERIALIZE_ENUM(CosmosOperation,
-                                 {{CosmosOperation::discoverRegions, "discoverRegions"},
-                                  {CosmosOperation::listDatabases, "listDatabases"},
-                                  {CosmosOperation::listCollections, "listCollections"},
-                                  {CosmosOperation::listDocuments, "listDocuments"},
-                                  {CosmosOperation::create, "create"},
-                                  {CosmosOperation::upsert, "upsert"},
-                                  {CosmosOperation::update, "update"},
-                                  {CosmosOperation::remove, "remove"},
-                                  {CosmosOperation::find, "find"},
-                                  {CosmosOperation::query, "query"},
-                                  {CosmosOperation::notset, nullptr}});
+        CosmosConcurrencyLimit(const CosmosConcurrencyLimit&) = delete;
+        CosmosConcurrencyLimit& operator=(const CosmosConcurrencyLimit&) = delete;
 
+        /// @brief Set the limits; the in-flight count is not affected
+        /// @param initial The starting limit
+        /// @param max The upper bound for the limit
+        /// @param target Samples slower than this are treated as overload
+        /// @param ratio Multiplier applied to the limit on overload (0..1)
+        void configure(size_t initial, size_t max, std::chrono::milliseconds target, double ratio = 0.75)
+        {
+            std::scoped_lock l(limitMutex);
+            maximum       = std::max<size_t>(1, max);
+            current       = static_cast<double>(std::clamp<size_t>(initial, minimum, maximum));
+            latencyTarget = target;
+            backoff       = std::clamp(ratio, 0.1, 0.99);
+        }
 
-    /// @brief Cosmos data extends the nlohmann::json and adds the callback
-    /// @notes The fields may contain the following key-values
-    /// operation:          "discoverRegions", "listDatabases", "listCollections", "listDocuments",
-    ///                     "create", "upsert", "update", "remove", "find",
-    ///                     "query"
-    /// db:                 <database name>
-    /// collection:         <collection name>
-    /// docId:              <unique document id>
-    /// partitionKey:       <parition key value>
-    /// continuationToken   <present on listDocuments, query>
-    /// queryString:        <query string>
-    /// queryParameters     <json array query parameters>
-    /// doc:                <json document contents to create,update,upsert>
-    struct CosmosArgumentType
-    {
-        CosmosOperation operation {};
-        std::string     database {};
-        std::string     collection {};
-        std::string     id {};
-        std::string     partitionKey {};
-        std::string     continuationToken {};
-        std::string     queryStatement {};
-        nlohmann::json  queryParameters;
-        nlohmann::json  document;
-        /// @brief The callback for this request. Invoked with the CosmosResponseType ref
-        /// @note The callback is invoked with this argument and the response to allow propogation and context.
-        std::function<void(CosmosArgumentType const&, CosmosResponseType const&)> onResponse {};
+        /// @brief Take a slot if the in-flight count is below the limit
+        /// @return true if the caller may start the request and must `release` once complete
+        bool tryAcquire()
+        {
+            std::scoped_lock l(limitMutex);
+            if (inflight >= static_cast<size_t>(current)) return false;
+            peak = std::max(peak, ++inflight);
+            return true;
+        }
 
-        NLOHMANN_DEFINE_TYPE_INTRUSIVE(CosmosArgumentType,
-                                       operation,
-                                       database,
-                                       collection,
-                                       id,
-                                       partitionKey,
-                                       continuationToken,
-                                       queryStatement,
-                                       queryParameters,
-                                       document);
-    };
+        /// @brief Return the slot taken by `tryAcquire`
+        void release()
+        {
+            std::scoped_lock l(limitMutex);
+            if (inflight > 0) inflight--;
+        }
 
+        /// @brief Adjust the limit with an observed request
+        /// @param latency The time taken by the request
+        /// @param overloaded True if the request was throttled (429), timed out or the service was unavailable
+        void sample(std::chrono::microseconds latency, bool overloaded)
+        {
+            std::scoped_lock l(limitMutex);
+            if (overloaded || latency > latencyTarget) {
+                auto now = std::chrono::steady_clock::now();
+                if (now - lastDecrease >= latencyTarget) {
+                    current      = std::max(static_cast<double>(minimum), std::floor(current * backoff));
+                    lastDecrease = now;
+                }
+            }
+            else if (inflight * 2 >= static_cast<size_t>(current)) {
+                // Only grow while the limit is in use; otherwise a quiet period inflates it without evidence
+                current = std::min(static_cast<double>(maximum), current + 1.0 / current);
+            }
+        }
 
-    /// @brief Alias to the callback for async operation
-    /// The first parameter is the argument establishing the "context" for this response and the second
-    /// parameter is the response from the requested operation.
-    using CosmosAsyncCallbackType = std::function<void(CosmosArgumentType const&, CosmosResponseType const&)>;
+        /// @brief The current limit
+        size_t limit() const
+        {
+            std::scoped_lock l(limitMutex);
+            return static_cast<size_t>(current);
+        }
 
+        /// @brief The number of requests holding a slot
+        size_t active() const
+        {
+            std::scoped_lock l(limitMutex);
+            return inflight;
+        }
 
-    /// @brief The CosmosIterableResponseType inherits from the CosmosResponseType and includes the continuation token
-    /// - `std::string` - Continuation Token.
-    ///
-    /// @remarks The functions `CosmosClient::find`, `CosmosClient::query` and `CosmosClient::listDocuments` use this return type
-    /// allowing the client to iterate through all of the entries.
-    ///
-    /// *Sample logic for continuation*
-    /// ```cpp
-    /// siddiqsoft::CosmosIterableResponseType irt {};
-    /// // This is your destination container; note that the first element is null in this example
-    /// nlohmann::json                         allDocs = nlohmann::json::array();
-    /// // This is the running count of the total
-    /// uint32_t                               allDocsCount {};
-    /// // First, we query for all items that match our criteria (source=__func__)
-    /// do {
-    ///     irt = cc.query(dbName,
-    ///                    collectionName,
-    ///                    "*",
-    ///                    "SELECT * FROM c WHERE contains(c.source, @v1)",
-    ///                    {{{"name", "@v1"}, {"value", std::format("{}-", getpid())}}},
-    ///                    irt.continuationToken);
-    ///     if (200 == irt.statusCode &&
-    ///         irt.document.contains("Documents") &&
-    ///         !irt.document.at("Documents").is_null())
-    ///     {
-    ///         // Append to the current container
-    ///         allDocs.insert(allDocs.end(),                     // dest
-    ///                        irt.document["Documents"].begin(), // from
-    ///                        irt.document["Documents"].end());
-    ///         allDocsCount += irt.document.value("_count", 0);
-    ///     }
-    /// } while (!irt.continuationToken.empty());
-    /// ```
-    struct CosmosIterableResponseType : CosmosResponseType
-    {
-        /// @brief Continuation token from the server
-        std::string continuationToken;
+        /// @brief The highest number of requests which held a slot at the same time
+        size_t maxActive() const
+        {
+            std::scoped_lock l(limitMutex);
+            return peak;
+        }
     };
+#pragma endregion
 
 
-    /// @brief Serializer for CosmosIterableResponseType uses the serializer for CosmosResponseType
-    /// @param dest Destination json object
-    /// @param src CosmosIterableResponseType
-    static void to_json(nlohmann::json& dest, CosmosIterableResponseType const& src)
+#pragma region CosmosKeyExtractor
+    /// @brief SAX handler which captures the top-level `id` and partition key values of a serialized document without
+    /// building the json object. The whole document is validated so a malformed line is rejected rather than sent.
+    /// String, numeric and boolean partition key values are captured with their type.
+    struct CosmosKeyExtractor : nlohmann::json_sax<nlohmann::json>
     {
-        to_json(dest, CosmosResponseType(src));
-        dest["continuationToken"] = src.continuationToken;
-    }
+        /// @brief Names of the partition key fields; one per level of a hierarchical (`MultiHash`) partition key
+        std::span<const std::string> partitionKeyNames {};
+        /// @brief Captured `id` (empty if absent)
+        std::string id {};
+        /// @brief Captured partition key values for each level (the `x-ms-documentdb-partitionkey` header); null if absent
+        nlohmann::json partitionKey {};
+
+        /// @brief Extract the `id` and partition key values from the given serialized document
+        /// @param line Serialized json document
+        /// @param pkNames The partition key field names (see `CosmosClient::partitionKeyNames`)
+        /// @return The keys if the document is valid and has the `id` and a value for every partition key level
+        static std::optional<CosmosKeyExtractor> extract(std::string_view line, std::span<const std::string> pkNames)
+        {
+            CosmosKeyExtractor kx {};
+            kx.partitionKeyNames = pkNames;
+            kx.partitionKey      = nlohmann::json::array();
+            for (size_t i = 0; i < pkNames.size(); i++) kx.partitionKey.push_back(nullptr);
+            if (pkNames.empty() || !nlohmann::json::sax_parse(line.begin(), line.end(), &kx) || kx.id.empty()) return std::nullopt;
+            for (auto const& value : kx.partitionKey)
+                if (value.is_null()) return std::nullopt;
+            return kx;
+        }
 
+        /// @brief Extract the `id` and the value of the single-level partition key
+        /// @param line Serialized json document
+        /// @param pkName The partition key field name
+        /// @return The keys if the document is valid and has both the `id` and the partition key
+        static std::optional<CosmosKeyExtractor> extract(std::string_view line, std::string const& pkName)
+        {
+            return extract(line, std::span<const std::string> {&pkName, 1});
+        }
 
-    /// @brief Cosmos Client
-    /// Implements a stateful Cosmos Client using Cosmos SQL-API via REST API
-    ///
-    /// @details The client is thread-safe in the operations `create`, `find`, `upsert`, `query` and `remove`. The client should
-    /// maintain a single instance as the underlying restcl uses connection pooling so you do not end up with needless sockets
-    /// connecting to Azure.
-    /// However, care must be taken if you wish to handle `401` and `rotate` the connection as the underlying re-discovery is
-    /// currently not thread-safe.
-    ///
-    /// @see Documentation on the REST API from MS
-    /// https://docs.microsoft.com/en-us/rest/api/cosmos-db/common-tasks-using-the-cosmosdb-rest-api
-    /// @see Samples are here: https://docs.microsoft.com/en-us/azure/cosmos-db/sql-api-cpp-get-started
-    /// @see Documentation is here: https://docs.microsoft.com/en-us/rest/api/documentdb/documentdb-resource-uri-syntax-for-rest
-    class CosmosClient
+        bool null() override { return value(nullptr); }
+        bool boolean(bool val) override { return value(val); }
+        bool number_integer(number_integer_t val) override { return value(val); }
+        bool number_unsigned(number_unsigned_t val) override { return value(val); }
+        bool number_float(number_float_t val, const string_t&) override { return value(val); }
+        bool string(string_t& val) override
+        {
+            if (depth == 1 && currentKey == "id") id = val;
+            return value(std::move(val));
+        }
+        bool binary(binary_t&) override { return value(nullptr); }
+        bool start_object(std::size_t) override { return ++depth, true; }
+        bool end_object() override { return --depth, true; }
+        bool start_array(std::size_t) override { return ++depth, true; }
+        bool end_array() override { return --depth, true; }
+        bool key(string_t& val) override
+        {
+            currentKey = (depth == 1) ? val : string_t {};
+            return true;
+        }
+        bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&) override { return false; }
+
+    private:
+        uint32_t depth {};
+        string_t currentKey {};
+
+        /// @brief Record the value for the current key if it names a partition key level
+        bool value(nlohmann::json&& val)
+        {
+            if (depth == 1 && !currentKey.empty()) {
+                for (size_t i = 0; i < partitionKeyNames.size(); i++)
+                    if (currentKey == partitionKeyNames[i]) partitionKey[i] = std::move(val);
+                currentKey.clear();
+            }
+            return true;
+        }
+    };
+#pragma endregion
+
+
+#pragma region CosmosTransport
+    /// @brief The REST client and the async executor shared by one or more CosmosClient instances.
+    /// Clients constructed on the same transport share the WinHTTP session (and therefore its connection pool) and the worker
+    /// threads so connections and threads scale with the hosts rather than with the number of client objects.
+    /// @remarks Create with `CosmosClient::makeTransport` and pass to the CosmosClient constructor. The transport is reference
+    /// counted and lives as long as any client (or the caller) holds it.
+    class CosmosTransport
+    {
+    public:
+        /// @brief The REST client; `send` may be invoked from multiple threads
+        WinHttpRESTClient restClient;
+
+        /// @brief Executes the queued tasks of every client using this transport
+        simple_pool<std::function<void()>> executor;
+
+        /// @brief Construct the transport
+        /// @param userAgent The User-Agent header for every request
+        /// @param threads Number of worker threads; 0 uses the pool default
+        CosmosTransport(std::string const& userAgent, size_t threads = 0)
+            : restClient(userAgent)
+            , executor([](std::function<void()>&& task) { task(); }, threads)
+        {
+        }
+
+        CosmosTransport(const CosmosTransport&) = delete;
+        CosmosTransport& operator=(const CosmosTransport&) = delete;
+    };
+#pragma endregion
+
+
+#pragma region CosmosLruCache
+    /// @brief Thread-safe least-recently-used cache where every entry expires after its time-to-live.
+    /// Used by the opt-in lookup caches of the CosmosClient. The lookup does not allocate when the key type does not allocate.
+    /// @tparam K The key type
+    /// @tparam V The value type; returned by copy so prefer small values such as `std::shared_ptr`
+    /// @tparam Hash The hash for the key
+    template <typename K, typename V, typename Hash = std::hash<K>>
+    class CosmosLruCache
+    {
+        using Clock = std::chrono::steady_clock;
+
+        struct Entry
+        {
+            K                 key;
+            V                 value;
+            Clock::time_point expires;
+        };
+
+        /// @brief The most recently used entry is at the front
+        std::list<Entry>                                                 items {};
+        std::unordered_map<K, typename std::list<Entry>::iterator, Hash> index {};
+        mutable std::mutex                                               itemsMutex {};
+        size_t                                                           capacity {};
+
+        /// @brief Remove the least recently used entries beyond the capacity; caller must hold the lock
+        void trim()
+        {
+            while (items.size() > capacity) {
+                index.erase(items.back().key);
+                items.pop_back();
+            }
+        }
+
+    public:
+        /// @brief Construct the cache
+        /// @param cap The maximum number of entries. Must be at least 1.
+        explicit CosmosLruCache(size_t cap = 1024)
+            : capacity(cap < 1 ? 1 : cap)
+        {
+        }
+
+        CosmosLruCache(const CosmosLruCache&) = delete;
+        CosmosLruCache& operator=(const CosmosLruCache&) = delete;
+
+        /// @brief Change the maximum number of entries; the least recently used entries are evicted
+        /// @param cap The maximum number of entries. Must be at least 1.
+        void setCapacity(size_t cap)
+        {
+            std::scoped_lock l(itemsMutex);
+            capacity = cap < 1 ? 1 : cap;
+            trim();
+        }
+
+        /// @brief Lookup the key
+        /// @param key The key
+        /// @return The value if present and not expired
+        std::optional<V> get(K const& key)
+        {
+            std::scoped_lock l(itemsMutex);
+            if (auto item = index.find(key); item != index.end()) {
+                if (item->second->expires > Clock::now()) {
+                    items.splice(items.begin(), items, item->second);
+                    return item->second->value;
+                }
+                items.erase(item->second);
+                index.erase(item);
+            }
+            return std::nullopt;
+        }
+
+        /// @brief Add or replace the entry
+        /// @param key The key
+        /// @param value The value
+        /// @param ttl The time-to-live for the entry
+        void put(K const& key, V value, Clock::duration ttl)
+        {
+            std::scoped_lock l(itemsMutex);
+            if (auto item = index.find(key); item != index.end()) {
+                item->second->value   = std::move(value);
+                item->second->expires = Clock::now() + ttl;
+                items.splice(items.begin(), items, item->second);
+                return;
+            }
+            items.emplace_front(Entry {key, std::move(value), Clock::now() + ttl});
+            index.emplace(key, items.begin());
+            trim();
+        }
+
+        /// @brief Remove the entry
+        /// @param key The key
+        /// @return true if the entry was present
+        bool erase(K const& key)
+        {
+            std::scoped_lock l(itemsMutex);
+            if (auto item = index.find(key); item != index.end()) {
+                items.erase(item->second);
+                index.erase(item);
+                return true;
+            }
+            return false;
+        }
+
+        /// @brief Remove the entries matching the predicate
+        /// @param pred Invoked with the key and the value; return true to remove the entry
+        /// @return The number of entries removed
+        template <typename Pred>
+        size_t eraseIf(Pred&& pred)
+        {
+            std::scoped_lock l(itemsMutex);
+            size_t           removed = 0;
+            for (auto item = items.begin(); item != items.end();) {
+                if (pred(item->key, item->value)) {
+                    index.erase(item->key);
+                    item = items.erase(item);
+                    removed++;
+                }
+                else {
+                    ++item;
+                }
+            }
+            return removed;
+        }
+
+        /// @brief Remove all of the entries
+        void clear()
+        {
+            std::scoped_lock l(itemsMutex);
+            index.clear();
+            items.clear();
+        }
+
+        /// @brief The number of entries (including the expired entries not yet evicted)
+        size_t size() const
+        {
+            std::scoped_lock l(itemsMutex);
+            return items.size();
+        }
+    };
+
+
+    /// @brief Lock-free Bloom filter used as the pre-check for the negative lookup cache.
+    /// A negative answer is definite so most lookups for keys which were never cached avoid the cache lock. Keys cannot be
+    /// removed; the owner clears the filter once it has seen more keys than `capacity()` to bound the false positive rate.
+    class CosmosBloomFilter
+    {
+        static constexpr size_t Probes {3};
+
+        std::vector<std::atomic_uint64_t> bits;
+
+        /// @brief Visit the bit positions for the key (double hashing)
+        /// @param bits The bit vector; const for the lookups and mutable for the additions
+        template <typename Bits, typename F>
+        static void probe(Bits& bits, std::string_view key, F&& f)
+        {
+            uint64_t h1 = std::hash<std::string_view> {}(key);
+            // The step comes from the high bits of the product; the low bits only depend on the low bits of the hash
+            uint64_t h2 = ((h1 * 0x9E3779B97F4A7C15ull) >> 32) | 1;
+            for (size_t i = 0; i < Probes; i++) {
+                auto bit = (h1 + i * h2) % (bits.size() * 64);
+                f(bits[bit / 64], uint64_t(1) << (bit % 64));
+            }
+        }
+
+    public:
+        /// @brief Construct the filter
+        /// @param nbits The number of bits; rounded up to a multiple of 64
+        explicit CosmosBloomFilter(size_t nbits = 64 * 1024)
+            : bits((std::max<size_t>(nbits, 64) + 63) / 64)
+        {
+        }
+
+        /// @brief The number of keys the filter holds with about 1% false positives (12.5 bits per key with 3 probes)
+        size_t capacity() const { return bits.size() * 64 * 2 / 25; }
+
+        /// @brief Add the key
+        void add(std::string_view key)
+        {
+            probe(bits, key, [](auto& word, uint64_t mask) { word.fetch_or(mask, std::memory_order_relaxed); });
+        }
+
+        /// @brief Check for the key
+        /// @return false if the key was never added (since the last clear); true if it may have been added
+        bool mayContain(std::string_view key) const
+        {
+            bool found = true;
+            probe(bits, key, [&found](auto& word, uint64_t mask) { found = found && (word.load(std::memory_order_relaxed) & mask); });
+            return found;
+        }
+
+        /// @brief Remove all of the keys
+        void clear()
+        {
+            for (auto& word : bits) word.store(0, std::memory_order_relaxed);
+        }
+    };
+#pragma endregion
+
+
+    /// @brief The response headers with lazy typed accessors for the Cosmos headers.
+    /// The headers object is moved from the transport response (not copied) and the accessors return views into it or decode
+    /// the value when invoked; nothing is parsed for the headers which are not used.
+    struct CosmosResponseHeaders
+    {
+        /// @brief The headers as received (names to string values)
+        nlohmann::json fields {};
+
+        CosmosResponseHeaders() = default;
+
+        /// @brief Take the headers object of the transport response
+        /// @param src The headers; explicit so the positional initialization of the derived responses cannot assign a
+        /// continuation token here by mistake
+        explicit CosmosResponseHeaders(nlohmann::json&& src)
+            : fields(std::move(src))
+        {
+        }
+
+        /// @brief The raw value of the header
+        /// @param name Header name (case sensitive; as sent by Cosmos)
+        /// @return View of the value (valid while this object is alive and unmodified) or empty if absent
+        std::string_view value(std::string_view name) const
+        {
+            if (auto item = find(fields, name); item && item->is_string()) return item->get_ref<const std::string&>();
+            return {};
+        }
+
+        /// @brief The numeric value of the header
+        /// @param name Header name
+        /// @return The value or 0 if absent
+        double number(std::string_view name) const
+        {
+            return number(fields, name);
+        }
+
+        /// @brief Find a header without allocating a key (the header objects are small)
+        static const nlohmann::json* find(nlohmann::json const& headers, std::string_view name)
+        {
+            if (headers.is_object()) {
+                for (auto item = headers.begin(); item != headers.end(); ++item) {
+                    if (item.key() == name) return &item.value();
+                }
+            }
+            return nullptr;
+        }
+
+        /// @brief The numeric value of the header from a headers object
+        static double number(nlohmann::json const& headers, std::string_view name)
+        {
+            if (auto item = find(headers, name)) {
+                if (item->is_number()) return item->get<double>();
+                if (item->is_string()) return std::strtod(item->get_ref<const std::string&>().c_str(), nullptr);
+            }
+            return 0;
+        }
+
+        /// @brief The `x-ms-continuation` (moved to the `continuationToken` of the iterable responses)
+        std::string_view continuation() const { return value("x-ms-continuation"); }
+
+        /// @brief The `x-ms-activity-id` identifying the request to Azure support
+        std::string_view activityId() const { return value("x-ms-activity-id"); }
+
+        /// @brief The `x-ms-session-token`
+        std::string_view sessionToken() const { return value("x-ms-session-token"); }
+
+        /// @brief The request units consumed (`x-ms-request-charge`)
+        double requestCharge() const { return number("x-ms-request-charge"); }
+
+        /// @brief The `x-ms-substatus` qualifying the status code
+        uint32_t substatus() const { return static_cast<uint32_t>(number("x-ms-substatus")); }
+
+        /// @brief The back-off requested with a 429 (`x-ms-retry-after-ms`)
+        std::chrono::milliseconds retryAfter() const
+        {
+            return std::chrono::milliseconds(static_cast<int64_t>(number("x-ms-retry-after-ms")));
+        }
+
+        /// @brief The number of items in a page (`x-ms-item-count`)
+        int64_t itemCount() const { return static_cast<int64_t>(number("x-ms-item-count")); }
+
+        /// @brief The size of the response body (`Content-Length`)
+        int64_t contentLength() const { return static_cast<int64_t>(number("Content-Length")); }
+
+        /// @brief The integrated cache result (`x-ms-cosmos-cachehit`) of a read through a dedicated gateway
+        /// @return true for a hit (no request units charged), false for a miss; empty if not served by a dedicated gateway
+        std::optional<bool> cacheHit() const { return cacheHit(fields); }
+
+        /// @brief The integrated cache result from a headers object
+        static std::optional<bool> cacheHit(nlohmann::json const& headers)
+        {
+            if (auto item = find(headers, "x-ms-cosmos-cachehit"); item && item->is_string() && !item->get_ref<const std::string&>().empty())
+                return std::tolower(static_cast<unsigned char>(item->get_ref<const std::string&>().front())) == 't';
+            return std::nullopt;
+        }
+    };
+
+
+    /// @brief The error details of a failed response.
+    /// A view of the response (valid while the response is alive); constructing it copies nothing.
+    struct CosmosErrorType
+    {
+        /// @brief HTTP status code or the WinHTTP error code
+        uint32_t statusCode {};
+
+        /// @brief The `x-ms-substatus` qualifying the status code (for example 3200 with a 429 for request rate too large)
+        uint32_t substatus {};
+
+        /// @brief The back-off requested by the service (`x-ms-retry-after-ms`)
+        std::chrono::milliseconds retryAfter {};
+
+        /// @brief The `x-ms-activity-id` identifying the request to Azure support
+        std::string_view activityId {};
+
+        /// @brief The error message from the Cosmos error body
+        std::string_view message {};
+    };
+
+
+#pragma region CosmosClient
+    /// @brief The CosmosResponseType contains status code and the json content returned by the server.
+    /// - `uint32_t` - Status Code from the server
+    /// - `nlohmann::json` - Json contents from the server
+    struct CosmosResponseType
+    {
+        /// @brief Status Code from the server
+        uint32_t statusCode {};
+
+        /// @brief Document from the server
+        nlohmann::json document;
+
+        /// @brief Represents the total time
+        std::chrono::microseconds ttx {};
+
+        /// @brief The response headers (empty for responses which are not from a single request)
+        CosmosResponseHeaders headers {};
+
+        /// @brief Checks if the response is successful based on the HTTP status code
+        /// @return true iff the statusCode < 300
+        bool success() const
+        {
+            return statusCode < 300;
+        }
+
+        /// @brief The error details decoded from the headers and the error body
+        /// @return The error; only the statusCode is set for a successful response
+        CosmosErrorType error() const
+        {
+            if (success()) return {statusCode};
+
+            std::string_view message {};
+            if (document.is_object()) {
+                if (auto item = document.find("message"); item != document.end() && item->is_string())
+                    message = item->get_ref<const std::string&>();
+            }
+            return {statusCode, headers.substatus(), headers.retryAfter(), headers.activityId(), message};
+        }
+    };
+
+    /// @brief Serializer for CosmosResponseType
+    /// @param dest Destination json object
+    /// @param src CosmosResponseType
+    static void to_json(nlohmann::json& dest, CosmosResponseType const& src)
+    {
+        dest["statusCode"] = src.statusCode;
+        dest["document"]   = src.document;
+        dest["ttx"]        = src.ttx.count();
+    }
+
+    /// @brief Azure Cosmos Operations
+    enum class CosmosOperation : uint16_t
+    {
+        discoverRegions = 0xA0,
+        listDatabases   = 0xB1,
+        listCollections = 0xB2,
+        listDocuments   = 0xB3,
+        create          = 0xC0,
+        upsert          = 0xC1,
+        update          = 0xC2,
+        remove          = 0xC3,
+        find            = 0xC4,
+        execute         = 0xD0,
+        query           = 0xE0,
+        notset          = 0
+    };
+
+    NLOHMANN_JSON_SERIALIZE_ENUM(CosmosOperation,
+                                 {{CosmosOperation::discoverRegions, "discoverRegions"},
+                                  {CosmosOperation::listDatabases, "listDatabases"},
+                                  {CosmosOperation::listCollections, "listCollections"},
+                                  {CosmosOperation::listDocuments, "listDocuments"},
+                                  {CosmosOperation::create, "create"},
+                                  {CosmosOperation::upsert, "upsert"},
+                                  {CosmosOperation::update, "update"},
+                                  {CosmosOperation::remove, "remove"},
+                                  {CosmosOperation::find, "find"},
+                                  {CosmosOperation::execute, "execute"},
+                                  {CosmosOperation::query, "query"},
+                                  {CosmosOperation::notset, nullptr}});
+
+
+    /// @brief How `CosmosClient::shutdown` treats the queued async requests
+    enum class CosmosShutdownMode : uint16_t
+    {
+        drain  = 0, // Queued requests and the pending continuation pages complete
+        cancel = 1  // Queued requests and the continuation pages not yet started are dropped
+    };
+
+    NLOHMANN_JSON_SERIALIZE_ENUM(CosmosShutdownMode, {{CosmosShutdownMode::drain, "drain"}, {CosmosShutdownMode::cancel, "cancel"}});
+
+
+    /// @brief Consistency level for the reads (`x-ms-consistency-level`); ordered from the weakest to the strongest.
+    /// A request may only relax the account's default consistency.
+    /// https://docs.microsoft.com/en-us/azure/cosmos-db/consistency-levels
+    enum class CosmosConsistencyLevel : uint16_t
+    {
+        account          = 0, // The account's default consistency (the header is not sent)
+        eventual         = 1,
+        consistentPrefix = 2,
+        session          = 3,
+        boundedStaleness = 4,
+        strong           = 5
+    };
+
+    NLOHMANN_JSON_SERIALIZE_ENUM(CosmosConsistencyLevel,
+                                 {{CosmosConsistencyLevel::account, nullptr},
+                                  {CosmosConsistencyLevel::eventual, "Eventual"},
+                                  {CosmosConsistencyLevel::consistentPrefix, "ConsistentPrefix"},
+                                  {CosmosConsistencyLevel::session, "Session"},
+                                  {CosmosConsistencyLevel::boundedStaleness, "BoundedStaleness"},
+                                  {CosmosConsistencyLevel::strong, "Strong"}});
+
+
+    /// @brief Prepared query holds the statement, its parameter slots and the partition targeting so that repeated executions
+    /// only bind the parameter values instead of rebuilding the query body and headers.
+    ///
+    /// @remarks Bind all of the parameters before handing the instance to `queryDocuments` or `async` (via
+    /// `CosmosArgumentType::preparedQuery`). Do not re-bind while a request, including its continuation pages, is in flight; use
+    /// one instance per thread.
+    ///
+    /// *Sample*
+    /// ```cpp
+    /// auto pq = std::make_shared<siddiqsoft::CosmosPreparedQuery>("SELECT * FROM c WHERE c.source=@v1",
+    ///                                                             std::vector<std::string> {"@v1"},
+    ///                                                             "odd.siddiqsoft.com");
+    /// pq->bind("@v1", sourceId);
+    /// auto irt = cc.queryDocuments({.database = dbName, .collection = collectionName, .preparedQuery = pq});
+    /// ```
+    class CosmosPreparedQuery
+    {
+        /// @brief The query body sent to Cosmos: `{"query": "...", "parameters": [{"name": "@v1", "value": ...}]}`
+        /// Shared with the requests in flight and the cached results; `bind` replaces it while it is shared (copy-on-write)
+        std::shared_ptr<nlohmann::json> body {};
+        /// @brief The query headers including the partition targeting (excludes the date and authorization); immutable once
+        /// prepared
+        std::shared_ptr<nlohmann::json> targetHeaders {
+                std::make_shared<nlohmann::json>(nlohmann::json {{"x-ms-max-item-count", -1}, // -1: Let Cosmos figure out item count
+                                                                 {"x-ms-documentdb-isquery", "true"},
+                                                                 {"Content-Type", "application/query+json"}})};
+        /// @brief Maps the parameter name to its index within the body's parameters array
+        std::unordered_map<std::string, size_t> slots {};
+
+    public:
+        /// @brief Prepare the query
+        /// @param statement The SQL API query string
+        /// @param parameterNames The names of the parameters in the statement (for example `@v1`)
+        /// @param partitionKey The partition key value or `*` for cross-partition query
+        CosmosPreparedQuery(std::string const&              statement,
+                            std::vector<std::string> const& parameterNames = {},
+                            std::string const&              partitionKey   = "*")
+        {
+            if (statement.empty()) throw std::invalid_argument("Missing queryStatement");
+
+            body = std::make_shared<nlohmann::json>(nlohmann::json {{"query", statement}});
+            if (!parameterNames.empty()) {
+                auto& params = (*body)["parameters"] = nlohmann::json::array();
+                for (auto& name : parameterNames) {
+                    slots.emplace(name, params.size());
+                    params.push_back({{"name", name}, {"value", nullptr}});
+                }
+            }
+
+            applyPartitionKey(*targetHeaders, partitionKey);
+        }
+
+        /// @brief Prepare the query against a hierarchical partition key
+        /// @param statement The SQL API query string
+        /// @param parameterNames The names of the parameters in the statement (for example `@v1`)
+        /// @param partitionKeys The partition key values (from the top level); may be a prefix of the levels
+        CosmosPreparedQuery(std::string const&              statement,
+                            std::vector<std::string> const& parameterNames,
+                            std::vector<std::string> const& partitionKeys)
+            : CosmosPreparedQuery(statement, parameterNames, std::string {})
+        {
+            applyPartitionKey(*targetHeaders, partitionKeys);
+        }
+
+        /// @brief Bind the value for the given parameter
+        /// @tparam T Any type convertible to json
+        /// @param name The parameter name as given in the constructor
+        /// @param value The value for the parameter
+        /// @return Self
+        template <typename T>
+        CosmosPreparedQuery& bind(std::string const& name, T&& value)
+        {
+            if (auto slot = slots.find(name); slot != slots.end()) {
+                // The previous body may still be in use by a request or a cached result
+                if (body.use_count() > 1) body = std::make_shared<nlohmann::json>(*body);
+                (*body)["parameters"][slot->second]["value"] = std::forward<T>(value);
+                return *this;
+            }
+            throw std::invalid_argument(std::format("Unknown query parameter {}", name));
+        }
+
+        /// @brief The query body
+        nlohmann::json const& content() const
+        {
+            return *body;
+        }
+
+        /// @brief The query body with the values bound so far; unaffected by later calls to `bind`
+        std::shared_ptr<const nlohmann::json> sharedContent() const
+        {
+            return body;
+        }
+
+        /// @brief The query headers including the partition targeting
+        nlohmann::json const& headers() const
+        {
+            return *targetHeaders;
+        }
+
+        /// @brief The query headers including the partition targeting; shared rather than copied
+        std::shared_ptr<const nlohmann::json> sharedHeaders() const
+        {
+            return targetHeaders;
+        }
+
+        /// @brief The SQL API query string
+        std::string const& statement() const
+        {
+            return (*body)["query"].get_ref<const std::string&>();
+        }
+
+        /// @brief Add the partition targeting headers for the given partition key value
+        /// @param headers Destination headers
+        /// @param partitionKey The partition key value or `*` for cross-partition query
+        static void applyPartitionKey(nlohmann::json& headers, std::string const& partitionKey)
+        {
+            if (partitionKey.starts_with("*")) {
+                // Special case query with partitioned data set.
+                headers["x-ms-documentdb-query-enablecrosspartition"] = "true";
+                // This is required if the client does not provide partitionkey
+                headers["x-ms-query-enable-crosspartition"] = "true";
+            }
+            else if (!partitionKey.empty()) {
+                // Specific partition set by client.
+                headers["x-ms-documentdb-partitionkey"] = nlohmann::json {partitionKey};
+            }
+        }
+
+        /// @brief Add the partition targeting headers for the given hierarchical partition key values
+        /// @param headers Destination headers
+        /// @param partitionKeys The partition key values from the top level; a prefix targets every partition under the prefix
+        static void applyPartitionKey(nlohmann::json& headers, std::vector<std::string> const& partitionKeys)
+        {
+            if (partitionKeys.empty()) return;
+            headers["x-ms-documentdb-partitionkey"] = partitionKeys;
+            // A prefix of the levels may span several partitions; the service limits the query to the matching ranges
+            headers["x-ms-documentdb-query-enablecrosspartition"] = "true";
+            headers["x-ms-query-enable-crosspartition"]           = "true";
+        }
+    };
+
+
+    /// @brief Cosmos data extends the nlohmann::json and adds the callback
+    /// @notes The fields may contain the following key-values
+    /// operation:          "discoverRegions", "listDatabases", "listCollections", "listDocuments",
+    ///                     "create", "upsert", "update", "remove", "find",
+    ///                     "query"
+    /// db:                 <database name>
+    /// collection:         <collection name>
+    /// docId:              <unique document id>
+    /// partitionKey:       <parition key value>
+    /// continuationToken   <present on listDocuments, query>
+    /// queryString:        <query string>
+    /// queryParameters     <json array query parameters>
+    /// doc:                <json document contents to create,update,upsert>
+    /// partitionKeyRangeId <optional partition key range for listDocuments>
+    /// preparedQuery       <optional prepared query; replaces the queryStatement and queryParameters>
+    /// maxItemCount        <optional page size for listDocuments, query; 0 uses the server default>
+    /// adaptivePageSize    <optional; grow the page size from the observed document size and response time>
+    /// continuationTokenLimitInKb <optional limit for the query continuation token size; 0 uses the configuration>
+    /// partitionKeys       <optional hierarchical partition key values; replaces the partitionKey>
+    /// consistencyLevel    <optional consistency for find, query; relaxes the account consistency; account uses the configuration>
+    /// maxIntegratedCacheStalenessInMs <optional staleness accepted from the integrated cache for find, query; 0 uses the configuration>
+    /// bypassIntegratedCache <optional; find, query are served by the backend instead of the integrated cache>
+    struct CosmosArgumentType
+    {
+        CosmosOperation operation {};
+        std::string     database {};
+        std::string     collection {};
+        std::string     id {};
+        std::string     partitionKey {};
+        std::string     continuationToken {};
+        std::string     queryStatement {};
+        nlohmann::json  queryParameters;
+        nlohmann::json  document;
+        std::string     partitionKeyRangeId {};
+        std::shared_ptr<CosmosPreparedQuery> preparedQuery {};
+        int32_t                              maxItemCount {};
+        bool                                 adaptivePageSize {false};
+        uint16_t                             continuationTokenLimitInKb {};
+        std::vector<std::string>             partitionKeys {};
+        CosmosConsistencyLevel               consistencyLevel {};
+        int32_t                              maxIntegratedCacheStalenessInMs {};
+        bool                                 bypassIntegratedCache {false};
+        /// @brief The callback for this request. Invoked with the CosmosResponseType ref
+        /// @note The callback is invoked with this argument and the response to allow propogation and context.
+        std::function<void(CosmosArgumentType const&, CosmosResponseType const&)> onResponse {};
+
+        NLOHMANN_DEFINE_TYPE_INTRUSIVE(CosmosArgumentType,
+                                       operation,
+                                       database,
+                                       collection,
+                                       id,
+                                       partitionKey,
+                                       continuationToken,
+                                       queryStatement,
+                                       queryParameters,
+                                       document,
+                                       partitionKeyRangeId,
+                                       maxItemCount,
+                                       adaptivePageSize,
+                                       continuationTokenLimitInKb,
+                                       partitionKeys,
+                                       consistencyLevel,
+                                       maxIntegratedCacheStalenessInMs,
+                                       bypassIntegratedCache);
+    };
+
+
+    /// @brief Alias to the callback for async operation
+    /// The first parameter is the argument establishing the "context" for this response and the second
+    /// parameter is the response from the requested operation.
+    using CosmosAsyncCallbackType = std::function<void(CosmosArgumentType const&, CosmosResponseType const&)>;
+
+    /// @brief Alias to an executor for the async callbacks; invoked with the task delivering a response to its callback
+    using CosmosCompletionExecutor = std::function<void(std::function<void()>&&)>;
+
+
+    /// @brief The CosmosIterableResponseType inherits from the CosmosResponseType and includes the continuation token
+    /// - `std::string` - Continuation Token.
+    ///
+    /// @remarks The functions `CosmosClient::find`, `CosmosClient::query` and `CosmosClient::listDocuments` use this return type
+    /// allowing the client to iterate through all of the entries.
+    ///
+    /// *Sample logic for continuation*
+    /// ```cpp
+    /// siddiqsoft::CosmosIterableResponseType irt {};
+    /// // This is your destination container; note that the first element is null in this example
+    /// nlohmann::json                         allDocs = nlohmann::json::array();
+    /// // This is the running count of the total
+    /// uint32_t                               allDocsCount {};
+    /// // First, we query for all items that match our criteria (source=__func__)
+    /// do {
+    ///     irt = cc.query(dbName,
+    ///                    collectionName,
+    ///                    "*",
+    ///                    "SELECT * FROM c WHERE contains(c.source, @v1)",
+    ///                    {{{"name", "@v1"}, {"value", std::format("{}-", getpid())}}},
+    ///                    irt.continuationToken);
+    ///     if (200 == irt.statusCode &&
+    ///         irt.document.contains("Documents") &&
+    ///         !irt.document.at("Documents").is_null())
+    ///     {
+    ///         // Append to the current container
+    ///         allDocs.insert(allDocs.end(),                     // dest
+    ///                        irt.document["Documents"].begin(), // from
+    ///                        irt.document["Documents"].end());
+    ///         allDocsCount += irt.document.value("_count", 0);
+    ///     }
+    /// } while (!irt.continuationToken.empty());
+    /// ```
+    struct CosmosIterableResponseType : CosmosResponseType
+    {
+        /// @brief Continuation token from the server
+        std::string continuationToken;
+
+        /// @brief Page size to use for the next page (the `maxItemCount` argument). When the request asked for the adaptive page
+        /// size this is the recommended size based on this page; otherwise it echoes the requested page size.
+        int32_t maxItemCount {};
+    };
+
+
+    /// @brief Serializer for CosmosIterableResponseType uses the serializer for CosmosResponseType
+    /// @param dest Destination json object
+    /// @param src CosmosIterableResponseType
+    static void to_json(nlohmann::json& dest, CosmosIterableResponseType const& src)
+    {
+        to_json(dest, CosmosResponseType(src));
+        dest["continuationToken"] = src.continuationToken;
+        dest["maxItemCount"]      = src.maxItemCount;
+    }
+
+
+    /// @brief The CosmosStoredProcedureResponseType inherits from the CosmosResponseType and includes the request charge
+    /// - `double` - Request units consumed (the `x-ms-request-charge`); summed over every invocation of a continued execution.
+    ///
+    /// @remarks The `document` is the value returned by the stored procedure (via `getContext().getResponse().setBody()`).
+    /// The async callback for `CosmosOperation::execute` receives this type and may `static_cast` the response to access the
+    /// request charge.
+    struct CosmosStoredProcedureResponseType : CosmosResponseType
+    {
+        /// @brief Request units consumed by the execution
+        double requestCharge {};
+
+        /// @brief Convert the stored procedure's result to the given type
+        /// @tparam T Any type supported by nlohmann::json (including types with `from_json`)
+        /// @return The result; throws `nlohmann::json::exception` if the result does not convert
+        template <typename T>
+        T result() const
+        {
+            return document.get<T>();
+        }
+    };
+
+
+    /// @brief Serializer for CosmosStoredProcedureResponseType uses the serializer for CosmosResponseType
+    /// @param dest Destination json object
+    /// @param src CosmosStoredProcedureResponseType
+    static void to_json(nlohmann::json& dest, CosmosStoredProcedureResponseType const& src)
+    {
+        to_json(dest, CosmosResponseType(src));
+        dest["requestCharge"] = src.requestCharge;
+    }
+
+
+    /// @brief The response of a completed async request; holds the type produced by the operation so the list and query pages
+    /// keep their continuation token and the stored procedures their request charge. Every alternative is a CosmosResponseType.
+    using CosmosCompletionResponseType =
+            std::variant<CosmosResponseType, CosmosIterableResponseType, CosmosStoredProcedureResponseType>;
+
+    /// @brief A completed async request and its response as delivered to the batch handler
+    using CosmosCompletionType = std::pair<CosmosArgumentType, CosmosCompletionResponseType>;
+
+    /// @brief Alias to the handler for batched async completions (see `CosmosClient::setBatchHandler`)
+    using CosmosBatchCallbackType = std::function<void(std::span<const CosmosCompletionType>)>;
+
+
+    /// @brief Lazy input range over the documents of a query or list operation.
+    /// A background prefetcher requests the pages (following the continuation token) into a bounded buffer while the caller
+    /// consumes the documents of the current page. The range may be used with range-for and the `std::views` adaptors.
+    /// The range is single-pass: invoke `begin()` once.
+    ///
+    /// ```cpp
+    /// for (auto& doc : cc.documents({.database = dbName, .collection = collectionName}) | std::views::take(100)) {
+    ///     std::cout << doc.value("id", "") << std::endl;
+    /// }
+    /// ```
+    class CosmosDocumentRange
+    {
+        /// @brief Shared between the range, its iterator and the prefetcher
+        struct State
+        {
+            std::function<CosmosIterableResponseType(CosmosArgumentType const&)> fetch {};
+            CosmosArgumentType                                                   request {};
+            CosmosBoundedQueue<CosmosIterableResponseType>                       pages;
+            CosmosResponseType                                                   status {200, nullptr};
+            std::exception_ptr                                                   failure {};
+            std::jthread                                                         prefetcher {};
+
+            State(std::function<CosmosIterableResponseType(CosmosArgumentType const&)>&& f, CosmosArgumentType const& ctx, size_t depth)
+                : fetch(std::move(f))
+                , request(ctx)
+                , pages(depth)
+            {
+            }
+
+            /// @brief Unblocks the prefetcher which is then joined
+            ~State() { pages.close(); }
+
+            /// @brief The prefetcher loop; stops at the last page, on the first failed page or when the range is destroyed
+            void prefetch(std::stop_token st)
+            {
+                try {
+                    while (!st.stop_requested()) {
+                        auto resp = fetch(request);
+                        auto more = resp.success() && !resp.continuationToken.empty();
+                        request.continuationToken = std::move(resp.continuationToken);
+                        request.maxItemCount      = resp.maxItemCount;
+                        if (!pages.push(std::move(resp)) || !more) break;
+                    }
+                }
+                catch (...) {
+                    failure = std::current_exception();
+                }
+                pages.close();
+            }
+        };
+
+        std::unique_ptr<State> state {};
+
+    public:
+        /// @brief Iterator over the documents; each page's `Documents` are yielded in order
+        class iterator
+        {
+            State*                          state {};
+            std::shared_ptr<nlohmann::json> documents {};
+            size_t                          index {};
+
+            /// @brief Advance to the next available document waiting for the next page when the current page is consumed
+            void next()
+            {
+                while (state) {
+                    if (documents && index < documents->size()) return;
+
+                    auto page = state->pages.pop();
+                    if (!page) {
+                        auto failure = state->failure;
+                        state        = nullptr;
+                        if (failure) std::rethrow_exception(failure);
+                        return;
+                    }
+                    if (!page->success()) {
+                        state->status = {page->statusCode, std::move(page->document), page->ttx};
+                        state         = nullptr;
+                        return;
+                    }
+                    documents = std::make_shared<nlohmann::json>(std::move(page->document["Documents"]));
+                    index     = 0;
+                }
+            }
+
+        public:
+            using iterator_concept = std::input_iterator_tag;
+            using value_type       = nlohmann::json;
+            using difference_type  = std::ptrdiff_t;
+
+            iterator() = default;
+            explicit iterator(State* s)
+                : state(s)
+            {
+                next();
+            }
+
+            iterator(iterator&&)            = default;
+            iterator& operator=(iterator&&) = default;
+
+            nlohmann::json& operator*() const { return (*documents)[index]; }
+
+            iterator& operator++()
+            {
+                ++index;
+                next();
+                return *this;
+            }
+
+            void operator++(int) { ++*this; }
+
+            friend bool operator==(iterator const& it, std::default_sentinel_t) { return it.state == nullptr; }
+        };
+
+        /// @brief Construct the range
+        /// @param fetch Returns the page for the given request (for example `queryDocuments`)
+        /// @param ctx The request for the first page
+        /// @param prefetchPages The number of pages buffered ahead of the consumer. Must be at least 1.
+        CosmosDocumentRange(std::function<CosmosIterableResponseType(CosmosArgumentType const&)> fetch,
+                            CosmosArgumentType const&                                            ctx,
+                            size_t                                                               prefetchPages = 2)
+            : state(std::make_unique<State>(std::move(fetch), ctx, prefetchPages))
+        {
+        }
+
+        /// @brief Starts the prefetcher and returns the iterator at the first document
+        iterator begin()
+        {
+            if (!state->prefetcher.joinable()) state->prefetcher = std::jthread {std::bind_front(&State::prefetch, state.get())};
+            return iterator {state.get()};
+        }
+
+        std::default_sentinel_t end() const { return {}; }
+
+        /// @brief The outcome once the iteration has ended: `200` or the failed page's status and error
+        CosmosResponseType const& status() const { return state->status; }
+    };
+
+
+    /// @brief Cosmos Client
+    /// Implements a stateful Cosmos Client using Cosmos SQL-API via REST API
+    ///
+    /// @details The client is thread-safe in the operations `create`, `find`, `upsert`, `query` and `remove`. The client should
+    /// maintain a single instance as the underlying restcl uses connection pooling so you do not end up with needless sockets
+    /// connecting to Azure.
+    /// However, care must be taken if you wish to handle `401` and `rotate` the connection as the underlying re-discovery is
+    /// currently not thread-safe.
+    ///
+    /// @see Documentation on the REST API from MS
+    /// https://docs.microsoft.com/en-us/rest/api/cosmos-db/common-tasks-using-the-cosmosdb-rest-api
+    /// @see Samples are here: https://docs.microsoft.com/en-us/azure/cosmos-db/sql-api-cpp-get-started
+    /// @see Documentation is here: https://docs.microsoft.com/en-us/rest/api/documentdb/documentdb-resource-uri-syntax-for-rest
+    class CosmosClient
     {
 #if defined(COSMOSCLIENT_TESTING_MODE)
     public:
@@ -527,8 +1838,30 @@ namespace siddiqsoft
         nlohmann::json config {
                 {"_typever", CosmosClientUserAgentString},
                 {"libRetryLimit", 7},
+                {"adaptivePageSizeInitial", 10},   // First page size when adaptive page size is requested
+                {"adaptivePageSizeLatency", 250},  // Target page latency (milliseconds) for the adaptive page size
+                {"continuationTokenLimitInKb", 0}, // Limit for the query continuation token (0: server default)
+                {"singleFlight", false},           // Concurrent identical find and query pages share one request
+                {"writeBehindWindow", 0},          // Milliseconds to coalesce async upserts to the same document (0: off)
+                {"asyncLanes", 0},                 // Ordered async lanes by partition key (0: use the shared worker pool)
+                {"asyncConcurrency", 0},           // Initial adaptive limit of in-flight async requests (0: off)
+                {"completionThreads", 0},          // Threads for the async callbacks (0: invoked on the worker)
+                {"shutdownTimeout", 30000},        // Milliseconds the destructor waits for the queued async requests
+                {"asyncConcurrencyMax", 64},       // Upper bound for the adaptive limit
+                {"asyncConcurrencyLatency", 1000}, // Requests slower than this (milliseconds) reduce the adaptive limit
+                {"negativeCacheTtl", 0},           // Milliseconds to remember a 404 from findDocument (0: off)
+                {"negativeCacheSize", 4096},       // Maximum number of 404 results remembered
+                {"pointReadCacheTtl", 0},          // Milliseconds to remember a document from findDocument (0: off)
+                {"pointReadCacheSize", 1024},      // Maximum number of documents remembered
+                {"queryCacheTtl", 0},              // Milliseconds to remember the result of queryAllDocuments (0: off)
+                {"queryCacheSize", 64},            // Maximum number of query results remembered
+                {"queryCacheInvalidateOnWrite", true}, // Writes by this client clear the cached queries for the partition
+                {"consistencyLevel", nullptr},     // Consistency for find and query (null: the account's default)
+                {"maxIntegratedCacheStalenessInMs", 0}, // Staleness accepted from the dedicated gateway cache (0: gateway default)
+                {"errorIoContext", false},     // Failed responses hold the transport request and response instead of the error body
                 {"apiVersion", "2018-12-31"}, // The API version for Cosmos REST API
                 {"connectionStrings", {}},    // The Connection String from the Azure portal
+                {"partitionKeyKind", "Hash"}, // "MultiHash" when every partitionKeyNames element is a level of the key
                 {"partitionKeyNames", {}}     // The partition key names is an array of partition key names
         };
 
@@ -537,20 +1870,203 @@ namespace siddiqsoft
         /// @warning Guard against writers.
         nlohmann::json serviceSettings;
 
+        /// @brief The configured `consistencyLevel` for the reads
+        CosmosConsistencyLevel defaultConsistency {};
+
+        /// @brief The account's default consistency from the `serviceSettings` (account if unknown)
+        CosmosConsistencyLevel accountConsistency {};
+
         /// @brief Used to signal first-time configuration
         std::atomic_bool isConfigured {false};
 
-        /// @brief The REST client is initialized with the user agent
+        /// @brief The REST client and the async executor; may be shared with other clients
+        std::shared_ptr<CosmosTransport> transport;
+
+        /// @brief The REST client of the transport
         /// @details This can be shared across multiple threads as the only method is `send` and they share minimal state
         /// information across threads.
-        WinHttpRESTClient restClient {CosmosClientUserAgentString};
+        WinHttpRESTClient& restClient;
+
+        /// @brief The number of this client's tasks queued to the transport executor or the lanes; the destructor waits for
+        /// them to complete as the executor may outlive this client
+        std::atomic_uint64_t pendingTasks {0};
+
+        /// @brief Cleared by `shutdown`; `async` rejects further requests
+        std::atomic_bool accepting {true};
+
+        /// @brief Set by `shutdown(CosmosShutdownMode::cancel)`; the requests which have not started are dropped
+        std::atomic_bool cancelling {false};
+
+        /// @brief The number of async requests completed and dropped (see `drain`)
+        std::atomic_uint64_t completedTasks {0};
+        std::atomic_uint64_t droppedTasks {0};
+
+        /// @brief Guards the dropped requests
+        std::mutex droppedMutex {};
+
+        /// @brief The first 100 dropped requests (see `drain`)
+        nlohmann::json droppedRequests = nlohmann::json::array();
+
+        /// @brief Request counters for this client (see `metrics`)
+        struct RequestCounters
+        {
+            std::atomic_uint64_t requests {0};
+            std::atomic_uint64_t failures {0};
+            std::atomic_uint64_t throttled {0};
+            std::atomic_uint64_t requestCharge {0}; // Hundredths of a request unit
+            std::atomic_uint64_t elapsedMicroseconds {0};
+            std::atomic_uint64_t cacheHits {0};   // Reads served by the integrated cache
+            std::atomic_uint64_t cacheMisses {0}; // Reads through a dedicated gateway not served by its cache
+        } counters {};
 
         /// @brief The connection object stores the Primary, Secondary connection strings as well as the read/write locations for
         /// the given Azure location.
         CosmosConnection cnxn {};
 
-        /// @brief The async worker pool
-        simple_pool<CosmosArgumentType> asyncWorkers {std::bind_front(&CosmosClient::asyncDispatcher, this)};
+        /// @brief Guards the in-flight requests shared by the single-flight reads
+        std::mutex inflightMutex {};
+
+        /// @brief In-flight requests keyed by the request arguments (see `singleFlight`)
+        std::unordered_map<std::string, std::shared_future<CosmosIterableResponseType>> inflight {};
+
+        /// @brief Pre-check for the negative cache and the number of keys added since it was cleared
+        CosmosBloomFilter  negativeFilter {};
+        std::atomic_size_t negativeFilterCount {0};
+
+        /// @brief Incremented by every invalidation before the entries are removed; a read which started at an earlier generation
+        /// does not fill the caches (it may have returned the document as it was before the write)
+        std::atomic_uint64_t cacheGeneration {0};
+
+        /// @brief The `findDocument` keys which recently returned 404 with the consistency of the read (see configuration
+        /// `negativeCacheTtl`)
+        CosmosLruCache<std::string, CosmosConsistencyLevel> negativeCache {};
+
+        /// @brief A document returned by `findDocument` and the consistency of the read
+        struct PointReadEntry
+        {
+            std::shared_ptr<const nlohmann::json> document {};
+            CosmosConsistencyLevel                consistency {};
+        };
+
+        /// @brief The documents recently returned by `findDocument` (see configuration `pointReadCacheTtl`)
+        CosmosLruCache<std::string, PointReadEntry> pointReadCache {};
+
+        /// @brief A cached query result along with the arguments used to verify the (hashed) key on lookup
+        struct QueryCacheEntry
+        {
+            std::string                database {};
+            std::string                collection {};
+            std::string                partitionKey {};
+            std::vector<std::string>   partitionKeys {};
+            std::string                queryStatement {};
+            nlohmann::json             queryParameters {};
+            std::shared_ptr<const nlohmann::json> preparedQuery {};   // The body of the prepared query (shared with it)
+            std::shared_ptr<const nlohmann::json> preparedHeaders {}; // The partition targeting of the prepared query
+            CosmosConsistencyLevel                consistency {};     // The consistency of the reads (see `cachedConsistency`)
+            CosmosIterableResponseType            result {};
+
+            /// @brief Check the entry was created for the given arguments; does not allocate
+            bool matches(CosmosArgumentType const& ctx) const
+            {
+                // The prepared query shares its objects with the entry until it is rebound so most checks compare pointers
+                auto same = [](std::shared_ptr<const nlohmann::json> const& cached, nlohmann::json const& current) {
+                    return cached && (cached.get() == &current || *cached == current);
+                };
+                return database == ctx.database && collection == ctx.collection && partitionKey == ctx.partitionKey &&
+                       partitionKeys == ctx.partitionKeys &&
+                       (ctx.preparedQuery ? same(preparedQuery, ctx.preparedQuery->content()) &&
+                                                    same(preparedHeaders, ctx.preparedQuery->headers())
+                                          : (queryStatement == ctx.queryStatement && queryParameters == ctx.queryParameters));
+            }
+        };
+
+        /// @brief The results of `queryAllDocuments` (see configuration `queryCacheTtl`)
+        CosmosLruCache<uint64_t, std::shared_ptr<const QueryCacheEntry>> queryCache {64};
+
+        /// @brief Set once the service reports the delete-by-partition-key operation is not implemented (405 or 501) so
+        /// `removeAll` skips the attempt
+        std::atomic_bool partitionKeyDeleteUnsupported {false};
+
+
+        /// @brief An ordered async lane: a single worker executing the lane's requests in submission order
+        struct AsyncLane
+        {
+            CosmosBoundedQueue<CosmosArgumentType> requests {std::numeric_limits<size_t>::max()};
+            std::jthread                           worker {};
+
+            /// @brief Rejects further requests; the worker completes the queued requests before it is joined
+            ~AsyncLane() { requests.close(); }
+        };
+
+        /// @brief Creates the lanes on first use
+        std::once_flag asyncLanesOnce {};
+
+        /// @brief The ordered async lanes (see configuration `asyncLanes`)
+        std::vector<std::unique_ptr<AsyncLane>> asyncLanes {};
+
+        /// @brief Adaptive limit of the async requests executing on the shared workers (see configuration `asyncConcurrency`)
+        CosmosConcurrencyLimit concurrencyLimit {};
+
+        /// @brief Set by `runTask` on its thread while a limited request executes; the first response sent for the request
+        /// adjusts that limit so the synchronous calls (and further requests from the callback) do not
+        inline static thread_local CosmosConcurrencyLimit* limitedRequest {nullptr};
+
+        /// @brief Guards the async requests waiting for the concurrency limit
+        std::mutex limitedMutex {};
+
+        /// @brief The async requests waiting for the concurrency limit in submission order
+        std::deque<CosmosArgumentType> limitedRequests {};
+
+        /// @brief Delivers the async responses to their callbacks when set (see `setCompletionExecutor`)
+        CosmosCompletionExecutor completionExecutor {};
+
+        /// @brief Delivers the async responses to their callbacks when `completionThreads` is configured
+        std::unique_ptr<simple_pool<std::function<void()>>> completionPool {};
+
+        /// @brief Completions buffered for the batch handler by the workers which hash to it
+        struct CompletionBatch
+        {
+            std::mutex                            batchMutex {};
+            std::vector<CosmosCompletionType>     items {};
+            std::vector<CosmosCompletionType>     spare {}; // Keeps the capacity of the delivered batch
+            std::chrono::steady_clock::time_point first {};
+        };
+
+        /// @brief Receives the completions of the async requests without a callback (see `setBatchHandler`)
+        CosmosBatchCallbackType batchHandler {};
+
+        /// @brief Deliver a batch once it holds this many completions
+        size_t batchSize {256};
+
+        /// @brief Deliver a batch once its first completion is this old
+        std::chrono::microseconds batchDelay {1000};
+
+        /// @brief One buffer per hardware thread so the workers rarely share a lock
+        std::vector<std::unique_ptr<CompletionBatch>> batches {};
+
+        /// @brief Delivers the batches which reach the `batchDelay`
+        std::jthread batchFlusher {};
+
+        /// @brief A pending write-behind upsert and the earlier upserts it superseded
+        struct WriteBehindEntry
+        {
+            CosmosArgumentType                    latest {};
+            std::vector<CosmosArgumentType>       superseded {};
+            std::chrono::steady_clock::time_point due {};
+        };
+
+        /// @brief Guards the pending write-behind upserts
+        std::mutex writeBehindMutex {};
+
+        /// @brief Signals the write-behind flusher
+        std::condition_variable_any writeBehindSignal {};
+
+        /// @brief Pending upserts keyed by database, collection, partition key and id so the flush is grouped by partition
+        std::map<std::string, WriteBehindEntry> writeBehindPending {};
+
+        /// @brief Flushes the pending upserts once their window elapses; started on first use.
+        /// @note Stopped by the destructor so the pending upserts are flushed before the client waits for its tasks.
+        std::jthread writeBehindFlusher {};
 
 
         /// @brief The async dispatcher/driver
@@ -560,104 +2076,779 @@ namespace siddiqsoft
             switch (req.operation) {
                 case CosmosOperation::discoverRegions: {
                     auto resp = discoverRegions();
-                    if (req.onResponse) req.onResponse(req, resp);
+                    complete(std::move(req), std::move(resp));
+                } break;
+
+                case CosmosOperation::listDatabases: {
+                    auto resp = listDatabases();
+                    complete(std::move(req), std::move(resp));
+                } break;
+
+                case CosmosOperation::listCollections: {
+                    auto resp = listCollections(req);
+                    complete(std::move(req), std::move(resp));
+                } break;
+
+                case CosmosOperation::listDocuments: {
+                    // This returns CosmosIterableResponseType and the client's handler is invoked for each block.
+                    CosmosIterableResponseType resp = listDocuments(req);
+                    complete(req, resp);
+                    if (resp.success() && !resp.continuationToken.empty()) {
+#ifdef _DEBUG
+                        std::cerr << std::format("....Status:{}  continueToken:{}  count:{}  ttx:{} requeue\n",
+                                                 resp.statusCode,
+                                                 resp.continuationToken,
+                                                 resp.document.value("_count", 0),
+                                                 resp.ttx);
+#endif
+                        // The response is no longer needed; the token is moved (it may be several KB on cross-partition queries)
+                        req.continuationToken = std::move(resp.continuationToken);
+                        req.maxItemCount      = resp.maxItemCount;
+                        // Queue the next instance.
+                        // This approach allows for controlled shutdown as the thread is able to listen and handle
+                        // stop requests.
+                        requeue(std::move(req));
+                    }
+                } break;
+
+                case CosmosOperation::create: {
+                    auto resp = createDocument(req);
+                    complete(std::move(req), std::move(resp));
+                } break;
+
+                case CosmosOperation::upsert: {
+                    auto resp = upsertDocument(req);
+                    complete(std::move(req), std::move(resp));
+                } break;
+
+                case CosmosOperation::update: {
+                    auto resp = updateDocument(req);
+                    complete(std::move(req), std::move(resp));
+                } break;
+
+                case CosmosOperation::find: {
+                    // Returns at most a single document or it is not found.
+                    auto resp = findDocument(req);
+                    complete(std::move(req), std::move(resp));
+                } break;
+
+                case CosmosOperation::remove: {
+                    // The response is an error code so we will need to normalize into a response type for the callback.
+                    auto rc = removeDocument(req);
+                    complete(std::move(req), CosmosResponseType {rc, nullptr});
+                } break;
+
+                case CosmosOperation::execute: {
+                    // The callback receives the CosmosStoredProcedureResponseType
+                    auto resp = executeStoredProcedure(req);
+                    complete(std::move(req), std::move(resp));
+                } break;
+
+                case CosmosOperation::query: {
+                    // This returns CosmosIterableResponseType and the client's handler is invoked for each block.
+                    CosmosIterableResponseType resp = queryDocuments(req);
+                    complete(req, resp);
+                    if (resp.success() && !resp.continuationToken.empty()) {
+#ifdef _DEBUG
+                        std::cerr << std::format("....Status:{}  continueToken:{}  count:{}  ttx:{} requeue\n",
+                                                 resp.statusCode,
+                                                 resp.continuationToken,
+                                                 resp.document.value("_count", 0),
+                                                 resp.ttx);
+#endif
+                        // The response is no longer needed; the token is moved (it may be several KB on cross-partition queries)
+                        req.continuationToken = std::move(resp.continuationToken);
+                        req.maxItemCount      = resp.maxItemCount;
+                        // Queue the next instance.
+                        // This approach allows for controlled shutdown as the thread is able to listen and handle
+                        // stop requests.
+                        requeue(std::move(req));
+                    }
                 } break;
+            }
+        }
+
+        /// @brief Deliver the response to the request's callback.
+        /// Invoked inline unless a completion executor (see `setCompletionExecutor`) or the `completionThreads` are configured
+        /// in which case the request and the response are moved (or copied when the caller still needs them) to the task so the
+        /// worker may issue the next request.
+        /// @param req The request; pass an rvalue when it is no longer needed
+        /// @param resp The response; the task preserves the derived type so the callback may `static_cast` it
+        template <typename Q, typename R>
+            requires std::same_as<std::remove_cvref_t<Q>, CosmosArgumentType> &&
+                     std::derived_from<std::remove_cvref_t<R>, CosmosResponseType>
+        void complete(Q&& req, R&& resp)
+        {
+            if (!req.onResponse) {
+                if (batchHandler) batch(std::forward<Q>(req), std::forward<R>(resp));
+                return;
+            }
+            if (!completionExecutor && !completionPool) return req.onResponse(req, resp);
+
+            // Counted as a task so `drain` and the destructor wait for the callback
+            pendingTasks++;
+            std::function<void()> task = [this, req = std::forward<Q>(req), resp = std::forward<R>(resp)]() {
+                try {
+                    req.onResponse(req, resp);
+                }
+                catch (...) {
+                    taskDone();
+                    throw;
+                }
+                taskDone();
+            };
+            if (completionExecutor)
+                completionExecutor(std::move(task));
+            else
+                completionPool->queue(std::move(task));
+        }
+
+        /// @brief Buffer the completion for the batch handler; the batch is delivered from this thread once it is full
+        /// @param req The request (without a callback); moved into the batch when given as an rvalue
+        /// @param resp The response; moved into the batch when given as an rvalue
+        template <typename Q, typename R>
+        void batch(Q&& req, R&& resp)
+        {
+            auto& shard = *batches[std::hash<std::thread::id> {}(std::this_thread::get_id()) % batches.size()];
+            std::vector<CosmosCompletionType> ready {};
+
+            // Counted as a task until delivered so `drain` and the destructor wait for the batch
+            pendingTasks++;
+            {
+                std::scoped_lock l(shard.batchMutex);
+                if (shard.items.empty()) shard.first = std::chrono::steady_clock::now();
+                shard.items.emplace_back(std::forward<Q>(req),
+                                         CosmosCompletionResponseType {std::in_place_type<std::remove_cvref_t<R>>, std::forward<R>(resp)});
+                if (shard.items.size() < batchSize) return;
+                ready.swap(shard.items);
+                shard.items.swap(shard.spare);
+            }
+            deliverBatch(shard, ready);
+        }
+
+        /// @brief Invoke the batch handler and keep the buffer for reuse
+        /// @param shard The buffer the batch was taken from
+        /// @param ready The completions
+        void deliverBatch(CompletionBatch& shard, std::vector<CosmosCompletionType>& ready)
+        {
+            auto count = ready.size();
+            try {
+                batchHandler(std::span<const CosmosCompletionType>(ready));
+            }
+            catch (...) {
+                taskDone(count);
+                throw;
+            }
+            ready.clear();
+            {
+                std::scoped_lock l(shard.batchMutex);
+                if (ready.capacity() > shard.spare.capacity()) shard.spare.swap(ready);
+            }
+            taskDone(count);
+        }
+
+        /// @brief The batch flusher loop; delivers the batches which reach the `batchDelay` and every batch when stopped
+        /// @param st The stop token
+        void batchFlush(std::stop_token st)
+        {
+            std::mutex                  waitMutex {};
+            std::condition_variable_any waitSignal {};
+            std::unique_lock            w(waitMutex);
+
+            while (true) {
+                auto stopping = st.stop_requested();
+                auto now      = std::chrono::steady_clock::now();
+                for (auto& shard : batches) {
+                    std::vector<CosmosCompletionType> ready {};
+                    {
+                        std::scoped_lock l(shard->batchMutex);
+                        if (shard->items.empty() || (!stopping && now - shard->first < batchDelay)) continue;
+                        ready.swap(shard->items);
+                        shard->items.swap(shard->spare);
+                    }
+                    try {
+                        deliverBatch(*shard, ready);
+                    }
+                    catch (...) {
+                        // The handler's failure must not stop the delivery of the other batches
+                    }
+                }
+                if (stopping) break;
+                waitSignal.wait_for(w, st, std::max(batchDelay / 2, std::chrono::microseconds(50)), [] { return false; });
+            }
+        }
+
+        /// @brief The number of partition key levels: every name in `partitionKeyNames` for a `MultiHash` (hierarchical)
+        /// partition key otherwise the first name
+        size_t partitionKeyLevels() const
+        {
+            if (config.value("partitionKeyKind", "Hash") == "MultiHash")
+                return std::max<size_t>(1, config.value("partitionKeyNames", nlohmann::json::array()).size());
+            return 1;
+        }
+
+        /// @brief The partition key field names for each level (see `partitionKeyLevels`)
+        std::vector<std::string> partitionKeyNames() const
+        {
+            std::vector<std::string> names {};
+            for (size_t i = 0; i < partitionKeyLevels(); i++)
+                names.push_back(config.at("partitionKeyNames").at(i).get<std::string>());
+            return names;
+        }
+
+        /// @brief The partition key values of the document for each level
+        /// @param doc The document
+        /// @return The array of values (the `x-ms-documentdb-partitionkey` header) or null if the document is missing a level
+        nlohmann::json documentPartitionKey(nlohmann::json const& doc) const
+        {
+            auto values = nlohmann::json::array();
+            if (!doc.is_object()) return nullptr;
+            for (size_t i = 0; i < partitionKeyLevels(); i++) {
+                auto item = doc.find(config.at("partitionKeyNames").at(i).get_ref<const std::string&>());
+                if (item == doc.end()) return nullptr;
+                values.push_back(*item);
+            }
+            return values;
+        }
+
+        /// @brief The partition key values of the request: the `partitionKeys` if given otherwise the `partitionKey`
+        /// @return The array of values (the `x-ms-documentdb-partitionkey` header)
+        static nlohmann::json requestPartitionKey(CosmosArgumentType const& ctx)
+        {
+            return ctx.partitionKeys.empty() ? nlohmann::json {ctx.partitionKey} : nlohmann::json(ctx.partitionKeys);
+        }
+
+        /// @brief Check the request has a value for every partition key level (required by the point operations)
+        bool completePartitionKey(CosmosArgumentType const& ctx) const
+        {
+            return ctx.partitionKeys.empty() ? (!ctx.partitionKey.empty() && partitionKeyLevels() == 1)
+                                             : ctx.partitionKeys.size() == partitionKeyLevels();
+        }
+
+        /// @brief The partition key values joined into the single string used by the caches, single-flight reads and the async
+        /// lanes. A single-level key is the value itself.
+        static std::string partitionKeyString(nlohmann::json const& values)
+        {
+            std::string key {};
+            for (auto const& value : values) {
+                if (&value != &values.front()) key += '\x1f';
+                key += value.is_string() ? value.get_ref<const std::string&>() : value.dump();
+            }
+            return key;
+        }
+
+        /// @brief The key identifying a document for the lookup caches and the single-flight reads
+        static std::string documentKey(std::string const& database,
+                                       std::string const& collection,
+                                       std::string const& partitionKey,
+                                       std::string const& id)
+        {
+            return std::format("{}\n{}\n{}\n{}", database, collection, partitionKey, id);
+        }
+
+        /// @brief Remove the document from the lookup caches after this client writes it
+        void invalidateDocument(std::string const& database,
+                                std::string const& collection,
+                                std::string const& partitionKey,
+                                std::string const& id)
+        {
+            cacheGeneration++;
+            if (config.value("negativeCacheTtl", 0) > 0 || config.value("pointReadCacheTtl", 0) > 0) {
+                auto key = documentKey(database, collection, partitionKey, id);
+                negativeCache.erase(key);
+                pointReadCache.erase(key);
+            }
+            if (config.value("queryCacheTtl", 0) > 0 && config.value("queryCacheInvalidateOnWrite", true))
+                invalidateQueryCache(database, collection, partitionKey);
+        }
+
+        /// @brief Remove every document of the partition from the lookup caches (and the query cache)
+        /// The negative filter cannot remove keys; it is only the pre-check for the negative cache so the stale bits cost a
+        /// cache lookup and never a wrong answer.
+        void invalidatePartition(std::string const& database, std::string const& collection, std::string const& partitionKey)
+        {
+            cacheGeneration++;
+            auto prefix = documentKey(database, collection, partitionKey, {});
+            negativeCache.eraseIf([&](auto const& key, auto const&) { return key.starts_with(prefix); });
+            pointReadCache.eraseIf([&](auto const& key, auto const&) { return key.starts_with(prefix); });
+            if (config.value("queryCacheTtl", 0) > 0) invalidateQueryCache(database, collection, partitionKey);
+        }
+
+        /// @brief The hash of the query arguments used as the query cache key; does not allocate
+        static uint64_t queryKey(CosmosArgumentType const& ctx)
+        {
+            auto combine = [](uint64_t seed, uint64_t h) { return seed ^ (h + 0x9E3779B97F4A7C15ull + (seed << 6) + (seed >> 2)); };
+
+            uint64_t h = std::hash<std::string_view> {}(ctx.database);
+            h          = combine(h, std::hash<std::string_view> {}(ctx.collection));
+            h          = combine(h, std::hash<std::string_view> {}(ctx.partitionKey));
+            for (auto const& level : ctx.partitionKeys) h = combine(h, std::hash<std::string_view> {}(level));
+            if (ctx.preparedQuery) {
+                h = combine(h, std::hash<nlohmann::json> {}(ctx.preparedQuery->headers()));
+                return combine(h, std::hash<nlohmann::json> {}(ctx.preparedQuery->content()));
+            }
+            h = combine(h, std::hash<std::string_view> {}(ctx.queryStatement));
+            return combine(h, std::hash<nlohmann::json> {}(ctx.queryParameters));
+        }
+
+        /// @brief The key used to select the ordered lane for the request
+        /// @param op The request
+        /// @return The partition key (from the argument or the document), the id or empty if the request is not keyed
+        std::string laneKey(CosmosArgumentType const& op) const
+        {
+            if (!op.partitionKeys.empty()) return partitionKeyString(requestPartitionKey(op));
+            if (!op.partitionKey.empty() && !op.partitionKey.starts_with("*")) return op.partitionKey;
+            if (auto pk = documentPartitionKey(op.document); !pk.is_null()) return partitionKeyString(pk);
+            return op.id;
+        }
+
+        /// @brief Queue the request to the async workers.
+        /// When `asyncLanes` is configured the keyed requests are queued to the lane for their partition key so requests for the
+        /// same key execute in submission order while different keys execute in parallel. Requests without a key (such as the
+        /// list operations) use the shared worker pool.
+        /// When `asyncConcurrency` is configured the requests for the shared worker pool wait in submission order until the
+        /// adaptive limit allows them to start. The lanes are already bounded by their count and are not limited.
+        /// @param op The request
+        void requeue(CosmosArgumentType&& op)
+        {
+            if (auto lanes = config.value("asyncLanes", 0); lanes > 0) {
+                if (auto key = laneKey(op); !key.empty()) {
+                    std::call_once(asyncLanesOnce, [&]() {
+                        for (auto i = 0; i < lanes; i++) {
+                            auto& lane  = asyncLanes.emplace_back(std::make_unique<AsyncLane>());
+                            lane->worker = std::jthread {[this, &requests = lane->requests]() {
+                                while (auto req = requests.pop()) {
+                                    // A failing request or callback must not escape the lane's thread (and terminate)
+                                    try {
+                                        runTask(std::move(*req));
+                                    }
+                                    catch (...) {
+                                    }
+                                }
+                            }};
+                        }
+                    });
+                    pendingTasks++;
+                    if (!asyncLanes[std::hash<std::string> {}(key) % asyncLanes.size()]->requests.push(std::move(op))) taskDone();
+                    return;
+                }
+            }
+
+            pendingTasks++;
+            if (config.value("asyncConcurrency", 0) > 0) {
+                {
+                    std::scoped_lock l(limitedMutex);
+                    limitedRequests.push_back(std::move(op));
+                }
+                dispatchLimited();
+                return;
+            }
+            transport->executor.queue([this, op = std::move(op)]() mutable { runTask(std::move(op)); });
+        }
+
+        /// @brief Queue the waiting requests to the shared workers while the concurrency limit allows.
+        /// Invoked when a request is queued and when a limited request completes (so its slot is reused).
+        void dispatchLimited()
+        {
+            while (true) {
+                CosmosArgumentType op {};
+                {
+                    std::scoped_lock l(limitedMutex);
+                    if (limitedRequests.empty() || !concurrencyLimit.tryAcquire()) return;
+                    op = std::move(limitedRequests.front());
+                    limitedRequests.pop_front();
+                }
+
+                transport->executor.queue([this, op = std::move(op)]() mutable { runTask(std::move(op), true); });
+            }
+        }
+
+        /// @brief Dispatch a queued request and account for its completion.
+        /// Once cancelled (see `shutdown`) the request is dropped instead; as the list and query operations queue each
+        /// continuation page as a new request their chains stop at the next page boundary.
+        /// @param op The request
+        /// @param limited True if the request holds a slot of the concurrency limit
+        void runTask(CosmosArgumentType&& op, bool limited = false)
+        {
+            auto finish = [&]() {
+                if (limited) {
+                    concurrencyLimit.release();
+                    dispatchLimited();
+                }
+                taskDone();
+            };
+
+            if (cancelling) {
+                dropTask(op);
+                return finish();
+            }
+
+            if (limited) limitedRequest = &concurrencyLimit;
+            try {
+                asyncDispatcher(std::move(op));
+            }
+            catch (...) {
+                limitedRequest = nullptr;
+                completedTasks++;
+                finish();
+                throw;
+            }
+            limitedRequest = nullptr;
+            completedTasks++;
+            finish();
+        }
+
+        /// @brief Record a request dropped by `shutdown`; the caller accounts for the task
+        /// @param op The request; the continuation token allows the caller to resume a list or query
+        void dropTask(CosmosArgumentType const& op)
+        {
+            droppedTasks++;
+            std::scoped_lock l(droppedMutex);
+            if (droppedRequests.size() < 100) {
+                droppedRequests.push_back({{"operation", op.operation},
+                                           {"database", op.database},
+                                           {"collection", op.collection},
+                                           {"id", op.id.empty() && op.document.is_object() ? op.document.value("id", "") : op.id},
+                                           {"continuationToken", op.continuationToken}});
+            }
+        }
+
+        /// @brief Account for a completed task and wake the destructor once all of the tasks have completed
+        /// @param count The number of completed tasks
+        void taskDone(uint64_t count = 1)
+        {
+            if ((pendingTasks -= count) == 0) pendingTasks.notify_all();
+        }
+
+        /// @brief Hold the upsert for the write-behind window, replacing any pending upsert to the same document.
+        /// The superseded request's callback is invoked once the replacement is committed.
+        /// @param op The validated upsert request
+        void writeBehind(CosmosArgumentType&& op)
+        {
+            auto window = std::chrono::milliseconds(config.value("writeBehindWindow", 0));
+            auto key    = std::format("{}\n{}\n{}\n{}",
+                                   op.database,
+                                   op.collection,
+                                   partitionKeyString(documentPartitionKey(op.document)),
+                                   op.document.value("id", ""));
+
+            std::scoped_lock l(writeBehindMutex);
+            if (auto item = writeBehindPending.find(key); item != writeBehindPending.end()) {
+                // Last write wins; the window is not extended so hot documents are still committed regularly
+                item->second.superseded.push_back(std::move(item->second.latest));
+                item->second.latest = std::move(op);
+            }
+            else {
+                writeBehindPending.emplace(std::move(key), WriteBehindEntry {std::move(op), {}, std::chrono::steady_clock::now() + window});
+            }
+
+            if (!writeBehindFlusher.joinable())
+                writeBehindFlusher = std::jthread {std::bind_front(&CosmosClient::writeBehindFlush, this)};
+        }
+
+        /// @brief The write-behind flusher loop. Queues the due upserts to the async workers, the upserts of the same partition
+        /// as one batch (see `writeBehindBatch`), and flushes everything pending when stopped.
+        /// @param st The stop token
+        void writeBehindFlush(std::stop_token st)
+        {
+            std::vector<CosmosArgumentType> ready {};
+            std::unique_lock                l(writeBehindMutex);
+            while (true) {
+                auto stopping = st.stop_requested();
+                auto now      = std::chrono::steady_clock::now();
+                auto next     = now + std::chrono::milliseconds(std::max(1, config.value("writeBehindWindow", 0)));
+
+                for (auto item = writeBehindPending.begin(); item != writeBehindPending.end();) {
+                    if (stopping || item->second.due <= now) {
+                        auto entry = std::move(item->second);
+                        item       = writeBehindPending.erase(item);
+                        if (!entry.superseded.empty()) {
+                            // The superseded callers are told the outcome of the write that replaced theirs
+                            entry.latest.onResponse = [this,
+                                                       committed  = std::move(entry.latest.onResponse),
+                                                       superseded = std::move(entry.superseded)](CosmosArgumentType const& req,
+                                                                                                 CosmosResponseType const& resp) {
+                                for (auto& s : superseded) {
+                                    complete(s, CosmosResponseType {resp.statusCode, {{"_superseded", true}}, resp.ttx});
+                                }
+                                if (committed)
+                                    committed(req, resp);
+                                else if (batchHandler)
+                                    batch(req, resp);
+                            };
+                        }
+                        ready.push_back(std::move(entry.latest));
+                    }
+                    else {
+                        next = std::min(next, item->second.due);
+                        ++item;
+                    }
+                }
+
+                // Queue outside the lock so the callbacks may issue further upserts
+                if (!ready.empty()) {
+                    l.unlock();
+                    // The pending map is ordered by partition so the upserts of a partition are adjacent. The lanes keep the
+                    // per-key order of the requests so each upsert goes through its lane instead.
+                    auto batched = config.value("asyncLanes", 0) == 0;
+                    for (size_t first = 0, last = 0; first < ready.size(); first = last) {
+                        auto pk = partitionKeyString(documentPartitionKey(ready[first].document));
+                        for (last = first + 1; batched && last < ready.size(); last++) {
+                            auto& op = ready[last];
+                            if (op.database != ready[first].database || op.collection != ready[first].collection ||
+                                partitionKeyString(documentPartitionKey(op.document)) != pk)
+                                break;
+                        }
+
+                        std::vector<CosmosArgumentType> group(std::make_move_iterator(ready.begin() + first),
+                                                              std::make_move_iterator(ready.begin() + last));
+                        if (!stopping) {
+                            if (group.size() == 1) {
+                                requeue(std::move(group.front()));
+                                continue;
+                            }
+                            pendingTasks++;
+                            transport->executor.queue([this, group = std::move(group)]() mutable {
+                                if (cancelling) {
+                                    for (auto& op : group) dropTask(op);
+                                    return taskDone();
+                                }
+                                try {
+                                    writeBehindBatch(std::move(group));
+                                }
+                                catch (...) {
+                                    taskDone();
+                                    throw;
+                                }
+                                taskDone();
+                            });
+                            continue;
+                        }
+                        // The final flush is sent from this thread so it completes even if the queued requests are
+                        // cancelled; a failing callback must not prevent the remaining upserts from being sent
+                        if (group.size() > 1) {
+                            try {
+                                writeBehindBatch(std::move(group));
+                            }
+                            catch (...) {
+                            }
+                            continue;
+                        }
+                        try {
+                            asyncDispatcher(std::move(group.front()));
+                        }
+                        catch (...) {
+                        }
+                        completedTasks++;
+                    }
+                    ready.clear();
+                    l.lock();
+                }
+
+                if (stopping) {
+                    // Upserts may have arrived while the lock was released
+                    if (writeBehindPending.empty()) break;
+                    continue;
+                }
+                writeBehindSignal.wait_until(l, st, next, [] { return false; });
+            }
+        }
+
+        /// @brief Upsert the write-behind requests of a single partition with `upsertBatch` and complete each request.
+        /// A failing callback does not prevent the completion of the other requests; the first failure is rethrown.
+        /// @param group The upserts; the same database, collection and partition key
+        void writeBehindBatch(std::vector<CosmosArgumentType>&& group)
+        {
+            std::vector<std::string>      bodies {};
+            std::vector<std::string_view> documents {};
+            for (auto& op : group) bodies.push_back(op.document.dump());
+            for (auto& body : bodies) documents.push_back(body);
+
+            std::vector<CosmosResponseType> results {};
+            try {
+                results = upsertBatch(
+                        group.front().database, group.front().collection, documentPartitionKey(group.front().document), documents);
+            }
+            catch (...) {
+                completedTasks += group.size();
+                throw;
+            }
+
+            std::exception_ptr failure {};
+            for (size_t i = 0; i < group.size(); i++) {
+                try {
+                    complete(std::move(group[i]), std::move(results[i]));
+                }
+                catch (...) {
+                    if (!failure) failure = std::current_exception();
+                }
+                completedTasks++;
+            }
+            if (failure) std::rethrow_exception(failure);
+        }
+
+        /// @brief The page size to request for the given argument
+        /// @param ctx The request
+        /// @return The explicit page size, the initial adaptive page size or 0 to leave the header unchanged
+        int32_t pageSizeFor(CosmosArgumentType const& ctx) const
+        {
+            if (ctx.maxItemCount > 0) return ctx.maxItemCount;
+            if (ctx.adaptivePageSize) return config.value("adaptivePageSizeInitial", 10);
+            return 0;
+        }
 
-                case CosmosOperation::listDatabases: {
-                    auto resp = listDatabases();
-                    if (req.onResponse) req.onResponse(req, resp);
-                } break;
+        /// @brief Compute the page size for the next page.
+        /// The adaptive page size doubles while full pages arrive within the target latency and halves when a page takes more
+        /// than twice the target. The size is capped so the page fits the 4MB response limit given the observed document size.
+        /// @param ctx The request for the current page
+        /// @param page The response for the current page
+        /// @return The page size for the next page
+        int32_t nextPageSize(CosmosArgumentType const& ctx, CosmosIterableResponseType const& page) const
+        {
+            constexpr int64_t MaxResponseBytes {4 * 1024 * 1024};
 
-                case CosmosOperation::listCollections: {
-                    auto resp = listCollections(req);
-                    if (req.onResponse) req.onResponse(req, resp);
-                } break;
+            int64_t current = pageSizeFor(ctx);
+            if (!ctx.adaptivePageSize || !page.success()) return int32_t(current);
 
-                case CosmosOperation::listDocuments: {
-                    // This returns CosmosIterableResponseType and the client's handler is invoked for each block.
-                    CosmosIterableResponseType resp = listDocuments(req);
-                    if (req.onResponse) req.onResponse(req, resp);
-                    if (resp.success() && !resp.continuationToken.empty()) {
-                        req.continuationToken = resp.continuationToken;
-#ifdef _DEBUG
-                        std::cerr << std::format("....Status:{}  continueToken:{}  count:{}  ttx:{} requeue\n",
-                                                 resp.statusCode,
-                                                 resp.continuationToken,
-                                                 resp.document.value("_count", 0),
-                                                 resp.ttx);
-#endif
-                        // Queue the next instance.
-                        // This approach allows for controlled shutdown as the thread is able to listen and handle
-                        // stop requests.
-                        asyncWorkers.queue(std::move(req));
-                    }
-                } break;
+            auto    target = std::chrono::milliseconds(config.value("adaptivePageSizeLatency", 250));
+            int64_t count  = page.document.value("_count", 0);
+            int64_t bytes  = page.headers.contentLength();
+            int64_t next   = current;
 
-                case CosmosOperation::create: {
-                    auto resp = createDocument(req);
-                    if (req.onResponse) req.onResponse(req, resp);
-                } break;
+            if (page.ttx > target * 2)
+                next = current / 2;
+            else if (count >= current && page.ttx < target)
+                next = current * 2;
 
-                case CosmosOperation::upsert: {
-                    auto resp = upsertDocument(req);
-                    if (req.onResponse) req.onResponse(req, resp);
-                } break;
+            // Keep the page within the maximum response size using the average document size for this page
+            if (count > 0 && bytes > 0) next = std::min(next, std::max<int64_t>(1, MaxResponseBytes * count / bytes));
 
-                case CosmosOperation::update: {
-                    auto resp = updateDocument(req);
-                    if (req.onResponse) req.onResponse(req, resp);
-                } break;
+            return int32_t(std::clamp<int64_t>(next, 1, std::numeric_limits<int32_t>::max()));
+        }
 
-                case CosmosOperation::find: {
-                    // Returns at most a single document or it is not found.
-                    auto resp = findDocument(req);
-                    if (req.onResponse) req.onResponse(req, resp);
-                } break;
+        /// @brief Move the continuation token out of the response headers
+        /// @param headers The response headers
+        /// @return The `x-ms-continuation` value or empty
+        static std::string takeContinuation(nlohmann::json& headers)
+        {
+            if (auto item = headers.is_object() ? headers.find("x-ms-continuation") : headers.end();
+                item != headers.end() && item->is_string())
+                return std::move(item->get_ref<std::string&>());
+            return {};
+        }
 
-                case CosmosOperation::remove: {
-                    // The response is an error code so we will need to normalize into a response type for the callback.
-                    auto rc = removeDocument(req);
-                    if (req.onResponse) req.onResponse(req, {rc, nullptr});
-                } break;
+        /// @brief The request units consumed by a request
+        /// @param headers The response headers
+        /// @return The `x-ms-request-charge` value or 0 if absent
+        static double requestCharge(nlohmann::json const& headers)
+        {
+            return CosmosResponseHeaders::number(headers, "x-ms-request-charge");
+        }
 
-                case CosmosOperation::query: {
-                    // This returns CosmosIterableResponseType and the client's handler is invoked for each block.
-                    CosmosIterableResponseType resp = queryDocuments(req);
-                    if (req.onResponse) req.onResponse(req, resp);
-                    if (resp.success() && !resp.continuationToken.empty()) {
-                        req.continuationToken = resp.continuationToken;
-#ifdef _DEBUG
-                        std::cerr << std::format("....Status:{}  continueToken:{}  count:{}  ttx:{} requeue\n",
-                                                 resp.statusCode,
-                                                 resp.continuationToken,
-                                                 resp.document.value("_count", 0),
-                                                 resp.ttx);
-#endif
-                        // Queue the next instance.
-                        // This approach allows for controlled shutdown as the thread is able to listen and handle
-                        // stop requests.
-                        asyncWorkers.queue(std::move(req));
-                    }
-                } break;
+        /// @brief Extract the server requested back-off from a throttled response
+        /// @param resp The response
+        /// @return The duration from `x-ms-retry-after-ms` or 100ms if absent
+        static std::chrono::milliseconds retryAfter(CosmosResponseType const& resp)
+        {
+            if (auto after = resp.headers.retryAfter(); after.count() > 0) return after;
+            return std::chrono::milliseconds(100);
+        }
+
+        /// @brief The document for the response: the content on success otherwise the Cosmos error body (`code` and
+        /// `message`) which is moved rather than copying the transport request and response. The transport request and
+        /// response (the io context) is returned when there is no error body (such as an IO error) or when the configuration
+        /// `errorIoContext` is set.
+        /// @param resp The transport response; the content is moved out
+        /// @return The document
+        nlohmann::json responseDocument(RESTResponseType& resp) const
+        {
+            if (resp.success()) return std::move(resp["content"]);
+            if (auto& content = resp["content"]; content.is_object() && !config.value("errorIoContext", false))
+                return std::move(content);
+            return nlohmann::json(resp);
+        }
+
+        /// @brief Size the lookup caches, start the completion pool and set the concurrency limit from the configuration.
+        /// Invoked by `configure` and the move constructor.
+        void applyConfiguration()
+        {
+            // Size the lookup caches
+            negativeCache.setCapacity(config.value("negativeCacheSize", 4096));
+            pointReadCache.setCapacity(config.value("pointReadCacheSize", 1024));
+            queryCache.setCapacity(config.value("queryCacheSize", 64));
+
+            // Separate the async callbacks from the workers
+            if (auto threads = config.value("completionThreads", 0); threads > 0 && !completionPool) {
+                completionPool =
+                        std::make_unique<simple_pool<std::function<void()>>>([](std::function<void()>&& task) { task(); }, threads);
             }
+
+            // Adaptive limit for the async requests
+            concurrencyLimit.configure(config.value("asyncConcurrency", 0),
+                                       config.value("asyncConcurrencyMax", 64),
+                                       std::chrono::milliseconds(config.value("asyncConcurrencyLatency", 1000)));
         }
 
     public:
         /// @brief This is the string used in the User-Agent header
         inline static const std::string CosmosClientUserAgentString {"SiddiqSoft.CosmosClient/0.10.0"};
 
-        /// @brief Default constructor
-        CosmosClient() { }
+        /// @brief Create a transport which may be shared by several clients
+        /// @param threads Number of worker threads for the async operations; 0 uses the pool default
+        /// @return The shared transport
+        static std::shared_ptr<CosmosTransport> makeTransport(size_t threads = 0)
+        {
+            return std::make_shared<CosmosTransport>(CosmosClientUserAgentString, threads);
+        }
+
+        /// @brief Default constructor; the client has its own transport
+        CosmosClient()
+            : CosmosClient(makeTransport())
+        {
+        }
 
-        /// @brief Move constructor
+        /// @brief Construct the client on the given transport
+        /// @param shared The transport (see `makeTransport`) shared with other clients. If empty the client has its own.
+        explicit CosmosClient(std::shared_ptr<CosmosTransport> shared)
+            : transport(shared ? std::move(shared) : makeTransport())
+            , restClient(transport->restClient)
+        {
+        }
+
+        /// @brief Move constructor. Moves the configuration, the consistency levels, the completion executor and the batch
+        /// handler; the caches, the completion pool and the concurrency limit are rebuilt from the configuration (the cached
+        /// entries are not moved). The source keeps its queued async requests and pending write-behind upserts and drains
+        /// them when destroyed.
         /// @param src Other client instance
         CosmosClient(CosmosClient&& src) noexcept
             : config(std::move(src.config))
             , serviceSettings(std::move(src.serviceSettings))
-            , restClient(std::move(src.restClient))
+            , defaultConsistency(src.defaultConsistency)
+            , accountConsistency(src.accountConsistency)
             , isConfigured(src.isConfigured.load())
+            , transport(src.transport)
+            , restClient(transport->restClient)
             , cnxn(std::move(src.cnxn))
+            , completionExecutor(std::move(src.completionExecutor))
+        {
+            applyConfiguration();
+
+            if (src.batchHandler) {
+                // The source's flusher delivers its buffered completions before the handler moves
+                src.batchFlusher.request_stop();
+                if (src.batchFlusher.joinable()) src.batchFlusher.join();
+                setBatchHandler(std::move(src.batchHandler), src.batchSize, src.batchDelay);
+                src.batchHandler = nullptr;
+            }
+        }
+
+        /// @brief Drains this client's async requests (the shared executor may outlive this client) and flushes the pending
+        /// write-behind upserts; the requests still queued after `shutdownTimeout` are cancelled at their next page boundary
+        /// (the requests in flight complete)
+        ~CosmosClient()
         {
+            auto timeout = config["shutdownTimeout"].is_number_integer() ? config["shutdownTimeout"].get<int64_t>() : 30000;
+            drain(std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max<int64_t>(timeout, 0)));
         }
 
 
@@ -703,6 +2894,14 @@ namespace siddiqsoft
                 if (config["connectionStrings"].size() < 1)
                     throw std::invalid_argument("connectionStrings array must contain atleast primary element");
 
+                // The null consistencyLevel is the account's default; an unknown name would silently map to it
+                defaultConsistency = config.value("consistencyLevel", CosmosConsistencyLevel::account);
+                if (!config["consistencyLevel"].is_null() && defaultConsistency == CosmosConsistencyLevel::account)
+                    throw std::invalid_argument(std::format("consistencyLevel unknown: {}", config["consistencyLevel"].dump()));
+
+                // Size the caches, the completion pool and the concurrency limit
+                applyConfiguration();
+
                 // Update the database configuration
                 cnxn.configure(config);
 
@@ -711,6 +2910,16 @@ namespace siddiqsoft
                     serviceSettings = resp.document;
                     // Reconfigure/update the information such as the read location
                     cnxn.configure(serviceSettings);
+                    // The reads may relax but not strengthen the account's consistency
+                    accountConsistency =
+                            serviceSettings
+                                    .value(nlohmann::json::json_pointer("/userConsistencyPolicy/defaultConsistencyLevel"),
+                                           nlohmann::json {})
+                                    .get<CosmosConsistencyLevel>();
+                    if (accountConsistency != CosmosConsistencyLevel::account && defaultConsistency > accountConsistency)
+                        throw std::invalid_argument(std::format("consistencyLevel {} is stronger than the account consistency {}",
+                                                                nlohmann::json(defaultConsistency).dump(),
+                                                                nlohmann::json(accountConsistency).dump()));
                     // Mark as updated
                     isConfigured = true;
                 }
@@ -720,11 +2929,120 @@ namespace siddiqsoft
         }
 
 
+        /// @brief Set the executor for the async callbacks so a slow callback does not hold a worker which would otherwise issue
+        /// the next request. Takes precedence over the `completionThreads`. Set before queuing any async requests.
+        /// @param executor Invoked with the task which delivers a response to its callback; the task must be run exactly once.
+        /// Empty restores the default.
+        /// @return Self
+        CosmosClient& setCompletionExecutor(CosmosCompletionExecutor executor)
+        {
+            completionExecutor = std::move(executor);
+            return *this;
+        }
+
+
+        /// @brief Deliver the completions of the async requests without a callback (`.onResponse`) in batches. The requests with
+        /// a callback are not affected. Set before queuing any async requests.
+        /// @param handler Receives the completed requests and their responses with the type produced by the operation (see
+        /// `CosmosCompletionResponseType`). Invoked from a worker when a batch is full and from the flusher thread when the batch
+        /// is due.
+        /// @param maxItems Deliver a batch once it holds this many completions
+        /// @param maxDelay Deliver a batch once its first completion is this old
+        /// @return Self
+        CosmosClient& setBatchHandler(CosmosBatchCallbackType handler,
+                                      size_t                  maxItems = 256,
+                                      std::chrono::microseconds maxDelay = std::chrono::microseconds(1000))
+        {
+            if (!handler) throw std::invalid_argument("setBatchHandler - handler required");
+            if (batchHandler) throw std::invalid_argument("setBatchHandler - handler already set");
+
+            batchSize  = std::max<size_t>(1, maxItems);
+            batchDelay = std::max(maxDelay, std::chrono::microseconds(1));
+            for (auto i = std::max(1u, std::thread::hardware_concurrency()); i > 0; i--) {
+                auto& shard = batches.emplace_back(std::make_unique<CompletionBatch>());
+                shard->items.reserve(batchSize);
+                shard->spare.reserve(batchSize);
+            }
+            batchHandler = std::move(handler);
+            batchFlusher = std::jthread {std::bind_front(&CosmosClient::batchFlush, this)};
+            return *this;
+        }
+
+
+        /// @brief Stop accepting async requests; further calls to `async` throw. Returns without waiting (see `drain`).
+        /// @param mode With `drain` the queued requests and the pending continuation pages complete. With `cancel` the requests
+        /// which have not started are dropped and the list and query operations stop at the next page boundary; the requests
+        /// in flight complete.
+        void shutdown(CosmosShutdownMode mode = CosmosShutdownMode::drain)
+        {
+            accepting = false;
+            if (mode == CosmosShutdownMode::cancel) {
+                cancelling = true;
+
+                // The requests waiting for the concurrency limit never reach the workers
+                std::deque<CosmosArgumentType> waiting {};
+                {
+                    std::scoped_lock l(limitedMutex);
+                    waiting.swap(limitedRequests);
+                }
+                for (auto& op : waiting) {
+                    dropTask(op);
+                    taskDone();
+                }
+            }
+        }
+
+
+        /// @brief Stop accepting async requests and wait for the queued requests to complete.
+        /// The requests still queued at the deadline are cancelled (see `shutdown`) and the requests in flight complete.
+        /// The write-behind upserts are flushed in either case.
+        /// @param deadline The time by which the queued requests should complete
+        /// @return 200 if every request completed or 207 if some were dropped. The document holds the number of requests
+        /// `completed` while draining, the number `dropped` and the first 100 `droppedRequests` (operation, database,
+        /// collection, id and the continuation token of the page which was not requested).
+        CosmosResponseType drain(std::chrono::steady_clock::time_point deadline)
+        {
+            TimeThis tt {};
+            auto     completed = completedTasks.load();
+
+            shutdown(CosmosShutdownMode::drain);
+            while (auto pending = pendingTasks.load()) {
+                if (deadline == std::chrono::steady_clock::time_point::max()) {
+                    pendingTasks.wait(pending);
+                    continue;
+                }
+                auto now = std::chrono::steady_clock::now();
+                if (now >= deadline) break;
+                std::this_thread::sleep_for(
+                        std::min<std::chrono::steady_clock::duration>(std::chrono::milliseconds(10), deadline - now));
+            }
+
+            // Past the deadline the remaining requests are dropped at their next page boundary
+            if (pendingTasks.load() > 0) shutdown(CosmosShutdownMode::cancel);
+
+            // Sends the pending write-behind upserts
+            if (writeBehindFlusher.joinable()) {
+                writeBehindFlusher.request_stop();
+                writeBehindFlusher.join();
+            }
+
+            while (auto pending = pendingTasks.load()) pendingTasks.wait(pending);
+
+            std::scoped_lock l(droppedMutex);
+            auto             dropped = droppedTasks.load();
+            return {dropped ? 207u : 200u,
+                    {{"completed", completedTasks.load() - completed}, {"dropped", dropped}, {"droppedRequests", droppedRequests}},
+                    std::chrono::microseconds(tt.elapsed().count())};
+        }
+
+
         /// @brief Invokes the requested operation from threadpool
         /// @param arg The request payload. The json must contain at least "operation". The callback is required as member
         /// .onResponse in the op argument.
         void async(CosmosArgumentType&& op) noexcept(false)
         {
+            if (!accepting) throw std::invalid_argument("async - client is shut down");
+
             // We need to perform some basic validations otherwise we cannot expect to throw within the callback as it would be
             // inefficient to throw for such basic validations.
             switch (op.operation) {
@@ -740,40 +3058,52 @@ namespace siddiqsoft
                     if (op.collection.empty()) throw std::invalid_argument("op.collection required");
                     if (op.document.empty()) throw std::invalid_argument("op.document required");
                     if (op.document.value("id", "").empty()) throw std::invalid_argument("op.document[id] required");
-                    if (!op.document.contains(config.at("/partitionKeyNames/0"_json_pointer)))
+                    if (documentPartitionKey(op.document).is_null())
                         throw std::invalid_argument("op.document[] must contain partition key");
                     break;
                 case CosmosOperation::update:
                     if (op.database.empty()) throw std::invalid_argument("op.database required");
                     if (op.collection.empty()) throw std::invalid_argument("op.collection required");
                     if (op.id.empty()) throw std::invalid_argument("op.id required");
-                    if (op.partitionKey.empty()) throw std::invalid_argument("op.partitionKey required");
+                    if (!completePartitionKey(op)) throw std::invalid_argument("op.partitionKey required");
                     if (op.document.empty()) throw std::invalid_argument("op.document required");
                     break;
                     // Query has same requirement as remove and find except for id so we need to split its check
                 case CosmosOperation::query:
                     if (op.database.empty()) throw std::invalid_argument("op.database required");
                     if (op.collection.empty()) throw std::invalid_argument("op.collection required");
-                    if (op.partitionKey.empty()) throw std::invalid_argument("op.partitionKey required");
+                    // The prepared query carries the statement and the partition targeting
+                    if (op.preparedQuery) break;
+                    if (op.partitionKey.empty() && op.partitionKeys.empty())
+                        throw std::invalid_argument("op.partitionKey required");
                     if (op.queryStatement.empty()) throw std::invalid_argument("op.queryStatement required");
                     break;
-                    // Remove and find have same requirements
+                    // Remove, find and execute have same requirements (the id is the stored procedure)
                 case CosmosOperation::remove:
                 case CosmosOperation::find:
+                case CosmosOperation::execute:
                     if (op.database.empty()) throw std::invalid_argument("op.database required");
                     if (op.collection.empty()) throw std::invalid_argument("op.collection required");
                     if (op.id.empty()) throw std::invalid_argument("op.id required");
-                    if (op.partitionKey.empty()) throw std::invalid_argument("op.partitionKey required");
+                    if (!completePartitionKey(op)) throw std::invalid_argument("op.partitionKey required");
                     break;
             }
 
             // Elementary checks..
             if (op.operation == CosmosOperation::notset)
                 throw std::invalid_argument(std::format("{} requires op.operation be valid: {}", __func__, op));
-            if (!op.onResponse) throw std::invalid_argument("async requires op.onResponse be valid callback");
+            if (!op.onResponse && !batchHandler)
+                throw std::invalid_argument("async requires op.onResponse be valid callback (or a batch handler)");
+            if (op.operation == CosmosOperation::find || op.operation == CosmosOperation::query) readConsistency(op);
+
+            // Upserts are held and coalesced when the write-behind window is configured
+            if (op.operation == CosmosOperation::upsert && config.value("writeBehindWindow", 0) > 0) {
+                writeBehind(std::move(op));
+                return;
+            }
 
             // We can now queue the request..
-            asyncWorkers.queue(std::move(op));
+            requeue(std::move(op));
         }
 
 
@@ -785,14 +3115,15 @@ namespace siddiqsoft
             TimeThis tt {};
             auto     ts = DateUtils::RFC7231();
             ReqGet   req {cnxn.current().currentReadUri(),
-                        {{"Authorization", EncryptionUtils::CosmosToken<char>(cnxn.current().Key, "GET", "", "", ts)},
+                        {{"Authorization", CosmosCodec::cosmosToken(cnxn.current().Key, "GET", "", "", ts)},
                          {"x-ms-date", ts},
                          {"x-ms-version", config["apiVersion"]}}};
 
-            auto     resp = restClient.send(req);
+            auto resp = send(req);
             return {resp.status().code,
-                    resp.success() ? std::move(resp["content"]) : resp, // return error/io context
-                    std::chrono::microseconds(tt.elapsed().count())};
+                    responseDocument(resp), // content or error
+                    std::chrono::microseconds(tt.elapsed().count()),
+                    CosmosResponseHeaders {std::move(resp["headers"])}};
         }
 
         /*
@@ -803,7 +3134,7 @@ namespace siddiqsoft
 
                 restClient.send(
                         ReqGet(cnxn.current().currentReadUri(),
-                               {{"Authorization", EncryptionUtils::CosmosToken<char>(cnxn.current().Key, "GET", "", "", ts)},
+                               {{"Authorization", CosmosCodec::cosmosToken(cnxn.current().Key, "GET", "", "", ts)},
                                 {"x-ms-date", ts},
                                 {"x-ms-version", config["apiVersion"]}}),
                         [&callback](const auto& req, const auto& resp) {
@@ -860,14 +3191,15 @@ namespace siddiqsoft
             auto ts   = DateUtils::RFC7231();
             auto path = cnxn.current().currentReadUri() + "dbs";
             auto req  = ReqGet(path,
-                              {{"Authorization", EncryptionUtils::CosmosToken<char>(cnxn.current().Key, "GET", "dbs", "", ts)},
+                              {{"Authorization", CosmosCodec::cosmosToken(cnxn.current().Key, "GET", "dbs", "", ts)},
                                {"x-ms-date", ts},
                                {"x-ms-version", config["apiVersion"]}});
 
-            auto resp = restClient.send(req);
+            auto resp = send(req);
             return {resp.status().code,
-                    resp.success() ? std::move(resp["content"]) : resp, // return error/io context
-                    std::chrono::microseconds(tt.elapsed().count())};
+                    responseDocument(resp), // content or error
+                    std::chrono::microseconds(tt.elapsed().count()),
+                    CosmosResponseHeaders {std::move(resp["headers"])}};
         }
 
 
@@ -879,12 +3211,64 @@ namespace siddiqsoft
             TimeThis tt {};
             auto     ts   = DateUtils::RFC7231();
             auto     path = std::format("{}dbs/{}/colls", cnxn.current().currentReadUri(), ctx.database);
-            auto     auth = EncryptionUtils::CosmosToken<char>(cnxn.current().Key, "GET", "colls", {"dbs/" + ctx.database}, ts);
+            auto     auth = CosmosCodec::cosmosToken(cnxn.current().Key, "GET", "colls", {"dbs/" + ctx.database}, ts);
             auto     req  = ReqGet(path, {{"Authorization", auth}, {"x-ms-date", ts}, {"x-ms-version", config["apiVersion"]}});
-            auto     resp = restClient.send(req);
+            auto resp = send(req);
             return {resp.status().code,
-                    resp.success() ? std::move(resp["content"]) : resp, // return error/io context
-                    std::chrono::microseconds(tt.elapsed().count())};
+                    responseDocument(resp), // content or error
+                    std::chrono::microseconds(tt.elapsed().count()),
+                    CosmosResponseHeaders {std::move(resp["headers"])}};
+        }
+
+
+        /// @brief List the partition key ranges for the given database and collection
+        /// @param ctx Requires the `database` and `collection`
+        /// @return The json document from Cosmos contains the array `PartitionKeyRanges`; each element has the `id` which may be
+        /// used as the `partitionKeyRangeId` for `listDocuments`. The pages are followed until the continuation is empty and the
+        /// ranges of every page are returned; a failed page is returned as is.
+        /// @see https://docs.microsoft.com/en-us/rest/api/cosmos-db/get-partition-key-ranges
+        CosmosResponseType listPartitionKeyRanges(CosmosArgumentType const& ctx)
+        {
+            TimeThis tt {};
+            auto     path = std::format("{}dbs/{}/colls/{}/pkranges", cnxn.current().currentReadUri(), ctx.database, ctx.collection);
+            CosmosResponseType ret {};
+            std::string        continuationToken {};
+
+            do {
+                auto           ts = DateUtils::RFC7231();
+                nlohmann::json headers {
+                        {"Authorization",
+                         CosmosCodec::cosmosToken(cnxn.current().Key,
+                                                  "GET",
+                                                  "pkranges",
+                                                  std::format("dbs/{}/colls/{}", ctx.database, ctx.collection),
+                                                  ts)},
+                        {"x-ms-date", ts},
+                        {"x-ms-version", config["apiVersion"]}};
+                if (!continuationToken.empty()) headers["x-ms-continuation"] = std::move(continuationToken);
+
+                auto req  = ReqGet(path, headers);
+                auto resp = send(req);
+                CosmosResponseType page {resp.status().code,
+                                         responseDocument(resp), // content or error
+                                         std::chrono::microseconds(tt.elapsed().count()),
+                                         CosmosResponseHeaders {std::move(resp["headers"])}};
+                if (!page.success()) return page;
+
+                continuationToken = takeContinuation(page.headers.fields);
+                if (ret.document.is_null()) {
+                    ret = std::move(page);
+                }
+                else if (auto& ranges = page.document["PartitionKeyRanges"]; ranges.is_array()) {
+                    auto& all = ret.document["PartitionKeyRanges"];
+                    for (auto& range : ranges) all.push_back(std::move(range));
+                    ret.document["_count"] = all.size();
+                    ret.headers            = std::move(page.headers);
+                }
+            } while (!continuationToken.empty());
+
+            ret.ttx = std::chrono::microseconds(tt.elapsed().count());
+            return ret;
         }
 
 
@@ -932,20 +3316,429 @@ namespace siddiqsoft
             auto     path = std::format("{}dbs/{}/colls/{}/docs", cnxn.current().currentReadUri(), ctx.database, ctx.collection);
             nlohmann::json headers {
                     {"Authorization",
-                     EncryptionUtils::CosmosToken<char>(
+                     CosmosCodec::cosmosToken(
                              cnxn.current().Key, "GET", "docs", std::format("dbs/{}/colls/{}", ctx.database, ctx.collection), ts)},
                     {"x-ms-date", ts},
                     {"x-ms-version", config["apiVersion"]}};
 
             if (!ctx.continuationToken.empty()) headers["x-ms-continuation"] = ctx.continuationToken;
+            // Restrict the feed to a single partition key range (see listPartitionKeyRanges)
+            if (!ctx.partitionKeyRangeId.empty()) headers["x-ms-documentdb-partitionkeyrangeid"] = ctx.partitionKeyRangeId;
+            if (auto pageSize = pageSizeFor(ctx); pageSize != 0) headers["x-ms-max-item-count"] = pageSize;
 
             auto req  = ReqGet(path, headers);
-            auto resp = restClient.send(req);
+            auto resp = send(req);
+
+            CosmosIterableResponseType ret {{resp.status().code,
+                                             responseDocument(resp), // content or error
+                                             std::chrono::microseconds(tt.elapsed().count()),
+                                             CosmosResponseHeaders {std::move(resp["headers"])}}};
+            ret.continuationToken = takeContinuation(ret.headers.fields);
+            ret.maxItemCount      = nextPageSize(ctx, ret);
+            return ret;
+        }
 
-            return {resp.status().code,
-                    resp.success() ? std::move(resp["content"]) : resp, // return error/io context
-                    std::chrono::microseconds(tt.elapsed().count()),
-                    resp["headers"].value("x-ms-continuation", "")};
+
+        /// @brief Export all of the documents in the collection as NDJSON (one document per line).
+        /// The partition key ranges are read in parallel (each reader pages through its range via `listDocuments`) and the
+        /// documents are handed to the sink as they arrive. The sink is only invoked from the calling thread so it does not need to
+        /// be thread-safe.
+        /// @param ctx Requires the `database` and `collection`. To resume a previous export, set `document` to the `checkpoints`
+        /// object from the previous response. The optional `onResponse` is invoked on the calling thread after each page has been
+        /// written to the sink; the argument carries the `partitionKeyRangeId` and the `continuationToken` to resume from.
+        /// @param sink Invoked with each serialized document (without the trailing newline)
+        /// @param parallelism Maximum number of partition key ranges read concurrently
+        /// @return The status code is `200` if all ranges completed; otherwise the first failure. The document contains `_count`
+        /// and `checkpoints` which is an object keyed by the partition key range id with the `continuationToken` and `done`.
+        /// @remarks At most `2 * parallelism` pages are buffered between the readers and the sink. An exception from a reader
+        /// (such as a document which cannot be serialized) stops the export and is rethrown once every reader has stopped.
+        CosmosResponseType exportDocuments(CosmosArgumentType const&              ctx,
+                                           std::function<void(std::string const&)> sink,
+                                           uint16_t                                parallelism = 4)
+        {
+            TimeThis tt {};
+
+            if (ctx.database.empty()) throw std::invalid_argument("export - I need the database");
+            if (ctx.collection.empty()) throw std::invalid_argument("export - I need the collection");
+            if (!sink) throw std::invalid_argument("export - I need the sink");
+
+            auto rangesResp = listPartitionKeyRanges(ctx);
+            if (!rangesResp.success()) return rangesResp;
+
+            nlohmann::json checkpoints = ctx.document.value("checkpoints", nlohmann::json::object());
+            if (!checkpoints.is_object()) checkpoints = nlohmann::json::object();
+
+            auto listed = rangesResp.document.value("PartitionKeyRanges", nlohmann::json::array());
+
+            // A checkpoint whose range is no longer listed belongs to a range which has split (or merged); the ranges which
+            // replaced it (their `parents` name it) resume from its continuation token. A checkpoint which cannot be carried
+            // over fails the export rather than exporting its documents again.
+            auto stale = [&](std::string const& rangeId) -> CosmosResponseType {
+                return {410,
+                        {{"_count", 0},
+                         {"checkpoints", ctx.document.value("checkpoints", nlohmann::json::object())},
+                         {"error",
+                          {{"code", "Gone"},
+                           {"message", std::format("export - the checkpoint of the partition key range {} is stale", rangeId)}}}},
+                        std::chrono::microseconds(tt.elapsed().count())};
+            };
+            std::set<std::string> listedIds {}, replaced {};
+            for (auto& range : listed) {
+                auto rangeId = range.value("id", "");
+                listedIds.insert(rangeId);
+                if (checkpoints.contains(rangeId)) continue;
+
+                nlohmann::json inherited {};
+                for (auto& parent : range.value("parents", nlohmann::json::array())) {
+                    auto parentId = parent.is_string() ? parent.get<std::string>() : std::string {};
+                    if (auto item = checkpoints.find(parentId); item != checkpoints.end() && item->is_object()) {
+                        // The merged ranges were read from different positions
+                        if (!inherited.is_null() && inherited != *item) return stale(parentId);
+                        inherited = *item;
+                        replaced.insert(parentId);
+                    }
+                }
+                if (!inherited.is_null()) checkpoints[rangeId] = std::move(inherited);
+            }
+            for (auto const& [rangeId, checkpoint] : checkpoints.items()) {
+                if (!listedIds.contains(rangeId) && !replaced.contains(rangeId)) return stale(rangeId);
+            }
+            for (auto const& rangeId : replaced) checkpoints.erase(rangeId);
+
+            // Build the work list; completed ranges from a previous run are skipped
+            std::vector<std::pair<std::string, std::string>> ranges {};
+            for (auto& range : listed) {
+                auto  rangeId    = range.value("id", "");
+                auto& checkpoint = checkpoints[rangeId];
+                if (!checkpoint.is_object()) checkpoint = {{"continuationToken", ""}, {"done", false}};
+                if (!checkpoint.value("done", false)) ranges.emplace_back(rangeId, checkpoint.value("continuationToken", ""));
+            }
+
+            /// Page of serialized documents from a single partition key range
+            struct ExportPage
+            {
+                std::string              partitionKeyRangeId {};
+                std::string              continuationToken {};
+                std::vector<std::string> lines {};
+                uint32_t                 statusCode {};
+                nlohmann::json           error {};
+            };
+
+            if (parallelism < 1) parallelism = 1;
+            CosmosBoundedQueue<ExportPage> pages {size_t(parallelism) * 2};
+            std::atomic_size_t             nextRange {0};
+            std::atomic_size_t             activeReaders {std::min<size_t>(parallelism, ranges.size())};
+            std::mutex                     failureMutex {};
+            std::exception_ptr             failure {};
+
+            auto read = [&]() {
+                for (auto i = nextRange++; i < ranges.size(); i = nextRange++) {
+                    CosmosArgumentType rangeCtx {.operation           = CosmosOperation::listDocuments,
+                                                 .database            = ctx.database,
+                                                 .collection          = ctx.collection,
+                                                 .continuationToken   = ranges[i].second,
+                                                 .partitionKeyRangeId = ranges[i].first};
+                    do {
+                        auto       resp = listDocuments(rangeCtx);
+                        ExportPage page {.partitionKeyRangeId = rangeCtx.partitionKeyRangeId,
+                                         .continuationToken   = resp.continuationToken,
+                                         .statusCode          = resp.statusCode};
+                        if (resp.success()) {
+                            // Serialize on the reader thread so the sink only performs I/O
+                            if (auto& docs = resp.document["Documents"]; docs.is_array()) {
+                                page.lines.reserve(docs.size());
+                                for (auto& doc : docs) page.lines.push_back(doc.dump());
+                            }
+                        }
+                        else {
+                            page.error = std::move(resp.document);
+                        }
+                        // Stop reading this range on failure; the checkpoint retains the last good continuation token
+                        auto more                   = resp.success() && !resp.continuationToken.empty();
+                        rangeCtx.continuationToken = std::move(resp.continuationToken);
+                        // Closed by the writer when the sink or the callback throws
+                        if (!pages.push(std::move(page))) return;
+                        if (!more) break;
+                    } while (true);
+                }
+            };
+
+            auto reader = [&]() {
+                try {
+                    read();
+                }
+                catch (...) {
+                    // Keep the first exception and release the other readers and the writer
+                    std::scoped_lock l(failureMutex);
+                    if (!failure) failure = std::current_exception();
+                    pages.close();
+                }
+                if (--activeReaders == 0) pages.close();
+            };
+
+            std::vector<std::jthread> readers {};
+            for (size_t r = 0; r < activeReaders.load(); r++) readers.emplace_back(reader);
+            if (readers.empty()) pages.close();
+
+            // The calling thread is the sole writer
+            uint32_t       statusCode {200};
+            nlohmann::json lastError {};
+            uint64_t       count {};
+            try {
+                while (auto page = pages.pop()) {
+                    auto& checkpoint = checkpoints[page->partitionKeyRangeId];
+                    if (page->statusCode >= 300) {
+                        if (statusCode < 300) {
+                            statusCode = page->statusCode;
+                            lastError  = std::move(page->error);
+                        }
+                        continue;
+                    }
+
+                    for (auto& line : page->lines) sink(line);
+                    count += page->lines.size();
+
+                    checkpoint["continuationToken"] = page->continuationToken;
+                    checkpoint["done"]              = page->continuationToken.empty();
+                    if (ctx.onResponse) {
+                        ctx.onResponse({.operation           = CosmosOperation::listDocuments,
+                                        .database            = ctx.database,
+                                        .collection          = ctx.collection,
+                                        .continuationToken   = page->continuationToken,
+                                        .partitionKeyRangeId = page->partitionKeyRangeId},
+                                       {200, {{"_count", page->lines.size()}}, std::chrono::microseconds(tt.elapsed().count())});
+                    }
+                }
+            }
+            catch (...) {
+                // Release the readers blocked on the full queue before they are joined
+                pages.close();
+                throw;
+            }
+            readers.clear();
+            if (failure) std::rethrow_exception(failure);
+
+            nlohmann::json result {{"_count", count}, {"checkpoints", std::move(checkpoints)}};
+            if (statusCode >= 300) result["error"] = std::move(lastError);
+            return {statusCode, std::move(result), std::chrono::microseconds(tt.elapsed().count())};
+        }
+
+
+        /// @brief Export all of the documents in the collection as NDJSON to the given output stream
+        /// @param ctx See `exportDocuments`
+        /// @param out Destination stream; each document is written followed by a newline
+        /// @param parallelism Maximum number of partition key ranges read concurrently
+        /// @return See `exportDocuments`
+        CosmosResponseType exportDocuments(CosmosArgumentType const& ctx, std::ostream& out, uint16_t parallelism = 4)
+        {
+            return exportDocuments(
+                    ctx, [&out](std::string const& line) { out << line << '\n'; }, parallelism);
+        }
+
+
+        /// @brief Import the NDJSON (one document per line) into the collection using upsert.
+        /// The source is split into `parallelism` chunks on line boundaries which are scanned concurrently; only the `id` and the
+        /// partition key are extracted from each line (no json object is built) and the lines are grouped by partition key into
+        /// batches. The batches are handed over to `parallelism` writers so scanning overlaps with the network I/O. Each batch is
+        /// sent as a single batch request whose body is built from the lines as they are in the source.
+        /// @param ctx Requires the `database` and `collection`. The optional `onResponse` receives progress after each batch with
+        /// the document containing `_count`, `imported`, `failed`, `bytes`, `docsPerSecond` and `bytesPerSecond`.
+        /// @param ndjson The source; must remain valid for the duration of the call
+        /// @param parallelism Number of scanners and number of writers
+        /// @return The status code is `200` if every line was imported; otherwise `207`. The document contains the final progress
+        /// along with up to 100 `errors` with the byte `offset` of the line and its `statusCode`.
+        /// @remarks Throttled (429) documents are retried up to `libRetryLimit` times. An exception from a writer or from the
+        /// `onResponse` stops the import and is rethrown once every thread has stopped.
+        CosmosResponseType importDocuments(CosmosArgumentType const& ctx, std::string_view ndjson, uint16_t parallelism = 4)
+        {
+            TimeThis tt {};
+
+            if (ctx.database.empty()) throw std::invalid_argument("import - I need the database");
+            if (ctx.collection.empty()) throw std::invalid_argument("import - I need the collection");
+
+            /// Lines from the same partition
+            struct ImportBatch
+            {
+                nlohmann::json                partitionKey {};
+                std::vector<std::string_view> lines {};
+            };
+
+            constexpr size_t MaxBatchSize {100};
+            constexpr size_t MaxPendingLines {1000}; // Partial batches held by a scanner across every partition key
+            constexpr size_t MaxErrors {100};
+            auto const       pkNames = partitionKeyNames();
+
+            if (parallelism < 1) parallelism = 1;
+            CosmosBoundedQueue<ImportBatch> batches {size_t(parallelism) * 2};
+            std::atomic_uint64_t            lineCount {0}, importedCount {0}, failedCount {0}, bytesCount {0};
+            std::mutex                      progressMutex {};
+            nlohmann::json                  errors = nlohmann::json::array();
+            std::exception_ptr              failure {};
+            std::atomic_bool                aborted {false};
+
+            auto recordFailure = [&](std::string_view line, uint32_t statusCode) {
+                failedCount++;
+                std::scoped_lock l(progressMutex);
+                if (errors.size() < MaxErrors) errors.push_back({{"offset", line.data() - ndjson.data()}, {"statusCode", statusCode}});
+            };
+
+            // Keep the first exception and release the threads blocked on the queue
+            auto abort = [&]() {
+                {
+                    std::scoped_lock l(progressMutex);
+                    if (!failure) failure = std::current_exception();
+                }
+                aborted = true;
+                batches.close();
+            };
+
+            auto progress = [&]() -> nlohmann::json {
+                auto elapsed = std::max<double>(1.0, double(tt.elapsed().count())) / 1e6;
+                return {{"_count", lineCount.load()},
+                        {"imported", importedCount.load()},
+                        {"failed", failedCount.load()},
+                        {"bytes", bytesCount.load()},
+                        {"docsPerSecond", double(importedCount.load()) / elapsed},
+                        {"bytesPerSecond", double(bytesCount.load()) / elapsed}};
+            };
+
+            auto scanner = [&](std::string_view chunk) {
+                try {
+                    std::unordered_map<std::string, ImportBatch> pending {};
+                    size_t                                       pendingLines {0};
+
+                    // Returns false once the queue has been closed by a failed writer
+                    auto flush = [&]() {
+                        for (auto& [pk, batch] : pending) {
+                            if (!batch.lines.empty() && !batches.push(std::move(batch))) return false;
+                        }
+                        pending.clear();
+                        pendingLines = 0;
+                        return true;
+                    };
+
+                    while (!chunk.empty()) {
+                        auto eol  = CosmosCodec::find(chunk, '\n');
+                        auto line = chunk.substr(0, eol);
+                        chunk.remove_prefix(eol == std::string_view::npos ? chunk.size() : eol + 1);
+                        if (line.ends_with('\r')) line.remove_suffix(1);
+                        if (line.find_first_not_of(" \t") == std::string_view::npos) continue;
+
+                        lineCount++;
+                        if (auto keys = CosmosKeyExtractor::extract(line, pkNames); keys) {
+                            auto& batch = pending[partitionKeyString(keys->partitionKey)];
+                            if (batch.lines.empty()) batch.partitionKey = std::move(keys->partitionKey);
+                            batch.lines.push_back(line);
+                            pendingLines++;
+                            if (batch.lines.size() >= MaxBatchSize) {
+                                pendingLines -= batch.lines.size();
+                                if (!batches.push(std::exchange(batch, {}))) return;
+                            }
+                            // Sources with many partition keys rarely fill a batch; the partial batches are handed over rather
+                            // than held until the end of the chunk
+                            if (pendingLines >= MaxPendingLines && !flush()) return;
+                        }
+                        else {
+                            recordFailure(line, 400);
+                        }
+                    }
+                    flush();
+                }
+                catch (...) {
+                    abort();
+                }
+            };
+
+            auto writer = [&]() {
+                try {
+                    for (auto batch = batches.pop(); batch && !aborted; batch = batches.pop()) {
+                        auto results = upsertBatch(ctx.database, ctx.collection, batch->partitionKey, batch->lines);
+                        for (size_t i = 0; i < results.size(); i++) {
+                            if (results[i].success()) {
+                                importedCount++;
+                                bytesCount += batch->lines[i].size();
+                            }
+                            else {
+                                recordFailure(batch->lines[i], results[i].statusCode);
+                            }
+                        }
+
+                        if (ctx.onResponse) {
+                            std::scoped_lock l(progressMutex);
+                            ctx.onResponse(ctx, {200, progress(), std::chrono::microseconds(tt.elapsed().count())});
+                        }
+                    }
+                }
+                catch (...) {
+                    abort();
+                }
+            };
+
+            std::vector<std::jthread> writers {};
+            for (auto w = 0; w < parallelism; w++) writers.emplace_back(writer);
+
+            {
+                // Split the source into chunks on line boundaries
+                std::vector<std::jthread> scanners {};
+                auto                      chunkSize = std::max<size_t>(1, ndjson.size() / parallelism);
+                for (size_t start = 0; start < ndjson.size();) {
+                    auto end = std::min(ndjson.size(), start + chunkSize);
+                    if (auto eol = CosmosCodec::find(ndjson, '\n', end); end < ndjson.size())
+                        end = (eol == std::string_view::npos) ? ndjson.size() : eol + 1;
+                    scanners.emplace_back(scanner, ndjson.substr(start, end - start));
+                    start = end;
+                }
+            }
+            // All of the scanners have completed; let the writers drain the queue
+            batches.close();
+            writers.clear();
+            if (failure) std::rethrow_exception(failure);
+
+            auto result      = progress();
+            result["errors"] = std::move(errors);
+            return {failedCount.load() == 0 ? 200u : 207u, std::move(result), std::chrono::microseconds(tt.elapsed().count())};
+        }
+
+
+        /// @brief Import the NDJSON file into the collection. The file is memory mapped; see `importDocuments`.
+        /// @param ctx See `importDocuments`
+        /// @param source Path to the NDJSON file
+        /// @param parallelism Number of scanners and number of writers
+        /// @return See `importDocuments`
+        CosmosResponseType importFile(CosmosArgumentType const& ctx, std::filesystem::path const& source, uint16_t parallelism = 4)
+        {
+            HANDLE file = CreateFileW(
+                    source.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+            if (file == INVALID_HANDLE_VALUE) throw std::invalid_argument("import - I need a readable source file");
+
+            LARGE_INTEGER fileSize {};
+            if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+                CloseHandle(file);
+                return importDocuments(ctx, {}, parallelism);
+            }
+
+            HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            auto   view    = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+            if (view == nullptr) {
+                if (mapping) CloseHandle(mapping);
+                CloseHandle(file);
+                throw std::invalid_argument("import - Unable to map the source file");
+            }
+
+            try {
+                auto resp = importDocuments(
+                        ctx, std::string_view {static_cast<const char*>(view), size_t(fileSize.QuadPart)}, parallelism);
+                UnmapViewOfFile(view);
+                CloseHandle(mapping);
+                CloseHandle(file);
+                return resp;
+            }
+            catch (...) {
+                UnmapViewOfFile(view);
+                CloseHandle(mapping);
+                CloseHandle(file);
+                throw;
+            }
         }
 
 
@@ -960,31 +3753,31 @@ namespace siddiqsoft
             TimeThis tt {};
 
             if (ctx.document.value("id", "").empty()) throw std::invalid_argument("create - I need the uniqueid of the document");
-            if (!ctx.document.contains(config.at("/partitionKeyNames/0"_json_pointer)))
-                throw std::invalid_argument("create - I need the partitionId of the document");
+            auto pkId = documentPartitionKey(ctx.document);
+            if (pkId.is_null()) throw std::invalid_argument("create - I need the partitionId of the document");
 
-            auto                ts        = DateUtils::RFC7231();
-            std::string&        pkKeyName = config.at("/partitionKeyNames/0"_json_pointer).get_ref<std::string&>();
-            auto                pkId      = ctx.document.value(pkKeyName, "");
+            auto ts = DateUtils::RFC7231();
 
             siddiqsoft::ReqPost req {
                     std::format("{}dbs/{}/colls/{}/docs", cnxn.current().currentWriteUri(), ctx.database, ctx.collection),
                     {{"Authorization",
-                      EncryptionUtils::CosmosToken<char>(cnxn.current().Key,
-                                                         "POST",
-                                                         "docs",
-                                                         std::format("dbs/{}/colls/{}", ctx.database, ctx.collection),
-                                                         ts)},
+                      CosmosCodec::cosmosToken(cnxn.current().Key,
+                                               "POST",
+                                               "docs",
+                                               std::format("dbs/{}/colls/{}", ctx.database, ctx.collection),
+                                               ts)},
                      {"x-ms-date", ts},
-                     {"x-ms-documentdb-partitionkey", nlohmann::json {pkId}},
+                     {"x-ms-documentdb-partitionkey", pkId},
                      {"x-ms-version", config["apiVersion"]},
                      {"x-ms-cosmos-allow-tentative-writes", "true"}},
                     ctx.document};
-            auto resp = restClient.send(req);
+            auto resp = send(req);
+            invalidateDocument(ctx.database, ctx.collection, partitionKeyString(pkId), ctx.document.value("id", ""));
 
             return {resp.status().code,
-                    resp.success() ? std::move(resp["content"]) : resp, // return error/io context
-                    std::chrono::microseconds(tt.elapsed().count())};
+                    responseDocument(resp), // content or error
+                    std::chrono::microseconds(tt.elapsed().count()),
+                    CosmosResponseHeaders {std::move(resp["headers"])}};
         }
 
 
@@ -1000,31 +3793,32 @@ namespace siddiqsoft
             TimeThis tt {};
 
             if (ctx.document.value("id", "").empty()) throw std::invalid_argument("upsert - I need the uniqueid of the document");
-            if (!ctx.document.contains(config.at("/partitionKeyNames/0"_json_pointer)))
-                throw std::invalid_argument("upsert - I need the partitionId of the document");
+            auto pkId = documentPartitionKey(ctx.document);
+            if (pkId.is_null()) throw std::invalid_argument("upsert - I need the partitionId of the document");
 
-            auto ts   = DateUtils::RFC7231();
-            auto pkId = ctx.document.value(config.at("/partitionKeyNames/0"_json_pointer).get_ref<std::string&>(), "");
+            auto ts = DateUtils::RFC7231();
 
             siddiqsoft::ReqPost req {
                     std::format("{}dbs/{}/colls/{}/docs", cnxn.current().currentWriteUri(), ctx.database, ctx.collection),
                     {{"Authorization",
-                      EncryptionUtils::CosmosToken<char>(cnxn.current().Key,
-                                                         "POST",
-                                                         "docs",
-                                                         std::format("dbs/{}/colls/{}", ctx.database, ctx.collection),
-                                                         ts)},
+                      CosmosCodec::cosmosToken(cnxn.current().Key,
+                                               "POST",
+                                               "docs",
+                                               std::format("dbs/{}/colls/{}", ctx.database, ctx.collection),
+                                               ts)},
                      {"x-ms-date", ts},
-                     {"x-ms-documentdb-partitionkey", nlohmann::json {pkId}},
+                     {"x-ms-documentdb-partitionkey", pkId},
                      {"x-ms-documentdb-is-upsert", "true"},
                      {"x-ms-version", config["apiVersion"]},
                      {"x-ms-cosmos-allow-tentative-writes", "true"}},
                     ctx.document};
 
-            auto resp = restClient.send(req);
+            auto resp = send(req);
+            invalidateDocument(ctx.database, ctx.collection, partitionKeyString(pkId), ctx.document.value("id", ""));
             return {resp.status().code,
-                    resp.success() ? std::move(resp["content"]) : resp, // return error/io context
-                    std::chrono::microseconds(tt.elapsed().count())};
+                    responseDocument(resp), // content or error
+                    std::chrono::microseconds(tt.elapsed().count()),
+                    CosmosResponseHeaders {std::move(resp["headers"])}};
         }
 
 
@@ -1040,28 +3834,30 @@ namespace siddiqsoft
             auto     ts = DateUtils::RFC7231();
 
             if (ctx.id.empty()) throw std::invalid_argument("update - I need the docId of the document");
-            if (ctx.partitionKey.empty()) throw std::invalid_argument("update - I need the pkId of the document");
+            if (!completePartitionKey(ctx)) throw std::invalid_argument("update - I need the pkId of the document");
             if (ctx.document.is_null() || ctx.document.size() == 0) throw std::invalid_argument("update - Need the document");
 
             siddiqsoft::ReqPut req {
                     std::format(
                             "{}dbs/{}/colls/{}/docs/{}", cnxn.current().currentWriteUri(), ctx.database, ctx.collection, ctx.id),
                     {{"Authorization",
-                      EncryptionUtils::CosmosToken<char>(
+                      CosmosCodec::cosmosToken(
                               cnxn.current().Key,
                               "PUT",
                               "docs",
                               std::format("dbs/{}/colls/{}/docs/{}", ctx.database, ctx.collection, ctx.id),
                               ts)},
                      {"x-ms-date", ts},
-                     {"x-ms-documentdb-partitionkey", nlohmann::json {ctx.partitionKey}},
+                     {"x-ms-documentdb-partitionkey", requestPartitionKey(ctx)},
                      {"x-ms-version", config["apiVersion"]},
                      {"x-ms-cosmos-allow-tentative-writes", "true"}},
                     ctx.document};
-            auto resp = restClient.send(req);
+            auto resp = send(req);
+            invalidateDocument(ctx.database, ctx.collection, partitionKeyString(requestPartitionKey(ctx)), ctx.id);
             return {resp.status().code,
-                    resp.success() ? std::move(resp["content"]) : resp, // return error/io context
-                    std::chrono::microseconds(tt.elapsed().count())};
+                    responseDocument(resp), // content or error
+                    std::chrono::microseconds(tt.elapsed().count()),
+                    CosmosResponseHeaders {std::move(resp["headers"])}};
         }
 
 
@@ -1075,28 +3871,204 @@ namespace siddiqsoft
         /// @remarks The remove operation returns no data beyond the status code.
         uint32_t removeDocument(CosmosArgumentType const& ctx)
         {
-            auto ts = DateUtils::RFC7231();
-
             if (ctx.id.empty()) throw std::invalid_argument("remove - I need the docId of the document");
-            if (ctx.partitionKey.empty()) throw std::invalid_argument("remove - I need the pkId of the document");
+            if (!completePartitionKey(ctx)) throw std::invalid_argument("remove - I need the pkId of the document");
 
-            siddiqsoft::ReqDelete req {
+            return sendRemoveDocument(ctx).statusCode;
+        }
+
+
+        /// @brief Removes every document in the partition.
+        /// The service's delete-by-partition-key operation is used when it is available (it completes in the background on the
+        /// service). Otherwise the ids are streamed by a query and removed by `parallelism` threads; throttled removes are retried
+        /// up to `libRetryLimit` times after the requested back-off.
+        /// @param ctx The `database`, `collection` and the complete partition key (`partitionKey` or `partitionKeys`). The
+        /// optional `onResponse` is invoked with the progress after each page of ids.
+        /// @param parallelism Number of concurrent removes when streaming
+        /// @return `200` when every document was removed (or the partition delete was accepted) otherwise `207` with
+        /// `{"_count", "removed", "failed", "method"}` where the method is `partitionKeyDelete` or `query`. A failed query
+        /// returns its status along with the `error`.
+        CosmosResponseType removeAll(CosmosArgumentType const& ctx, uint16_t parallelism = 4)
+        {
+            TimeThis tt {};
+
+            if (ctx.database.empty()) throw std::invalid_argument("removeAll - I need the database");
+            if (ctx.collection.empty()) throw std::invalid_argument("removeAll - I need the collection");
+            if (!completePartitionKey(ctx)) throw std::invalid_argument("removeAll - I need the pkId of the partition");
+
+            auto pkId = requestPartitionKey(ctx);
+
+            if (!partitionKeyDeleteUnsupported) {
+                auto                 ts = DateUtils::RFC7231();
+                siddiqsoft::ReqPost req {std::format("{}dbs/{}/colls/{}/operations/partitionkeydelete",
+                                                     cnxn.current().currentWriteUri(),
+                                                     ctx.database,
+                                                     ctx.collection),
+                                         {{"Authorization",
+                                           CosmosCodec::cosmosToken(cnxn.current().Key,
+                                                                    "POST",
+                                                                    "partitionkey",
+                                                                    std::format("dbs/{}/colls/{}", ctx.database, ctx.collection),
+                                                                    ts)},
+                                          {"x-ms-date", ts},
+                                          {"x-ms-documentdb-partitionkey", pkId},
+                                          {"x-ms-version", config["apiVersion"]}},
+                                         nlohmann::json::object()};
+
+                auto resp = send(req);
+                if (resp.success()) {
+                    invalidatePartition(ctx.database, ctx.collection, partitionKeyString(pkId));
+                    return {resp.status().code,
+                            {{"_count", 0}, {"removed", 0}, {"failed", 0}, {"method", "partitionKeyDelete"}},
+                            std::chrono::microseconds(tt.elapsed().count())};
+                }
+                // Only the statuses that mean the operation is not implemented disable it for the client. Any other failure
+                // (including a 400 when the feature is not enabled on the account) falls back to the query for this call alone.
+                if (auto code = resp.status().code; code == 405 || code == 501) partitionKeyDeleteUnsupported = true;
+            }
+
+            auto const retryLimit = config.value("libRetryLimit", 7);
+            if (parallelism < 1) parallelism = 1;
+
+            CosmosBoundedQueue<std::string> ids {size_t(parallelism) * 100};
+            std::atomic_uint64_t            idCount {0}, removedCount {0}, failedCount {0};
+            std::mutex                      progressMutex {};
+
+            auto progress = [&]() -> nlohmann::json {
+                return {{"_count", idCount.load()},
+                        {"removed", removedCount.load()},
+                        {"failed", failedCount.load()},
+                        {"method", "query"}};
+            };
+
+            auto remover = [&]() {
+                CosmosArgumentType removeCtx {.operation     = CosmosOperation::remove,
+                                              .database      = ctx.database,
+                                              .collection    = ctx.collection,
+                                              .partitionKey  = ctx.partitionKey,
+                                              .partitionKeys = ctx.partitionKeys};
+                while (auto id = ids.pop()) {
+                    removeCtx.id = std::move(*id);
+                    uint32_t rc {};
+                    for (auto attempt = 1;; attempt++) {
+                        auto resp = sendRemoveDocument(removeCtx);
+                        if (rc = resp.statusCode; rc != 429 || attempt >= retryLimit) break;
+                        std::this_thread::sleep_for(retryAfter(resp));
+                    }
+                    // Already removed is as good as removed
+                    if (rc == 204 || rc == 404)
+                        removedCount++;
+                    else
+                        failedCount++;
+                }
+            };
+
+            std::vector<std::jthread> removers {};
+            for (auto r = 0; r < parallelism; r++) removers.emplace_back(remover);
+
+            // The ids are streamed while the earlier pages are removed
+            auto idRange = documents({.database         = ctx.database,
+                                      .collection       = ctx.collection,
+                                      .partitionKey     = ctx.partitionKey,
+                                      .queryStatement   = "SELECT c.id FROM c",
+                                      .adaptivePageSize = true,
+                                      .partitionKeys    = ctx.partitionKeys});
+            try {
+                for (auto& doc : idRange) {
+                    ids.push(doc.value("id", ""));
+                    if ((++idCount % 100) == 0 && ctx.onResponse) {
+                        std::scoped_lock l(progressMutex);
+                        ctx.onResponse(ctx, {200, progress(), std::chrono::microseconds(tt.elapsed().count())});
+                    }
+                }
+            }
+            catch (...) {
+                ids.close();
+                throw;
+            }
+            ids.close();
+            removers.clear();
+
+            auto result = progress();
+            if (!idRange.status().success()) {
+                result["error"] = idRange.status().document;
+                return {idRange.status().statusCode, std::move(result), std::chrono::microseconds(tt.elapsed().count())};
+            }
+            return {failedCount.load() == 0 ? 200u : 207u, std::move(result), std::chrono::microseconds(tt.elapsed().count())};
+        }
+
+
+        /// @brief Executes the stored procedure within the partition
+        /// @param ctx The `database`, `collection`, the stored procedure `id`, the partition key (`partitionKey` or
+        /// `partitionKeys`) and the arguments as a json array in the `document` (empty for none)
+        /// @return The status code, the stored procedure's result and the request charge. On failure the document holds the
+        /// error/io context.
+        /// @see https://docs.microsoft.com/en-us/rest/api/cosmos-db/execute-a-stored-procedure
+        CosmosStoredProcedureResponseType executeStoredProcedure(CosmosArgumentType const& ctx)
+        {
+            TimeThis tt {};
+            auto     ts = DateUtils::RFC7231();
+
+            if (ctx.id.empty()) throw std::invalid_argument("execute - I need the id of the stored procedure");
+            if (!completePartitionKey(ctx)) throw std::invalid_argument("execute - I need the pkId of the partition");
+            if (!ctx.document.is_null() && !ctx.document.is_array())
+                throw std::invalid_argument("execute - The arguments must be an array");
+
+            siddiqsoft::ReqPost req {
                     std::format(
-                            "{}dbs/{}/colls/{}/docs/{}", cnxn.current().currentWriteUri(), ctx.database, ctx.collection, ctx.id),
+                            "{}dbs/{}/colls/{}/sprocs/{}", cnxn.current().currentWriteUri(), ctx.database, ctx.collection, ctx.id),
                     {{"Authorization",
-                      EncryptionUtils::CosmosToken<char>(
+                      CosmosCodec::cosmosToken(
                               cnxn.current().Key,
-                              "DELETE",
-                              "docs",
-                              std::format("dbs/{}/colls/{}/docs/{}", ctx.database, ctx.collection, ctx.id),
+                              "POST",
+                              "sprocs",
+                              std::format("dbs/{}/colls/{}/sprocs/{}", ctx.database, ctx.collection, ctx.id),
                               ts)},
                      {"x-ms-date", ts},
-                     {"x-ms-documentdb-partitionkey", nlohmann::json {ctx.partitionKey}},
+                     {"x-ms-documentdb-partitionkey", requestPartitionKey(ctx)},
                      {"x-ms-version", config["apiVersion"]},
-                     {"x-ms-cosmos-allow-tentative-writes", "true"}}};
-            auto resp = restClient.send(req);
+                     {"Content-Type", "application/json"}},
+                    ctx.document.is_null() ? nlohmann::json::array() : ctx.document};
+
+            auto resp = send(req);
+            auto charge = requestCharge(resp["headers"]);
+            // The stored procedure may have written any document in the partition
+            invalidatePartition(ctx.database, ctx.collection, partitionKeyString(requestPartitionKey(ctx)));
+            return {{resp.status().code,
+                     responseDocument(resp), // content or error
+                     std::chrono::microseconds(tt.elapsed().count()),
+                     CosmosResponseHeaders {std::move(resp["headers"])}},
+                    charge};
+        }
 
-            return resp.status().code;
+
+        /// @brief Executes the stored procedure repeatedly for long-running work.
+        /// Stored procedures are bounded in time so bulk work returns its progress (for example a continuation token) and is
+        /// invoked again until done.
+        /// @param ctx See `executeStoredProcedure`; the `document` holds the arguments for the first execution
+        /// @param continueWith Invoked with each successful response; returns the arguments for the next execution or empty when
+        /// the work is complete
+        /// @return The last response with the request charge summed over every execution
+        CosmosStoredProcedureResponseType
+        executeStoredProcedure(CosmosArgumentType const&                                                          ctx,
+                               std::function<std::optional<nlohmann::json>(CosmosStoredProcedureResponseType const&)> continueWith)
+        {
+            TimeThis           tt {};
+            CosmosArgumentType next {ctx};
+            double             charge {};
+
+            while (true) {
+                auto resp = executeStoredProcedure(next);
+                charge += resp.requestCharge;
+                std::optional<nlohmann::json> args {};
+                if (resp.success() && continueWith) args = continueWith(resp);
+                if (!args) {
+                    resp.requestCharge = charge;
+                    resp.ttx           = std::chrono::microseconds(tt.elapsed().count());
+                    return resp;
+                }
+                next.document = std::move(*args);
+            }
         }
 
 
@@ -1146,48 +4118,115 @@ namespace siddiqsoft
         /// ```
         CosmosIterableResponseType queryDocuments(CosmosArgumentType const& ctx)
         {
-            TimeThis       tt {};
-            auto           ts    = DateUtils::RFC7231();
-            auto           count = 0;
-            nlohmann::json headers {
-                    {"Authorization",
-                     EncryptionUtils::CosmosToken<char>(
-                             cnxn.current().Key, "POST", "docs", std::format("dbs/{}/colls/{}", ctx.database, ctx.collection), ts)},
-                    {"x-ms-date", ts},
-                    {"x-ms-max-item-count", -1}, // -1: Let Cosmos figure out item count
-                    {"x-ms-documentdb-isquery", "true"},
-                    {"x-ms-version", config["apiVersion"]},
-                    {"Content-Type", "application/query+json"}};
+            if (ctx.queryStatement.empty() && !ctx.preparedQuery) throw std::invalid_argument("Missing queryStatement");
+            auto headers = queryHeaders(ctx);
+
+            // Concurrent identical query pages share a single round trip; only the pages requested since the same invalidation
+            // share it
+            if (config.value("singleFlight", false)) {
+                return singleFlight(std::format("{}\n{}", cacheGeneration.load(), queryFlightKey(ctx, headers)),
+                                    [&]() { return sendQueryDocuments(ctx, std::move(headers)); });
+            }
+
+            return sendQueryDocuments(ctx, std::move(headers));
+        }
 
-            if (ctx.queryStatement.empty()) throw std::invalid_argument("Missing queryStatement");
 
-            if (ctx.partitionKey.starts_with("*")) {
-                // Special case query with partitioned data set.
-                headers["x-ms-documentdb-query-enablecrosspartition"] = "true";
-                // This is required if the client does not provide partitionkey
-                headers["x-ms-query-enable-crosspartition"] = "true";
-            }
-            else if (!ctx.partitionKey.empty()) {
-                // Specific partition set by client.
-                headers["x-ms-documentdb-partitionkey"] = nlohmann::json {ctx.partitionKey};
+        /// @brief The headers for a query page except for the date and the authorization: the partition targeting (an explicit
+        /// partition key takes precedence over the prepared targeting), the continuation, the page size, the continuation token
+        /// limit, the consistency and the integrated cache options
+        /// @param ctx The request
+        /// @return The headers
+        /// @throws std::invalid_argument if the consistency is stronger than the account's consistency
+        nlohmann::json queryHeaders(CosmosArgumentType const& ctx) const
+        {
+            // The prepared query carries the static headers along with its partition targeting
+            nlohmann::json headers = ctx.preparedQuery ? ctx.preparedQuery->headers()
+                                                       : nlohmann::json {{"x-ms-max-item-count", -1}, // -1: Let Cosmos figure out item count
+                                                                         {"x-ms-documentdb-isquery", "true"},
+                                                                         {"Content-Type", "application/query+json"}};
+
+            // An explicit partition key replaces the prepared targeting (a single partition is not queried cross-partition)
+            if (!ctx.partitionKeys.empty() || !ctx.partitionKey.empty()) {
+                headers.erase("x-ms-documentdb-partitionkey");
+                headers.erase("x-ms-documentdb-query-enablecrosspartition");
+                headers.erase("x-ms-query-enable-crosspartition");
+                if (!ctx.partitionKeys.empty())
+                    CosmosPreparedQuery::applyPartitionKey(headers, ctx.partitionKeys);
+                else
+                    CosmosPreparedQuery::applyPartitionKey(headers, ctx.partitionKey);
             }
 
             if (!ctx.continuationToken.empty()) {
                 headers["x-ms-continuation"] = ctx.continuationToken;
             }
 
-            ReqPost req {std::format("{}dbs/{}/colls/{}/docs", cnxn.current().currentWriteUri(), ctx.database, ctx.collection),
-                         headers,
-                         !ctx.queryParameters.is_null() && ctx.queryParameters.is_array()
-                                 ? nlohmann::json {{"query", ctx.queryStatement}, {"parameters", ctx.queryParameters}}
-                                 : nlohmann::json {{"query", ctx.queryStatement}}};
+            if (auto pageSize = pageSizeFor(ctx); pageSize != 0) headers["x-ms-max-item-count"] = pageSize;
 
-            auto    resp = restClient.send(req);
+            if (auto consistency = readConsistency(ctx); consistency != CosmosConsistencyLevel::account)
+                headers["x-ms-consistency-level"] = consistency;
+            applyIntegratedCache(headers, ctx);
 
-            return {resp.status().code,                                 // status code
-                    resp.success() ? std::move(resp["content"]) : resp, // return error/io context // document or empty json
-                    std::chrono::microseconds(tt.elapsed().count()),
-                    resp["headers"].value("x-ms-continuation", "")}; //  continuation token or empty
+            // Ask the server to bound the continuation token we will be sending back on every page
+            if (auto limit = ctx.continuationTokenLimitInKb > 0 ? ctx.continuationTokenLimitInKb
+                                                                : config.value("continuationTokenLimitInKb", 0);
+                limit > 0)
+                headers["x-ms-documentdb-responsecontinuationtokenlimitinkb"] = std::to_string(limit);
+
+            return headers;
+        }
+
+
+        /// @brief The single-flight key for a query page: the collection, the effective headers from `queryHeaders` (which include
+        /// the partition targeting of a prepared query) and the query body
+        /// @param ctx The request
+        /// @param headers The headers from `queryHeaders`
+        /// @return The key
+        static std::string queryFlightKey(CosmosArgumentType const& ctx, nlohmann::json const& headers)
+        {
+            return std::format("query\n{}\n{}\n{}\n{}\n{}",
+                               ctx.database,
+                               ctx.collection,
+                               headers.dump(),
+                               ctx.preparedQuery ? ctx.preparedQuery->content().dump() : nlohmann::json {ctx.queryStatement}.dump(),
+                               ctx.preparedQuery ? std::string {} : ctx.queryParameters.dump());
+        }
+
+
+        /// @brief Performs the query for `queryDocuments`
+        /// @param ctx The validated request
+        /// @param headers The headers from `queryHeaders`
+        /// @return The response page from Cosmos
+        CosmosIterableResponseType sendQueryDocuments(CosmosArgumentType const& ctx, nlohmann::json&& headers)
+        {
+            TimeThis tt {};
+            auto     ts = DateUtils::RFC7231();
+
+            headers["Authorization"] = CosmosCodec::cosmosToken(
+                    cnxn.current().Key, "POST", "docs", std::format("dbs/{}/colls/{}", ctx.database, ctx.collection), ts);
+            headers["x-ms-date"]    = ts;
+            headers["x-ms-version"] = config["apiVersion"];
+
+            // The prepared body is handed to the request as is (the snapshot is kept while the request is built)
+            auto           prepared = ctx.preparedQuery ? ctx.preparedQuery->sharedContent() : nullptr;
+            nlohmann::json statement {};
+            if (!prepared) {
+                statement = {{"query", ctx.queryStatement}};
+                if (!ctx.queryParameters.is_null() && ctx.queryParameters.is_array()) statement["parameters"] = ctx.queryParameters;
+            }
+            ReqPost req {std::format("{}dbs/{}/colls/{}/docs", cnxn.current().currentWriteUri(), ctx.database, ctx.collection),
+                         std::move(headers),
+                         prepared ? *prepared : statement};
+
+            auto resp = send(req);
+
+            CosmosIterableResponseType ret {{resp.status().code,                                 // status code
+                                             responseDocument(resp), // content or error
+                                             std::chrono::microseconds(tt.elapsed().count()),
+                                             CosmosResponseHeaders {std::move(resp["headers"])}}};
+            ret.continuationToken = takeContinuation(ret.headers.fields); //  continuation token or empty
+            ret.maxItemCount      = nextPageSize(ctx, ret);
+            return ret;
         }
 
 
@@ -1215,39 +4254,502 @@ namespace siddiqsoft
         /// @remarks
         /// We do not modify or abstract the contents.
         CosmosResponseType findDocument(CosmosArgumentType const& ctx)
+        {
+            if (ctx.id.empty()) throw std::invalid_argument("find - I need the docId of the document");
+            if (!completePartitionKey(ctx)) throw std::invalid_argument("find - I need the pkId of the document");
+            auto consistency = readConsistency(ctx);
+
+            // A read bypassing the integrated cache wants the current document; the client caches are neither used nor filled
+            auto negativeTtl  = std::chrono::milliseconds(ctx.bypassIntegratedCache ? 0 : config.value("negativeCacheTtl", 0));
+            auto pointReadTtl = std::chrono::milliseconds(ctx.bypassIntegratedCache ? 0 : config.value("pointReadCacheTtl", 0));
+            auto key          = documentKey(ctx.database, ctx.collection, partitionKeyString(requestPartitionKey(ctx)), ctx.id);
+
+            // Recently missing documents are not looked up again; the filter avoids the cache lock for most keys. The entries
+            // read with a weaker consistency than requested are not used.
+            auto cached = cachedConsistency(consistency);
+            if (negativeTtl.count() > 0 && negativeFilter.mayContain(key)) {
+                if (auto level = negativeCache.get(key); level && *level >= cached)
+                    return {404, {{"_cached", true}}, std::chrono::microseconds(0)};
+            }
+            if (pointReadTtl.count() > 0) {
+                if (auto entry = pointReadCache.get(key); entry && entry->consistency >= cached)
+                    return {200, *entry->document, std::chrono::microseconds(0)};
+            }
+
+            // Concurrent identical reads share a single round trip; only the reads started since the same invalidation share it
+            auto               generation = cacheGeneration.load();
+            CosmosResponseType resp =
+                    config.value("singleFlight", false)
+                            ? singleFlight(std::format("find{}\n{}\n{}", readOptionsKey(ctx, consistency), generation, key),
+                                           [&]() -> CosmosIterableResponseType { return {sendFindDocument(ctx)}; })
+                            : sendFindDocument(ctx);
+
+            // A write invalidated during the read may be missing from the response; it is not cached
+            if (cacheGeneration.load() != generation) return resp;
+            if (resp.statusCode == 404 && negativeTtl.count() > 0) {
+                if (++negativeFilterCount > negativeFilter.capacity()) {
+                    negativeFilter.clear();
+                    negativeFilterCount = 1;
+                }
+                negativeCache.put(key, cached, negativeTtl);
+                negativeFilter.add(key);
+            }
+            else if (resp.statusCode == 200 && pointReadTtl.count() > 0) {
+                pointReadCache.put(key, {std::make_shared<const nlohmann::json>(resp.document), cached}, pointReadTtl);
+            }
+            else {
+                return resp;
+            }
+            // The invalidation may have happened between the check and the fill
+            if (cacheGeneration.load() != generation) {
+                negativeCache.erase(key);
+                pointReadCache.erase(key);
+            }
+
+            return resp;
+        }
+
+
+        /// @brief Performs the query and returns every page as a single response.
+        /// When the configuration `queryCacheTtl` is set the result is cached (keyed by the database, collection, partition key,
+        /// statement and parameters) and shared by later calls until it expires, is evicted or is invalidated by a write.
+        /// A cache hit does not allocate.
+        /// @param ctx The query arguments as for `queryDocuments`; the `continuationToken` is ignored
+        /// @return The response with the `Documents` of every page and the total `_count`. On failure the response for the failed
+        /// page (failures are not cached).
+        std::shared_ptr<const CosmosIterableResponseType> queryAllDocuments(CosmosArgumentType const& ctx)
+        {
+            // A query bypassing the integrated cache wants the current documents; the cache is neither used nor filled
+            auto ttl = std::chrono::milliseconds(ctx.bypassIntegratedCache ? 0 : config.value("queryCacheTtl", 0));
+            auto key = queryKey(ctx);
+            auto consistency = cachedConsistency(readConsistency(ctx));
+
+            // A hash collision is treated as a miss; so is a result read with a weaker consistency than requested
+            if (ttl.count() > 0) {
+                if (auto entry = queryCache.get(key); entry && (*entry)->matches(ctx) && (*entry)->consistency >= consistency)
+                    return std::shared_ptr<const CosmosIterableResponseType>(*entry, &(*entry)->result);
+            }
+
+            TimeThis           tt {};
+            CosmosArgumentType page {ctx};
+            auto               generation = cacheGeneration.load();
+            auto               entry      = std::make_shared<QueryCacheEntry>();
+            auto&              all   = entry->result;
+            all.statusCode           = 200;
+            all.document             = {{"Documents", nlohmann::json::array()}, {"_count", 0}};
+            page.continuationToken.clear();
+
+            do {
+                auto resp = queryDocuments(page);
+                if (!resp.success()) return std::make_shared<const CosmosIterableResponseType>(std::move(resp));
+
+                for (auto& doc : resp.document["Documents"]) all.document["Documents"].push_back(std::move(doc));
+                page.continuationToken = std::move(resp.continuationToken);
+                page.maxItemCount      = resp.maxItemCount;
+            } while (!page.continuationToken.empty());
+
+            all.document["_count"] = all.document["Documents"].size();
+            all.ttx                = std::chrono::microseconds(tt.elapsed().count());
+
+            // A write invalidated while the pages were read may be missing from the result; it is not cached
+            if (ttl.count() > 0 && cacheGeneration.load() == generation) {
+                entry->database        = ctx.database;
+                entry->collection      = ctx.collection;
+                entry->partitionKey    = ctx.partitionKey;
+                entry->partitionKeys   = ctx.partitionKeys;
+                entry->queryStatement  = ctx.queryStatement;
+                entry->queryParameters = ctx.queryParameters;
+                entry->consistency     = consistency;
+                if (ctx.preparedQuery) {
+                    entry->preparedQuery   = ctx.preparedQuery->sharedContent();
+                    entry->preparedHeaders = ctx.preparedQuery->sharedHeaders();
+                }
+                queryCache.put(key, entry, ttl);
+                // The invalidation may have happened between the check and the fill
+                if (cacheGeneration.load() != generation) queryCache.erase(key);
+            }
+
+            return std::shared_ptr<const CosmosIterableResponseType>(entry, &entry->result);
+        }
+
+
+        /// @brief Lazily iterate over the documents of the query or the collection.
+        /// The pages are requested by a background prefetcher (see `CosmosDocumentRange`) following the continuation token.
+        /// @param ctx The arguments as for `queryDocuments` when `queryStatement` or `preparedQuery` is given; otherwise as for
+        /// `listDocuments`
+        /// @param prefetchPages The number of pages buffered ahead of the consumer
+        /// @return The single-pass range of documents
+        CosmosDocumentRange documents(CosmosArgumentType const& ctx, size_t prefetchPages = 2)
+        {
+            if (ctx.database.empty()) throw std::invalid_argument("documents - database required");
+            if (ctx.collection.empty()) throw std::invalid_argument("documents - collection required");
+
+            if (ctx.queryStatement.empty() && !ctx.preparedQuery)
+                return {[this](CosmosArgumentType const& page) { return listDocuments(page); }, ctx, prefetchPages};
+            return {[this](CosmosArgumentType const& page) { return queryDocuments(page); }, ctx, prefetchPages};
+        }
+
+
+        /// @brief Remove the cached query results which may include documents from the given partition.
+        /// Invoked for this client's writes when `queryCacheInvalidateOnWrite` is set; may be invoked directly when the
+        /// documents are changed elsewhere.
+        /// @param database Database name
+        /// @param collection Collection name
+        /// @param partitionKey The partition key (see `partitionKeyString` for hierarchical keys); empty or `*` removes every cached
+        /// query for the collection
+        /// @return The number of cached queries removed
+        size_t invalidateQueryCache(std::string const& database, std::string const& collection, std::string const& partitionKey = {})
+        {
+            cacheGeneration++;
+            auto everyPartition = partitionKey.empty() || partitionKey.starts_with("*");
+            return queryCache.eraseIf([&](auto const&, auto const& entry) {
+                if (entry->database != database || entry->collection != collection) return false;
+                if (everyPartition) return true;
+                // Hierarchical keys: the cached query may target the written key or any prefix of it
+                if (!entry->partitionKeys.empty()) {
+                    auto prefix = partitionKeyString(entry->partitionKeys);
+                    return partitionKey == prefix || partitionKey.starts_with(prefix + '\x1f');
+                }
+                return entry->partitionKey == partitionKey || entry->partitionKey.empty() || entry->partitionKey.starts_with("*");
+            });
+        }
+
+
+        /// @brief Snapshot of the request counters for this client
+        /// @return json object with the `requests`, `failures`, `throttled` (429) counts, the total `requestCharge` and the
+        /// `averageLatencyMs` for the requests sent by this client, the current `asyncConcurrency` limit (0 if off) and the
+        /// `asyncConcurrencyPeak` number of limited requests in flight at the same time
+        nlohmann::json metrics() const
+        {
+            auto requests = counters.requests.load();
+            auto hits     = counters.cacheHits.load();
+            auto misses   = counters.cacheMisses.load();
+            return {{"requests", requests},
+                    {"failures", counters.failures.load()},
+                    {"throttled", counters.throttled.load()},
+                    {"requestCharge", counters.requestCharge.load() / 100.0},
+                    {"averageLatencyMs", requests ? counters.elapsedMicroseconds.load() / 1000.0 / requests : 0.0},
+                    {"asyncConcurrency", config.value("asyncConcurrency", 0) > 0 ? concurrencyLimit.limit() : 0},
+                    {"asyncConcurrencyPeak", concurrencyLimit.maxActive()},
+                    {"cacheHits", hits},
+                    {"cacheMisses", misses},
+                    {"cacheHitRate", hits + misses ? double(hits) / (hits + misses) : 0.0}};
+        }
+
+
+        /// @brief JSON serializer helper for CosmosClient
+        /// @param dest Output json object
+        /// @param src Reference to a CosmosClient instance
+        friend void to_json(nlohmann::json& dest, const CosmosClient& src);
+
+#if defined(COSMOSCLIENT_TESTING_MODE)
+    public:
+#else
+    protected:
+#endif
+        /// @brief Send the request and update the request counters. Every request to Cosmos goes through here.
+        /// @param req The request
+        /// @return The response from the REST client
+        RESTResponseType send(RESTRequestType& req)
+        {
+            auto start   = std::chrono::steady_clock::now();
+            auto resp    = restClient.send(req);
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+
+            counters.requests++;
+            counters.elapsedMicroseconds += elapsed.count();
+            if (limitedRequest == &concurrencyLimit) {
+                // Throttled, timed out (408 or the WinHTTP timeout) or unavailable requests reduce the limit
+                auto code      = resp.status().code;
+                limitedRequest = nullptr;
+                concurrencyLimit.sample(elapsed, code == 429 || code == 408 || code == 503 || code == 12002);
+            }
+            counters.requestCharge += static_cast<uint64_t>(requestCharge(resp["headers"]) * 100 + 0.5);
+            if (!resp.success()) {
+                counters.failures++;
+                if (resp.status().code == 429) counters.throttled++;
+            }
+            if (auto hit = CosmosResponseHeaders::cacheHit(resp["headers"]); hit) (*hit ? counters.cacheHits : counters.cacheMisses)++;
+            return resp;
+        }
+
+
+        /// @brief Performs the delete for `removeDocument`
+        /// @param ctx The validated request
+        /// @return The status code and the response headers (the document is not used)
+        CosmosResponseType sendRemoveDocument(CosmosArgumentType const& ctx)
         {
             TimeThis tt {};
             auto     ts = DateUtils::RFC7231();
 
-            if (ctx.id.empty()) throw std::invalid_argument("find - I need the docId of the document");
-            if (ctx.partitionKey.empty()) throw std::invalid_argument("find - I need the pkId of the document");
-
-            siddiqsoft::ReqGet req {
+            siddiqsoft::ReqDelete req {
                     std::format(
                             "{}dbs/{}/colls/{}/docs/{}", cnxn.current().currentWriteUri(), ctx.database, ctx.collection, ctx.id),
                     {{"Authorization",
-                      EncryptionUtils::CosmosToken<char>(
+                      CosmosCodec::cosmosToken(
                               cnxn.current().Key,
-                              "GET",
+                              "DELETE",
                               "docs",
                               std::format("dbs/{}/colls/{}/docs/{}", ctx.database, ctx.collection, ctx.id),
                               ts)},
                      {"x-ms-date", ts},
-                     {"x-ms-documentdb-partitionkey", nlohmann::json {ctx.partitionKey}},
+                     {"x-ms-documentdb-partitionkey", requestPartitionKey(ctx)},
                      {"x-ms-version", config["apiVersion"]},
                      {"x-ms-cosmos-allow-tentative-writes", "true"}}};
+            auto resp = send(req);
+            invalidateDocument(ctx.database, ctx.collection, partitionKeyString(requestPartitionKey(ctx)), ctx.id);
 
-            auto resp = restClient.send(req);
             return {resp.status().code,
-                    resp.success() ? std::move(resp["content"]) : resp, // return error/io context
-                    std::chrono::microseconds(tt.elapsed().count())};
+                    nullptr,
+                    std::chrono::microseconds(tt.elapsed().count()),
+                    CosmosResponseHeaders {std::move(resp["headers"])}};
         }
 
 
-        /// @brief JSON serializer helper for CosmosClient
-        /// @param dest Output json object
-        /// @param src Reference to a CosmosClient instance
-        friend void to_json(nlohmann::json& dest, const CosmosClient& src);
+        /// @brief Send a batch of operations on a single partition. The batch is not atomic: every operation succeeds or fails on
+        /// its own and the response document is the array of the results (`statusCode` and `resourceBody`) in order.
+        /// @param database The database
+        /// @param collection The collection
+        /// @param partitionKey The partition key values shared by the operations (the `x-ms-documentdb-partitionkey` header)
+        /// @param operations The serialized array of operations
+        /// @return The response from Cosmos
+        CosmosResponseType sendBatch(std::string const&    database,
+                                     std::string const&    collection,
+                                     nlohmann::json const& partitionKey,
+                                     std::string const&    operations)
+        {
+            TimeThis tt {};
+            auto     ts = DateUtils::RFC7231();
+
+            siddiqsoft::ReqPost req {
+                    std::format("{}dbs/{}/colls/{}/docs", cnxn.current().currentWriteUri(), database, collection),
+                    {{"Authorization",
+                      CosmosCodec::cosmosToken(
+                              cnxn.current().Key, "POST", "docs", std::format("dbs/{}/colls/{}", database, collection), ts)},
+                     {"x-ms-date", ts},
+                     {"x-ms-documentdb-partitionkey", partitionKey},
+                     {"x-ms-cosmos-is-batch-request", "True"},
+                     {"x-ms-cosmos-batch-atomic", "False"},
+                     {"x-ms-cosmos-batch-continue-on-error", "True"},
+                     {"x-ms-version", config["apiVersion"]},
+                     {"x-ms-cosmos-allow-tentative-writes", "true"}}};
+            // The documents are already serialized; they are sent as is rather than parsed into a json body
+            req.setContent("application/json", operations);
+
+            auto resp = send(req);
+            return {resp.status().code,
+                    responseDocument(resp), // results or error
+                    std::chrono::microseconds(tt.elapsed().count()),
+                    CosmosResponseHeaders {std::move(resp["headers"])}};
+        }
+
+
+        /// @brief Upsert the serialized documents of a single partition with `sendBatch`; up to 100 documents (and below the
+        /// 2MB request limit) per request. Throttled (429) documents are retried after the server's back-off up to
+        /// `libRetryLimit` times.
+        /// @param database The database
+        /// @param collection The collection
+        /// @param partitionKey The partition key values shared by the documents (see `documentPartitionKey`)
+        /// @param documents The serialized documents; each must be valid json with the `id` and the partition key
+        /// @return The result for each document in order: the status code and the document as returned by Cosmos
+        std::vector<CosmosResponseType> upsertBatch(std::string const&                database,
+                                                    std::string const&                collection,
+                                                    nlohmann::json const&             partitionKey,
+                                                    std::span<const std::string_view> documents)
+        {
+            constexpr size_t MaxOperations {100};
+            constexpr size_t MaxBatchBytes {2000 * 1024}; // Leaves room for the operation envelopes within the 2MB limit
+            auto const       retryLimit = config.value("libRetryLimit", 7);
+
+            TimeThis                        tt {};
+            std::vector<CosmosResponseType> results(documents.size());
+            std::vector<size_t>             remaining {};
+            for (size_t i = 0; i < documents.size(); i++) remaining.push_back(i);
+
+            for (auto attempt = 1; !remaining.empty(); attempt++) {
+                std::vector<size_t>       throttled {};
+                std::chrono::milliseconds backoff {};
+
+                for (size_t first = 0, last = 0; first < remaining.size(); first = last) {
+                    // Fill the request up to the limits; an oversized document is sent on its own
+                    std::string operations {"["};
+                    for (last = first; last < remaining.size() && last - first < MaxOperations; last++) {
+                        auto document = documents[remaining[last]];
+                        if (last > first && operations.size() + document.size() > MaxBatchBytes) break;
+                        if (last > first) operations += ',';
+                        operations += R"({"operationType":"Upsert","resourceBody":)";
+                        operations += document;
+                        operations += '}';
+                    }
+                    operations += ']';
+
+                    auto  resp     = sendBatch(database, collection, partitionKey, operations);
+                    auto& outcomes = resp.document;
+                    // A failure of the whole request (such as throttling) applies to each of its documents
+                    auto perDocument = outcomes.is_array() && outcomes.size() == last - first;
+                    for (auto i = first; i < last; i++) {
+                        auto& result = results[remaining[i]];
+                        result.ttx   = std::chrono::microseconds(tt.elapsed().count());
+                        if (perDocument) {
+                            auto& outcome     = outcomes[i - first];
+                            result.statusCode = outcome.value("statusCode", 500u);
+                            result.document   = outcome.contains("resourceBody") ? std::move(outcome["resourceBody"])
+                                                                                 : std::move(outcome);
+                        }
+                        else {
+                            result.statusCode = resp.statusCode;
+                            result.document   = resp.document;
+                        }
+                        if (result.statusCode == 429 && attempt < retryLimit) {
+                            throttled.push_back(remaining[i]);
+                            backoff = std::max(backoff, retryAfter(resp));
+                        }
+                    }
+                }
+
+                remaining = std::move(throttled);
+                if (!remaining.empty()) std::this_thread::sleep_for(backoff);
+            }
+
+            invalidatePartition(database, collection, partitionKeyString(partitionKey));
+            return results;
+        }
+
+
+        /// @brief Performs the point read for `findDocument`
+        /// @param ctx The validated request
+        /// @return The response from Cosmos
+        CosmosResponseType sendFindDocument(CosmosArgumentType const& ctx)
+        {
+            TimeThis tt {};
+            auto     ts = DateUtils::RFC7231();
+
+            nlohmann::json headers {
+                    {"Authorization",
+                     CosmosCodec::cosmosToken(cnxn.current().Key,
+                                              "GET",
+                                              "docs",
+                                              std::format("dbs/{}/colls/{}/docs/{}", ctx.database, ctx.collection, ctx.id),
+                                              ts)},
+                    {"x-ms-date", ts},
+                    {"x-ms-documentdb-partitionkey", requestPartitionKey(ctx)},
+                    {"x-ms-version", config["apiVersion"]},
+                    {"x-ms-cosmos-allow-tentative-writes", "true"}};
+
+            if (auto consistency = readConsistency(ctx); consistency != CosmosConsistencyLevel::account)
+                headers["x-ms-consistency-level"] = consistency;
+            applyIntegratedCache(headers, ctx);
+
+            siddiqsoft::ReqGet req {
+                    std::format(
+                            "{}dbs/{}/colls/{}/docs/{}", cnxn.current().currentWriteUri(), ctx.database, ctx.collection, ctx.id),
+                    headers};
+
+            auto resp = send(req);
+            return {resp.status().code,
+                    responseDocument(resp), // content or error
+                    std::chrono::microseconds(tt.elapsed().count()),
+                    CosmosResponseHeaders {std::move(resp["headers"])}};
+        }
+
+
+        /// @brief The consistency recorded with the cached reads: the level from `readConsistency` with the account's default
+        /// resolved. An unknown account default is taken as strong so such reads are only served by the entries read the same way.
+        /// @param level The level from `readConsistency`
+        /// @return The level; a cached entry serves the reads of the same or a weaker level
+        CosmosConsistencyLevel cachedConsistency(CosmosConsistencyLevel level) const
+        {
+            if (level != CosmosConsistencyLevel::account) return level;
+            return accountConsistency != CosmosConsistencyLevel::account ? accountConsistency : CosmosConsistencyLevel::strong;
+        }
+
+
+        /// @brief The consistency level for a read: the request's level otherwise the configured `consistencyLevel`
+        /// @param ctx The request
+        /// @return The level to send; account if the header is not sent
+        /// @throws std::invalid_argument if the level is stronger than the account's default consistency
+        CosmosConsistencyLevel readConsistency(CosmosArgumentType const& ctx) const
+        {
+            auto level = ctx.consistencyLevel != CosmosConsistencyLevel::account ? ctx.consistencyLevel : defaultConsistency;
+            if (accountConsistency != CosmosConsistencyLevel::account && level > accountConsistency)
+                throw std::invalid_argument(std::format("consistencyLevel {} is stronger than the account consistency {}",
+                                                        nlohmann::json(level).dump(),
+                                                        nlohmann::json(accountConsistency).dump()));
+            return level;
+        }
+
+
+        /// @brief Add the dedicated gateway's integrated cache headers for a read. The integrated cache serves the reads with the
+        /// eventual or session consistency through the dedicated gateway endpoint; other endpoints ignore the headers.
+        /// @param headers The request headers
+        /// @param ctx The request
+        void applyIntegratedCache(nlohmann::json& headers, CosmosArgumentType const& ctx) const
+        {
+            if (ctx.bypassIntegratedCache) {
+                headers["x-ms-dedicatedgateway-bypass-cache"] = "true";
+            }
+            else if (auto staleness = ctx.maxIntegratedCacheStalenessInMs > 0 ? ctx.maxIntegratedCacheStalenessInMs
+                                                                                : config.value("maxIntegratedCacheStalenessInMs", 0);
+                     staleness > 0) {
+                headers["x-ms-dedicatedgateway-max-age"] = std::to_string(staleness);
+            }
+        }
+
+
+        /// @brief The read options which affect the response (part of the single-flight key)
+        /// @param ctx The request
+        /// @param consistency The consistency from `readConsistency`
+        /// @return The consistency and the integrated cache options
+        static std::string readOptionsKey(CosmosArgumentType const& ctx, CosmosConsistencyLevel consistency)
+        {
+            return std::format("{}/{}/{}",
+                               static_cast<uint16_t>(consistency),
+                               ctx.bypassIntegratedCache ? -1 : ctx.maxIntegratedCacheStalenessInMs,
+                               ctx.bypassIntegratedCache);
+        }
+
+
+        /// @brief Share a single in-flight request among the concurrent callers with the same key.
+        /// The first caller performs the request and the others wait for its response. The entry is removed as soon as the
+        /// response is available so later callers issue a fresh request.
+        /// @param key Identifies the request; must include every argument which affects the response
+        /// @param send Performs the request
+        /// @return The response (shared by all of the concurrent callers)
+        CosmosIterableResponseType singleFlight(std::string const& key, std::function<CosmosIterableResponseType()> const& send)
+        {
+            std::promise<CosmosIterableResponseType>     leader {};
+            std::shared_future<CosmosIterableResponseType> shared {};
+            {
+                std::scoped_lock l(inflightMutex);
+                if (auto item = inflight.find(key); item != inflight.end()) {
+                    shared = item->second;
+                }
+                else {
+                    inflight.emplace(key, leader.get_future().share());
+                }
+            }
+
+            // Follower; wait for the leader's response
+            if (shared.valid()) return shared.get();
+
+            try {
+                auto resp = send();
+                {
+                    std::scoped_lock l(inflightMutex);
+                    inflight.erase(key);
+                }
+                leader.set_value(resp);
+                return resp;
+            }
+            catch (...) {
+                {
+                    std::scoped_lock l(inflightMutex);
+                    inflight.erase(key);
+                }
+                leader.set_exception(std::current_exception());
+                throw;
+            }
+        }
     };
 
     /// @brief JSON serializer helper for CosmosClient
@@ -1258,10 +4760,297 @@ namespace siddiqsoft
         dest["serviceSettings"] = src.serviceSettings;
         dest["database"]        = src.cnxn;
         dest["configuration"]   = src.config;
-        dest["workers"]         = src.asyncWorkers;
+        dest["workers"]         = src.transport->executor;
         dest["userAgentString"] = src.CosmosClientUserAgentString;
     }
 #pragma endregion
+
+
+#pragma region CosmosRouter
+    /// @brief Routes each tenant (or partition key) to one of several Cosmos accounts.
+    /// The accounts are placed on a consistent-hash ring so adding or removing an account only moves the keys of its share
+    /// of the ring. The explicit assignments take precedence over the ring (for example, to pin a large tenant).
+    /// @remarks The accounts, the ring and the assignments are published together as an immutable shard map in one of two
+    /// slots. The `route` method pins the current slot with its reader count (lock-free; it never takes the writers' mutex)
+    /// for the duration of the lookup. A writer fills the other slot once its last reader has left so a replaced map is freed
+    /// by the next publish. The accounts are kept (once for each distinct name, client and weight) for the lifetime of the
+    /// router so the clients and names returned by `route` and `accountFor` remain valid.
+    class CosmosRouter
+    {
+    public:
+        /// @brief An account available to the router
+        struct Account
+        {
+            std::string                   name {};
+            std::shared_ptr<CosmosClient> client {};
+            uint32_t                      weight {100}; // Number of points on the hash ring
+        };
+
+#if defined(COSMOSCLIENT_TESTING_MODE)
+    public:
+#else
+    protected:
+#endif
+        /// @brief Allows lookup of the assignments by string_view
+        struct KeyHash
+        {
+            using is_transparent = void;
+            size_t operator()(std::string_view key) const
+            {
+                return std::hash<std::string_view> {}(key);
+            }
+        };
+
+        /// @brief The immutable shard map
+        struct ShardMap
+        {
+            std::vector<const Account*>                                       accounts {}; // Owned by `retained`
+            std::vector<std::pair<uint64_t, size_t>>                          ring {};     // Sorted point and account index
+            std::unordered_map<std::string, size_t, KeyHash, std::equal_to<>> assignments {};
+        };
+
+        /// @brief A published shard map and the number of readers using it
+        struct ShardSlot
+        {
+            std::unique_ptr<const ShardMap> map {};
+            mutable std::atomic_uint32_t    readers {0};
+        };
+
+        /// @brief Pins the current shard map for the reader; the writers do not replace a pinned map
+        class ShardPin
+        {
+            ShardSlot const* slot {};
+
+        public:
+            explicit ShardPin(CosmosRouter const& router)
+            {
+                while (true) {
+                    auto index = router.currentSlot.load();
+                    slot       = &router.slots[index];
+                    slot->readers++;
+                    // The slot may have been replaced before it was pinned; its map is only read once it is still current
+                    if (router.currentSlot.load() == index) break;
+                    slot->readers--;
+                }
+            }
+            ~ShardPin()
+            {
+                slot->readers--;
+            }
+
+            ShardPin(const ShardPin&)            = delete;
+            ShardPin& operator=(const ShardPin&) = delete;
+
+            ShardMap const& operator*() const
+            {
+                return *slot->map;
+            }
+        };
+
+        /// @brief Serializes the writers; `route` does not take this lock
+        std::mutex publishMutex {};
+
+        /// @brief Every distinct account published by this router (stable addresses)
+        std::list<Account> retained {};
+
+        /// @brief The current and the previous shard map
+        std::array<ShardSlot, 2> slots {};
+
+        /// @brief Index of the current slot
+        std::atomic_size_t currentSlot {0};
+
+        /// @brief Publish the map into the other slot once its readers have left; the caller must hold the `publishMutex`
+        void store(ShardMap&& map)
+        {
+            auto& next = slots[1 - currentSlot.load()];
+            // The readers only hold the slot for a lookup
+            while (next.readers.load() != 0) std::this_thread::yield();
+            next.map = std::make_unique<const ShardMap>(std::move(map));
+            currentSlot.store(size_t(&next - slots.data()));
+        }
+
+        /// @brief The current map; the caller must hold the `publishMutex`
+        ShardMap const& current() const
+        {
+            return *slots[currentSlot.load()].map;
+        }
+
+        /// @brief The retained copy of the account; the caller must hold the `publishMutex`
+        const Account* retain(Account&& account)
+        {
+            for (auto const& item : retained) {
+                if (item.name == account.name && item.client == account.client && item.weight == account.weight) return &item;
+            }
+            return &retained.emplace_back(std::move(account));
+        }
+
+        /// @brief Position of the key on the ring. The points must not depend on the standard library or the build so every
+        /// instance of the application routes a tenant to the same account: FNV-1a (64-bit) of the key followed by the
+        /// splitmix64 finalizer which spreads the points of similar names across the ring.
+        static uint64_t ringPoint(std::string_view key)
+        {
+            uint64_t h = 0xCBF29CE484222325ull;
+            for (auto c : key) h = (h ^ uint8_t(c)) * 0x100000001B3ull;
+            h          = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+            h          = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+            return h ^ (h >> 31);
+        }
+
+        /// @brief Find the account for the key in the given map
+        /// @return The account or nullptr if the map has no accounts
+        static const Account* lookup(ShardMap const& map, std::string_view key)
+        {
+            if (map.ring.empty()) return nullptr;
+            if (auto item = map.assignments.find(key); item != map.assignments.end()) return map.accounts[item->second];
+
+            auto point = std::lower_bound(map.ring.begin(), map.ring.end(), std::pair {ringPoint(key), size_t {0}});
+            return map.accounts[(point == map.ring.end() ? map.ring.front() : *point).second];
+        }
+
+        /// @brief Index of the named account in the map
+        static size_t indexOf(ShardMap const& map, std::string_view name)
+        {
+            for (size_t i = 0; i < map.accounts.size(); i++) {
+                if (map.accounts[i]->name == name) return i;
+            }
+            throw std::invalid_argument(std::format("CosmosRouter - unknown account {}", name));
+        }
+
+    public:
+        CosmosRouter()
+        {
+            std::scoped_lock l(publishMutex);
+            store({});
+        }
+
+        /// @brief Construct the router with the given accounts
+        /// @param accounts The configured clients (see `publish`)
+        /// @param assignments Explicit tenant to account name assignments
+        explicit CosmosRouter(std::vector<Account> accounts, std::map<std::string, std::string> const& assignments = {})
+            : CosmosRouter()
+        {
+            publish(std::move(accounts), assignments);
+        }
+
+        CosmosRouter(const CosmosRouter&)            = delete;
+        CosmosRouter& operator=(const CosmosRouter&) = delete;
+
+
+        /// @brief Replace the accounts and the assignments. The routes of the in-flight requests are not affected.
+        /// @param accounts The configured clients; the names must be unique and the weight must be non-zero. The clients
+        /// may share a transport (see `CosmosClient::makeTransport`).
+        /// @param assignments Explicit tenant to account name assignments
+        void publish(std::vector<Account> accounts, std::map<std::string, std::string> const& assignments = {})
+        {
+            ShardMap map {};
+
+            for (auto i = accounts.begin(); i != accounts.end(); ++i) {
+                if (i->name.empty()) throw std::invalid_argument("CosmosRouter - account name required");
+                if (!i->client) throw std::invalid_argument("CosmosRouter - account client required");
+                if (i->weight == 0) throw std::invalid_argument("CosmosRouter - account weight must be non-zero");
+                if (std::any_of(accounts.begin(), i, [&](auto const& other) { return other.name == i->name; }))
+                    throw std::invalid_argument(std::format("CosmosRouter - duplicate account {}", i->name));
+
+                for (uint32_t point = 0; point < i->weight; point++) {
+                    map.ring.emplace_back(ringPoint(std::format("{}#{}", i->name, point)), size_t(i - accounts.begin()));
+                }
+            }
+            std::sort(map.ring.begin(), map.ring.end());
+
+            std::scoped_lock l(publishMutex);
+            for (auto& account : accounts) map.accounts.push_back(retain(std::move(account)));
+            for (auto const& [tenant, name] : assignments) {
+                map.assignments.emplace(tenant, indexOf(map, name));
+            }
+            store(std::move(map));
+        }
+
+
+        /// @brief Pin the tenant to the given account
+        /// @param tenant The tenant (or partition key)
+        /// @param name The account name
+        void assign(std::string const& tenant, std::string_view name)
+        {
+            std::scoped_lock l(publishMutex);
+            auto             map = current();
+            map.assignments.insert_or_assign(tenant, indexOf(map, name));
+            store(std::move(map));
+        }
+
+
+        /// @brief Remove the explicit assignment; the tenant is routed by the ring
+        /// @param tenant The tenant (or partition key)
+        void unassign(std::string_view tenant)
+        {
+            std::scoped_lock l(publishMutex);
+            if (auto const& map = current(); map.assignments.find(tenant) != map.assignments.end()) {
+                auto next = map;
+                next.assignments.erase(next.assignments.find(tenant));
+                store(std::move(next));
+            }
+        }
+
+
+        /// @brief Find the client for the tenant
+        /// @param tenant The tenant (or partition key)
+        /// @return The client; it remains valid after the shard map is replaced (for the lifetime of the router)
+        CosmosClient& route(std::string_view tenant) const
+        {
+            if (auto account = lookup(*ShardPin {*this}, tenant)) return *account->client;
+            throw std::invalid_argument("route - no accounts");
+        }
+
+
+        /// @brief Find the account name for the tenant
+        /// @param tenant The tenant (or partition key)
+        /// @return The account name; valid for the lifetime of the router
+        std::string_view accountFor(std::string_view tenant) const
+        {
+            if (auto account = lookup(*ShardPin {*this}, tenant)) return account->name;
+            throw std::invalid_argument("accountFor - no accounts");
+        }
+
+
+        /// @brief The number of accounts
+        size_t size() const
+        {
+            return (*ShardPin {*this}).accounts.size();
+        }
+
+
+        /// @brief Aggregate the request counters of the accounts
+        /// @return json object with the `accounts` (see `CosmosClient::metrics`) and the `total` across the accounts
+        nlohmann::json metrics() const
+        {
+            // The slot is not held while the clients are queried
+            auto           current  = (*ShardPin {*this}).accounts;
+            nlohmann::json accounts = nlohmann::json::object();
+            uint64_t       requests = 0, failures = 0, throttled = 0, cacheHits = 0, cacheMisses = 0;
+            double         requestCharge = 0, latency = 0;
+
+            for (auto account : current) {
+                auto item = account->client->metrics();
+                requests += item.value("requests", uint64_t {0});
+                failures += item.value("failures", uint64_t {0});
+                throttled += item.value("throttled", uint64_t {0});
+                requestCharge += item.value("requestCharge", 0.0);
+                cacheHits += item.value("cacheHits", uint64_t {0});
+                cacheMisses += item.value("cacheMisses", uint64_t {0});
+                latency += item.value("averageLatencyMs", 0.0) * item.value("requests", uint64_t {0});
+                accounts[account->name] = std::move(item);
+            }
+
+            return {{"accounts", accounts},
+                    {"total",
+                     {{"requests", requests},
+                      {"failures", failures},
+                      {"throttled", throttled},
+                      {"requestCharge", requestCharge},
+                      {"averageLatencyMs", requests ? latency / requests : 0.0},
+                      {"cacheHitRate", cacheHits + cacheMisses ? double(cacheHits) / (cacheHits + cacheMisses) : 0.0}}}};
+        }
+    };
+#pragma endregion
 } // namespace siddiqsoft
 
 
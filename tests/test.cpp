@@ -42,6 +42,8 @@
 #include <chrono>
 #include <ranges>
 #include <semaphore>
+#include <fstream>
+#include <array>
 
 #include "nlohmann/json.hpp"
 #include "../src/azure-cosmos-restcl.hpp"
@@ -1435,3 +1437,1615 @@ TEST(CosmosClient, configure_multi)
 
     EXPECT_EQ(4, passTest.load());
 }
+
+
+/// @brief Exports the first collection as NDJSON and checks the checkpoints are complete
+TEST(CosmosClient, exportDocuments)
+{
+    // These are pulled from Azure Pipelines mapped as secret variables into the following environment variables.
+    // WARNING!
+    // DO NOT DISPLAY the contents as they will expose the secrets in the Azure pipeline logs!
+    std::string priConnStr = std::getenv("CCTEST_PRIMARY_CS");
+    std::string secConnStr = std::getenv("CCTEST_SECONDARY_CS");
+
+    ASSERT_FALSE(priConnStr.empty())
+            << "Missing environment variable CCTEST_PRIMARY_CS; Set it to Primary Connection string from Azure portal.";
+
+    siddiqsoft::CosmosClient cc;
+
+    cc.configure({{"partitionKeyNames", {"__pk"}}, {"connectionStrings", {priConnStr, secConnStr}}});
+
+    auto rc = cc.listDatabases();
+    EXPECT_EQ(200, rc.statusCode);
+    auto dbName = rc.document.value("/Databases/0/id"_json_pointer, "");
+
+    auto rc2 = cc.listCollections({.database = dbName});
+    EXPECT_EQ(200, rc2.statusCode);
+    auto collectionName = rc2.document.value("/DocumentCollections/0/id"_json_pointer, "");
+
+    auto rc3 = cc.listPartitionKeyRanges({.database = dbName, .collection = collectionName});
+    EXPECT_EQ(200, rc3.statusCode);
+    EXPECT_LE(1, rc3.document.value("_count", 0));
+
+    std::stringstream ndjson {};
+    uint32_t          pages {};
+    auto              rc4 = cc.exportDocuments({.database   = dbName,
+                                   .collection = collectionName,
+                                   .onResponse = [&pages](auto const& ctx, auto const& resp) {
+                                       EXPECT_FALSE(ctx.partitionKeyRangeId.empty());
+                                       pages++;
+                                   }},
+                                  ndjson);
+    EXPECT_EQ(200, rc4.statusCode) << rc4.document.dump(3);
+    EXPECT_LE(1, pages);
+
+    // Every line must be a complete document
+    uint64_t    lines {};
+    std::string line {};
+    while (std::getline(ndjson, line)) {
+        EXPECT_TRUE(nlohmann::json::parse(line).contains("id"));
+        lines++;
+    }
+    EXPECT_EQ(rc4.document.value<uint64_t>("_count", 0), lines);
+
+    // All of the ranges are complete
+    EXPECT_EQ(rc3.document.value("_count", 0), rc4.document["checkpoints"].size());
+    for (auto& [rangeId, checkpoint] : rc4.document["checkpoints"].items()) {
+        EXPECT_TRUE(checkpoint.value("done", false)) << rangeId;
+    }
+
+    // Resuming from the completed checkpoints exports nothing
+    auto rc5 = cc.exportDocuments({.database   = dbName,
+                                   .collection = collectionName,
+                                   .document   = {{"checkpoints", rc4.document["checkpoints"]}}},
+                                  [](auto const&) { FAIL() << "Nothing to export"; });
+    EXPECT_EQ(200, rc5.statusCode);
+    EXPECT_EQ(0, rc5.document.value("_count", 0));
+
+    // A checkpoint for a range which is not listed (and has no listed child) cannot be resumed
+    auto stale        = rc4.document["checkpoints"];
+    stale["no-range"] = {{"continuationToken", "token"}, {"done", false}};
+    auto rc6          = cc.exportDocuments({.database = dbName, .collection = collectionName, .document = {{"checkpoints", stale}}},
+                                  [](auto const&) { FAIL() << "Nothing to export"; });
+    EXPECT_EQ(410, rc6.statusCode);
+    EXPECT_TRUE(rc6.document["checkpoints"].contains("no-range"));
+
+    // A failing sink stops the export (and its readers) instead of blocking them on the full queue
+    if (lines > 0) {
+        EXPECT_THROW(cc.exportDocuments(
+                             {.database = dbName, .collection = collectionName},
+                             [](auto const&) { throw std::runtime_error("sink failure"); },
+                             1),
+                     std::runtime_error);
+    }
+}
+
+
+/// @brief Imports a handful of documents from NDJSON and removes them
+TEST(CosmosClient, importDocuments)
+{
+    // These are pulled from Azure Pipelines mapped as secret variables into the following environment variables.
+    // WARNING!
+    // DO NOT DISPLAY the contents as they will expose the secrets in the Azure pipeline logs!
+    std::string    priConnStr = std::getenv("CCTEST_PRIMARY_CS");
+    std::string    secConnStr = std::getenv("CCTEST_SECONDARY_CS");
+    constexpr auto DOCS {25};
+
+    ASSERT_FALSE(priConnStr.empty())
+            << "Missing environment variable CCTEST_PRIMARY_CS; Set it to Primary Connection string from Azure portal.";
+
+    siddiqsoft::CosmosClient cc;
+
+    cc.configure({{"partitionKeyNames", {"__pk"}}, {"connectionStrings", {priConnStr, secConnStr}}});
+
+    auto rc = cc.listDatabases();
+    EXPECT_EQ(200, rc.statusCode);
+    auto dbName = rc.document.value("/Databases/0/id"_json_pointer, "");
+
+    auto rc2 = cc.listCollections({.database = dbName});
+    EXPECT_EQ(200, rc2.statusCode);
+    auto collectionName = rc2.document.value("/DocumentCollections/0/id"_json_pointer, "");
+
+    // Build the source; the last line is missing the partition key and must be rejected
+    std::vector<std::string> docIds {};
+    std::string              ndjson {};
+    for (auto i = 0; i < DOCS; i++) {
+        docIds.push_back(std::format("azure-cosmos-restcl.{}.{}", std::chrono::system_clock().now().time_since_epoch().count(), i));
+        ndjson += nlohmann::json {{"id", docIds.back()},
+                                  {"ttl", 360},
+                                  {"__pk", (i % 2 == 0) ? "even.siddiqsoft.com" : "odd.siddiqsoft.com"},
+                                  {"source", "basic_tests.exe"}}
+                          .dump();
+        ndjson += "\n";
+    }
+    ndjson += R"({"id":"missing-partition-key"})";
+
+    std::atomic_uint32_t progressCount {0};
+    auto                 rc3 = cc.importDocuments({.database   = dbName,
+                                   .collection = collectionName,
+                                   .onResponse = [&progressCount](auto const& ctx, auto const& resp) {
+                                       EXPECT_TRUE(resp.document.contains("docsPerSecond"));
+                                       progressCount++;
+                                   }},
+                                  ndjson);
+    EXPECT_EQ(207, rc3.statusCode) << rc3.document.dump(3);
+    EXPECT_EQ(DOCS + 1, rc3.document.value("_count", 0));
+    EXPECT_EQ(DOCS, rc3.document.value("imported", 0));
+    EXPECT_EQ(1, rc3.document.value("failed", 0));
+    EXPECT_LE(2, progressCount.load()); // at least one batch per partition
+
+    // The same source from a memory-mapped file upserts the documents again
+    auto source = std::filesystem::temp_directory_path() / std::format("azure-cosmos-restcl.{}.ndjson", docIds.front());
+    {
+        std::ofstream out(source, std::ios::binary);
+        out << ndjson;
+    }
+    auto rc4 = cc.importFile({.database = dbName, .collection = collectionName}, source);
+    std::filesystem::remove(source);
+    EXPECT_EQ(207, rc4.statusCode) << rc4.document.dump(3);
+    EXPECT_EQ(DOCS + 1, rc4.document.value("_count", 0));
+    EXPECT_EQ(DOCS, rc4.document.value("imported", 0));
+    EXPECT_EQ(1, rc4.document.value("failed", 0));
+
+    // A failing callback stops the import (and its scanners) and is rethrown on the caller
+    EXPECT_THROW(cc.importDocuments({.database   = dbName,
+                                     .collection = collectionName,
+                                     .onResponse = [](auto const&, auto const&) { throw std::runtime_error("progress failure"); }},
+                                    ndjson,
+                                    1),
+                 std::runtime_error);
+
+    for (auto i = 0; i < DOCS; i++) {
+        EXPECT_EQ(204,
+                  cc.removeDocument({.database     = dbName,
+                                     .collection   = collectionName,
+                                     .id           = docIds[i],
+                                     .partitionKey = (i % 2 == 0) ? "even.siddiqsoft.com" : "odd.siddiqsoft.com"}));
+    }
+}
+
+
+/// @brief The import source file must be readable
+TEST(CosmosClient, importFile)
+{
+    siddiqsoft::CosmosClient cc;
+    cc.config["partitionKeyNames"] = {"__pk"};
+    EXPECT_THROW(cc.importFile({.database = "db", .collection = "coll"}, std::filesystem::temp_directory_path() / "missing.azure-cosmos-restcl.ndjson"),
+                 std::invalid_argument);
+}
+
+
+/// @brief Only the top-level id and partition key are captured; numeric and boolean keys are captured as their text
+TEST(CosmosKeyExtractor, extract)
+{
+    auto keys = siddiqsoft::CosmosKeyExtractor::extract(R"({"nested":{"id":"x","__pk":"y"},"id":"a","__pk":"b"})", "__pk");
+    ASSERT_TRUE(keys);
+    EXPECT_EQ("a", keys->id);
+    EXPECT_EQ(nlohmann::json {"b"}, keys->partitionKey);
+
+    // The values keep their type for the partition key header
+    EXPECT_EQ(nlohmann::json {42}, siddiqsoft::CosmosKeyExtractor::extract(R"({"id":"a","__pk":42})", "__pk")->partitionKey);
+    EXPECT_EQ(nlohmann::json {-7}, siddiqsoft::CosmosKeyExtractor::extract(R"({"__pk":-7,"id":"a"})", "__pk")->partitionKey);
+    EXPECT_EQ(nlohmann::json {1.5}, siddiqsoft::CosmosKeyExtractor::extract(R"({"id":"a","__pk":1.5})", "__pk")->partitionKey);
+    EXPECT_EQ(nlohmann::json {true}, siddiqsoft::CosmosKeyExtractor::extract(R"({"id":"a","__pk":true})", "__pk")->partitionKey);
+
+    // Hierarchical partition key; every level is required
+    std::vector<std::string> levels {"tenant", "user"};
+    keys = siddiqsoft::CosmosKeyExtractor::extract(R"({"user":"u1","id":"a","tenant":"t1"})", levels);
+    ASSERT_TRUE(keys);
+    EXPECT_EQ(nlohmann::json({"t1", "u1"}), keys->partitionKey);
+    EXPECT_FALSE(siddiqsoft::CosmosKeyExtractor::extract(R"({"id":"a","tenant":"t1"})", levels));
+
+    EXPECT_FALSE(siddiqsoft::CosmosKeyExtractor::extract(R"({"id":"a"})", "__pk"));
+    EXPECT_FALSE(siddiqsoft::CosmosKeyExtractor::extract(R"({"id":"a","__pk":null})", "__pk"));
+    EXPECT_FALSE(siddiqsoft::CosmosKeyExtractor::extract(R"({"id":"a","__pk":)", "__pk"));
+    // The line is sent as is so it must be valid beyond the keys
+    EXPECT_FALSE(siddiqsoft::CosmosKeyExtractor::extract(R"({"id":"a","__pk":"b","i":})", "__pk"));
+}
+
+
+/// @brief Checks the prepared query binds into the cached body and carries the partition targeting
+TEST(CosmosPreparedQuery, bind)
+{
+    siddiqsoft::CosmosPreparedQuery pq {"SELECT * FROM c WHERE c.source=@v1 AND c.i > @v2", {"@v1", "@v2"}, "odd.siddiqsoft.com"};
+
+    EXPECT_EQ("SELECT * FROM c WHERE c.source=@v1 AND c.i > @v2", pq.statement());
+    EXPECT_EQ(nlohmann::json {"odd.siddiqsoft.com"}, pq.headers().at("x-ms-documentdb-partitionkey"));
+    EXPECT_FALSE(pq.headers().contains("x-ms-documentdb-query-enablecrosspartition"));
+
+    pq.bind("@v1", "basic_tests.exe").bind("@v2", 3);
+    EXPECT_EQ("basic_tests.exe", pq.content().at("/parameters/0/value"_json_pointer));
+    EXPECT_EQ(3, pq.content().at("/parameters/1/value"_json_pointer));
+
+    // Re-binding replaces the value in place
+    pq.bind("@v2", 7);
+    EXPECT_EQ(2, pq.content().at("parameters").size());
+    EXPECT_EQ(7, pq.content().at("/parameters/1/value"_json_pointer));
+
+    // The body handed to a request or a cached result is not changed by a later bind
+    auto snapshot = pq.sharedContent();
+    pq.bind("@v2", 9);
+    EXPECT_EQ(7, snapshot->at("/parameters/1/value"_json_pointer));
+    EXPECT_EQ(9, pq.content().at("/parameters/1/value"_json_pointer));
+    snapshot.reset();
+    auto body = &pq.content();
+    pq.bind("@v2", 10);
+    EXPECT_EQ(body, &pq.content());
+    EXPECT_EQ(pq.sharedHeaders().get(), &pq.headers());
+
+    EXPECT_THROW(pq.bind("@v3", 1), std::invalid_argument);
+    EXPECT_THROW(siddiqsoft::CosmosPreparedQuery {""}, std::invalid_argument);
+
+    // Cross-partition is the default targeting
+    siddiqsoft::CosmosPreparedQuery pqAll {"SELECT * FROM c"};
+    EXPECT_EQ("true", pqAll.headers().value("x-ms-documentdb-query-enablecrosspartition", ""));
+    EXPECT_FALSE(pqAll.content().contains("parameters"));
+}
+
+
+/// @brief Checks the prepared queries differing only by their partition targeting do not share a single-flight request
+/// NOTE: The `queryHeaders` is protected and this test declares the macro `COSMOSCLIENT_TESTING_MODE`
+TEST(CosmosPreparedQuery, singleFlightKey)
+{
+    siddiqsoft::CosmosClient cc;
+
+    auto odd  = std::make_shared<siddiqsoft::CosmosPreparedQuery>("SELECT * FROM c", std::vector<std::string> {}, "odd");
+    auto even = std::make_shared<siddiqsoft::CosmosPreparedQuery>("SELECT * FROM c", std::vector<std::string> {}, "even");
+
+    siddiqsoft::CosmosArgumentType oddArgs {.database = "db", .collection = "col", .preparedQuery = odd};
+    siddiqsoft::CosmosArgumentType evenArgs {.database = "db", .collection = "col", .preparedQuery = even};
+    EXPECT_NE(cc.queryFlightKey(oddArgs, cc.queryHeaders(oddArgs)), cc.queryFlightKey(evenArgs, cc.queryHeaders(evenArgs)));
+
+    // The continuation token limit changes the response
+    auto limited                       = oddArgs;
+    limited.continuationTokenLimitInKb = 1;
+    EXPECT_NE(cc.queryFlightKey(oddArgs, cc.queryHeaders(oddArgs)), cc.queryFlightKey(limited, cc.queryHeaders(limited)));
+
+    // An explicit partition key overrides the prepared targeting
+    auto overridden         = evenArgs;
+    overridden.partitionKey = "odd";
+    EXPECT_EQ(cc.queryFlightKey(oddArgs, cc.queryHeaders(oddArgs)), cc.queryFlightKey(overridden, cc.queryHeaders(overridden)));
+
+    // Overriding a cross-partition prepared query targets the single partition only
+    siddiqsoft::CosmosArgumentType crossArgs {
+            .database = "db", .collection = "col", .partitionKey = "odd", .preparedQuery = std::make_shared<siddiqsoft::CosmosPreparedQuery>("SELECT * FROM c")};
+    auto headers = cc.queryHeaders(crossArgs);
+    EXPECT_FALSE(headers.contains("x-ms-documentdb-query-enablecrosspartition"));
+    EXPECT_FALSE(headers.contains("x-ms-query-enable-crosspartition"));
+    EXPECT_EQ(cc.queryFlightKey(oddArgs, cc.queryHeaders(oddArgs)), cc.queryFlightKey(crossArgs, headers));
+
+    // ..and the other way around
+    overridden.partitionKey = "*";
+    headers                 = cc.queryHeaders(overridden);
+    EXPECT_FALSE(headers.contains("x-ms-documentdb-partitionkey"));
+    EXPECT_EQ("true", headers.value("x-ms-query-enable-crosspartition", ""));
+}
+
+
+/// @brief Checks the query cache does not return the result of a prepared query targeting another partition
+/// NOTE: The `queryKey` and `QueryCacheEntry` are protected and this test declares the macro `COSMOSCLIENT_TESTING_MODE`
+TEST(CosmosPreparedQuery, queryCacheKey)
+{
+    auto odd  = std::make_shared<siddiqsoft::CosmosPreparedQuery>("SELECT * FROM c", std::vector<std::string> {}, "odd");
+    auto even = std::make_shared<siddiqsoft::CosmosPreparedQuery>("SELECT * FROM c", std::vector<std::string> {}, "even");
+
+    siddiqsoft::CosmosArgumentType oddArgs {.database = "db", .collection = "col", .preparedQuery = odd};
+    siddiqsoft::CosmosArgumentType evenArgs {.database = "db", .collection = "col", .preparedQuery = even};
+    EXPECT_NE(siddiqsoft::CosmosClient::queryKey(oddArgs), siddiqsoft::CosmosClient::queryKey(evenArgs));
+
+    siddiqsoft::CosmosClient::QueryCacheEntry entry {
+            .database = "db", .collection = "col", .preparedQuery = odd->sharedContent(), .preparedHeaders = odd->sharedHeaders()};
+    EXPECT_TRUE(entry.matches(oddArgs));
+    EXPECT_FALSE(entry.matches(evenArgs));
+}
+
+
+/// @brief Executes the same prepared query against two partitions
+TEST(CosmosClient, queryDocument_prepared)
+{
+    // These are pulled from Azure Pipelines mapped as secret variables into the following environment variables.
+    // WARNING!
+    // DO NOT DISPLAY the contents as they will expose the secrets in the Azure pipeline logs!
+    std::string    priConnStr = std::getenv("CCTEST_PRIMARY_CS");
+    std::string    secConnStr = std::getenv("CCTEST_SECONDARY_CS");
+    std::string    sourceId   = std::format("{}-{}", getpid(), __func__);
+    constexpr auto DOCS {5};
+
+    ASSERT_FALSE(priConnStr.empty())
+            << "Missing environment variable CCTEST_PRIMARY_CS; Set it to Primary Connection string from Azure portal.";
+
+    siddiqsoft::CosmosClient cc;
+
+    cc.configure({{"partitionKeyNames", {"__pk"}}, {"connectionStrings", {priConnStr, secConnStr}}});
+
+    auto rc = cc.listDatabases();
+    EXPECT_EQ(200, rc.statusCode);
+    auto dbName = rc.document.value("/Databases/0/id"_json_pointer, "");
+
+    auto rc2 = cc.listCollections({.database = dbName});
+    EXPECT_EQ(200, rc2.statusCode);
+    auto collectionName = rc2.document.value("/DocumentCollections/0/id"_json_pointer, "");
+
+    std::vector<std::string> docIds {};
+    for (auto i = 0; i < DOCS; i++) {
+        docIds.push_back(std::format("azure-cosmos-restcl.{}", std::chrono::system_clock().now().time_since_epoch().count()));
+        auto rc3 = cc.createDocument({.database   = dbName,
+                                      .collection = collectionName,
+                                      .document   = {{"id", docIds.back()},
+                                                   {"ttl", 360},
+                                                   {"__pk", (i % 2 == 0) ? "even.siddiqsoft.com" : "odd.siddiqsoft.com"},
+                                                   {"source", sourceId}}});
+        EXPECT_EQ(201, rc3.statusCode);
+    }
+
+    auto pq = std::make_shared<siddiqsoft::CosmosPreparedQuery>("SELECT * FROM c WHERE c.source=@v1",
+                                                                std::vector<std::string> {"@v1"});
+    pq->bind("@v1", sourceId);
+
+    auto countFor = [&](std::string const& pkId) {
+        uint32_t                               count {};
+        siddiqsoft::CosmosIterableResponseType irt {};
+        do {
+            irt = cc.queryDocuments({.database          = dbName,
+                                     .collection        = collectionName,
+                                     .partitionKey      = pkId,
+                                     .continuationToken = irt.continuationToken,
+                                     .preparedQuery     = pq});
+            EXPECT_EQ(200, irt.statusCode);
+            count += irt.document.value("_count", 0);
+        } while (!irt.continuationToken.empty());
+        return count;
+    };
+
+    EXPECT_EQ(2, countFor("odd.siddiqsoft.com"));
+    EXPECT_EQ(3, countFor("even.siddiqsoft.com"));
+    EXPECT_EQ(DOCS, countFor("*"));
+
+    for (auto i = 0; i < DOCS; i++) {
+        EXPECT_EQ(204,
+                  cc.removeDocument({.database     = dbName,
+                                     .collection   = collectionName,
+                                     .id           = docIds[i],
+                                     .partitionKey = (i % 2 == 0) ? "even.siddiqsoft.com" : "odd.siddiqsoft.com"}));
+    }
+}
+
+
+/// @brief Checks the adaptive page size growth, back-off and the response size cap
+TEST(CosmosClient, adaptivePageSize)
+{
+    using namespace std::chrono_literals;
+
+    siddiqsoft::CosmosClient cc;
+
+    // Explicit page size is echoed and the default leaves the header alone
+    EXPECT_EQ(0, cc.pageSizeFor({}));
+    EXPECT_EQ(50, cc.pageSizeFor({.maxItemCount = 50}));
+    EXPECT_EQ(cc.configuration().value("adaptivePageSizeInitial", 0), cc.pageSizeFor({.adaptivePageSize = true}));
+
+    siddiqsoft::CosmosIterableResponseType page {};
+    page.statusCode = 200;
+    page.document   = {{"_count", 10}};
+    page.ttx        = 10ms;
+    EXPECT_EQ(50, cc.nextPageSize({.maxItemCount = 50}, page));
+
+    // Fast and full page doubles
+    page.headers.fields = {{"Content-Length", "10240"}};
+    EXPECT_EQ(20, cc.nextPageSize({.maxItemCount = 10, .adaptivePageSize = true}, page));
+    page.headers.fields = {};
+    // Partial page does not grow
+    EXPECT_EQ(40, cc.nextPageSize({.maxItemCount = 40, .adaptivePageSize = true}, page));
+    // Slow page halves
+    page.ttx = 1s;
+    EXPECT_EQ(5, cc.nextPageSize({.maxItemCount = 10, .adaptivePageSize = true}, page));
+    // Large documents (1MB each) cap the page at 4 documents
+    page.ttx            = 10ms;
+    page.headers.fields = {{"Content-Length", "10485760"}};
+    EXPECT_EQ(4, cc.nextPageSize({.maxItemCount = 10, .adaptivePageSize = true}, page));
+    page.headers.fields = {};
+    // Failures keep the current size
+    page.statusCode = 429;
+    EXPECT_EQ(10, cc.nextPageSize({.maxItemCount = 10, .adaptivePageSize = true}, page));
+}
+
+
+/// @brief Checks the continuation token is moved out of the response headers
+TEST(CosmosClient, takeContinuation)
+{
+    nlohmann::json headers {{"x-ms-continuation", std::string(2048, 'c')}, {"x-ms-request-charge", "2.5"}};
+
+    EXPECT_EQ(2048, siddiqsoft::CosmosClient::takeContinuation(headers).size());
+    EXPECT_TRUE(siddiqsoft::CosmosClient::takeContinuation(headers).empty());
+    EXPECT_TRUE(headers.contains("x-ms-request-charge"));
+
+    nlohmann::json noHeaders {};
+    EXPECT_TRUE(siddiqsoft::CosmosClient::takeContinuation(noHeaders).empty());
+}
+
+
+/// @brief Checks the typed accessors of the response headers
+TEST(CosmosResponseHeaders, accessors)
+{
+    siddiqsoft::CosmosResponseType resp {429,
+                                         {},
+                                         {},
+                                         siddiqsoft::CosmosResponseHeaders {{{"x-ms-activity-id", "6f0c3f4e-0000-0000-0000-000000000000"},
+                                                                             {"x-ms-request-charge", "2.86"},
+                                                                             {"x-ms-retry-after-ms", "120"},
+                                                                             {"x-ms-substatus", "3200"},
+                                                                             {"x-ms-item-count", 7}}}};
+
+    EXPECT_EQ("6f0c3f4e-0000-0000-0000-000000000000", resp.headers.activityId());
+    EXPECT_DOUBLE_EQ(2.86, resp.headers.requestCharge());
+    EXPECT_EQ(std::chrono::milliseconds(120), resp.headers.retryAfter());
+    EXPECT_EQ(3200, resp.headers.substatus());
+    EXPECT_EQ(7, resp.headers.itemCount());
+    EXPECT_TRUE(resp.headers.continuation().empty());
+    EXPECT_EQ(0, resp.headers.contentLength());
+    EXPECT_EQ(std::chrono::milliseconds(120), siddiqsoft::CosmosClient::retryAfter(resp));
+
+    // The view refers to the stored header
+    EXPECT_EQ(resp.headers.fields["x-ms-activity-id"].get_ref<const std::string&>().data(), resp.headers.activityId().data());
+}
+
+
+/// @brief Checks the error decoded from a throttled response
+TEST(CosmosResponseType, error)
+{
+    siddiqsoft::CosmosResponseType resp {429,
+                                         {{"code", "TooManyRequests"}, {"message", "Request rate is large."}},
+                                         {},
+                                         siddiqsoft::CosmosResponseHeaders {{{"x-ms-activity-id", "6f0c3f4e-0000-0000-0000-000000000000"},
+                                                                             {"x-ms-retry-after-ms", "250"},
+                                                                             {"x-ms-substatus", "3200"}}}};
+
+    auto err = resp.error();
+    EXPECT_EQ(429, err.statusCode);
+    EXPECT_EQ(3200, err.substatus);
+    EXPECT_EQ(std::chrono::milliseconds(250), err.retryAfter);
+    EXPECT_EQ("6f0c3f4e-0000-0000-0000-000000000000", err.activityId);
+    EXPECT_EQ("Request rate is large.", err.message);
+
+    // Views into the response; nothing is copied
+    EXPECT_EQ(resp.document["message"].get_ref<const std::string&>().data(), err.message.data());
+
+    // A successful response has no error details
+    siddiqsoft::CosmosResponseType ok {200, {{"message", "not an error"}}};
+    EXPECT_EQ(200, ok.error().statusCode);
+    EXPECT_TRUE(ok.error().message.empty());
+}
+
+
+/// @brief Checks the response document holds the content, the Cosmos error body or the transport io context
+/// NOTE: The `responseDocument` is protected and this test declares the macro `COSMOSCLIENT_TESTING_MODE`
+TEST(CosmosResponseType, responseDocument)
+{
+    siddiqsoft::CosmosClient cc;
+
+    auto transport = [](uint32_t status, nlohmann::json content) {
+        siddiqsoft::RESTResponseType resp {};
+        resp["response"]["status"] = status;
+        resp["content"]            = std::move(content);
+        return resp;
+    };
+
+    // The content of a successful response
+    auto ok = transport(200, {{"id", "a"}});
+    EXPECT_EQ((nlohmann::json {{"id", "a"}}), cc.responseDocument(ok));
+
+    // The Cosmos error body rather than the transport echo of the request and response
+    nlohmann::json body {{"code", "NotFound"}, {"message", "Entity with the specified id does not exist in the system."}};
+    auto           notFound = transport(404, body);
+    auto           doc      = cc.responseDocument(notFound);
+    EXPECT_EQ(body, doc);
+    EXPECT_FALSE(doc.contains("response"));
+    EXPECT_EQ("Entity with the specified id does not exist in the system.",
+              (siddiqsoft::CosmosResponseType {404, std::move(doc)}.error().message));
+
+    // An IO error has no error body; the full io context is kept
+    auto ioError = transport(12029, nullptr);
+    doc          = cc.responseDocument(ioError);
+    ASSERT_TRUE(doc.contains("response"));
+    EXPECT_EQ(12029, doc["response"].value("status", 0u));
+
+    // The configuration restores the io context for every failure
+    cc.config["errorIoContext"] = true;
+    notFound                    = transport(404, body);
+    doc                         = cc.responseDocument(notFound);
+    ASSERT_TRUE(doc.contains("response"));
+    EXPECT_EQ(404, doc["response"].value("status", 0u));
+    EXPECT_EQ(body, doc["content"]);
+}
+
+
+/// @brief Checks the base64 and url-escape kernels against the RFC 4648 vectors and the scalar kernels
+TEST(CosmosCodec, kernels)
+{
+    using siddiqsoft::CosmosCodec;
+
+    std::vector<std::pair<std::string, std::string>> vectors {
+            {"", ""}, {"f", "Zg=="}, {"fo", "Zm8="}, {"foo", "Zm9v"}, {"foob", "Zm9vYg=="}, {"fooba", "Zm9vYmE="}, {"foobar", "Zm9vYmFy"}};
+    for (auto& [plain, encoded] : vectors) {
+        EXPECT_EQ(encoded, CosmosCodec::base64Encode(plain));
+        EXPECT_EQ(plain, CosmosCodec::base64Decode(encoded));
+    }
+
+    // Every length across the 12/16 byte blocks and the tails; the vectorized and scalar kernels must agree
+    uint32_t seed = 7;
+    for (size_t length = 0; length < 200; length++) {
+        std::string data(length, '\0');
+        for (auto& c : data)
+            c = char((seed = seed * 1664525 + 1013904223) >> 24);
+
+        auto encoded = CosmosCodec::base64Encode(data);
+        EXPECT_EQ(CosmosCodec::base64Encode(data, false), encoded) << length;
+        EXPECT_EQ(data, CosmosCodec::base64Decode(encoded)) << length;
+        EXPECT_EQ(data, CosmosCodec::base64Decode(encoded, false)) << length;
+        EXPECT_EQ(CosmosCodec::urlEscape(data, false), CosmosCodec::urlEscape(data)) << length;
+        EXPECT_EQ(CosmosCodec::urlEscape(encoded, false), CosmosCodec::urlEscape(encoded)) << length;
+    }
+
+    // Invalid characters in the vectorized block and in the tail
+    EXPECT_TRUE(CosmosCodec::base64Decode("Zm9vYmFyZm9vYmFy*m9vYmFyZm9vYmFy").empty());
+    EXPECT_TRUE(CosmosCodec::base64Decode("Zm9vYmFyZm9vYmFyZm9vYm$y").empty());
+
+    EXPECT_EQ("a%2Bb%2Fc%3D%3D-._~%20%C3%A9", CosmosCodec::urlEscape("a+b/c==-._~ \xc3\xa9"));
+    EXPECT_EQ("abcdefghijklmnopqrstuvwxyz%2B0123456789", CosmosCodec::urlEscape("abcdefghijklmnopqrstuvwxyz+0123456789"));
+
+    // The newline at every position of the blocks and the tail, from every start position
+    for (size_t length = 0; length < 40; length++) {
+        for (size_t at = 0; at <= length; at++) {
+            std::string data(length, 'x');
+            if (at < length) data[at] = '\n';
+            for (size_t pos = 0; pos <= length + 1; pos++) {
+                EXPECT_EQ(std::string_view(data).find('\n', pos), CosmosCodec::find(data, '\n', pos)) << length << "/" << at;
+                EXPECT_EQ(std::string_view(data).find('\n', pos), CosmosCodec::find(data, '\n', pos, false)) << length << "/" << at;
+            }
+        }
+    }
+}
+
+
+/// @brief The token must be identical to the azure-cpp-utils implementation it replaces
+TEST(CosmosCodec, cosmosToken)
+{
+    using siddiqsoft::CosmosCodec;
+
+    auto key  = CosmosCodec::base64Decode("C2y6yDjf5/R+ob0N8A7Cgv30VRDJIWEHLM+4QDU5DE2nQ9nDuVTqobD4b8mGGyPMbIZnqyMsEcaGQy67XIw/Jw==");
+    auto date = std::string {"Tue, 01 Nov 2022 20:03:45 GMT"};
+    ASSERT_FALSE(key.empty());
+
+    std::vector<std::array<std::string, 3>> requests {{"GET", "", ""},
+                                                      {"GET", "dbs", ""},
+                                                      {"POST", "docs", "dbs/db/colls/coll"},
+                                                      {"DELETE", "docs", "dbs/db/colls/coll/docs/Some Id"},
+                                                      {"POST", "sprocs", "dbs/db/colls/coll/sprocs/bulkUpdate"}};
+    for (auto& [verb, type, link] : requests) {
+        EXPECT_EQ(siddiqsoft::EncryptionUtils::CosmosToken<char>(key, verb, type, link, date),
+                  CosmosCodec::cosmosToken(key, verb, type, link, date))
+                << verb << " " << link;
+    }
+
+    // Characters above 0x7f are always escaped
+    EXPECT_EQ("%E9%FF", CosmosCodec::urlEscape("\xe9\xff", false));
+}
+
+
+/// @brief Compares the token encoding (32 byte signature) with the vectorized kernels and the azure-cpp-utils implementation
+/// NOTE: Timing only; run with `--gtest_also_run_disabled_tests --gtest_filter=CosmosCodec.*`
+TEST(CosmosCodec, DISABLED_benchmark)
+{
+    using siddiqsoft::CosmosCodec;
+
+    std::string signature(32, '\0');
+    for (size_t i = 0; i < signature.size(); i++)
+        signature[i] = char(i * 37 + 11);
+
+    constexpr auto iterations = 100000;
+    size_t         total {};
+
+    auto start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < iterations; i++)
+        total += CosmosCodec::urlEscape(CosmosCodec::base64Encode(signature)).size();
+    auto codec = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < iterations; i++)
+        total += CosmosCodec::urlEscape(CosmosCodec::base64Encode(signature, false), false).size();
+    auto scalar = std::chrono::steady_clock::now() - start;
+
+    start = std::chrono::steady_clock::now();
+    for (auto i = 0; i < iterations; i++)
+        total += siddiqsoft::UrlUtils::encode<char>(siddiqsoft::Base64Utils::encode(signature)).size();
+    auto utils = std::chrono::steady_clock::now() - start;
+
+    std::cerr << std::format("vectorized:{} codec:{} scalar:{} azure-cpp-utils:{} ({} iterations)\n",
+                             CosmosCodec::vectorized(),
+                             std::chrono::duration_cast<std::chrono::microseconds>(codec),
+                             std::chrono::duration_cast<std::chrono::microseconds>(scalar),
+                             std::chrono::duration_cast<std::chrono::microseconds>(utils),
+                             iterations);
+    EXPECT_GT(total, 0);
+}
+
+
+/// @brief Checks the consistency override may only relax the account's consistency
+/// NOTE: The consistency members are protected and this test declares the macro `COSMOSCLIENT_TESTING_MODE`
+TEST(CosmosClient, consistencyLevel)
+{
+    using siddiqsoft::CosmosConsistencyLevel;
+
+    EXPECT_EQ("ConsistentPrefix", nlohmann::json(CosmosConsistencyLevel::consistentPrefix));
+    EXPECT_EQ(CosmosConsistencyLevel::boundedStaleness, nlohmann::json("BoundedStaleness").get<CosmosConsistencyLevel>());
+    EXPECT_TRUE(nlohmann::json(CosmosConsistencyLevel::account).is_null());
+
+    siddiqsoft::CosmosClient cc;
+
+    // Unknown names are rejected before contacting the service
+    EXPECT_THROW(cc.configure({{"partitionKeyNames", {"__pk"}},
+                               {"connectionStrings", {"AccountEndpoint=https://localhost:443/;AccountKey=a2V5"}},
+                               {"consistencyLevel", "Weak"}}),
+                 std::invalid_argument);
+
+    // As if discovered from the account's userConsistencyPolicy
+    cc.accountConsistency = CosmosConsistencyLevel::session;
+    cc.defaultConsistency = CosmosConsistencyLevel::eventual;
+
+    EXPECT_EQ(CosmosConsistencyLevel::eventual, cc.readConsistency({.operation = siddiqsoft::CosmosOperation::find}));
+    EXPECT_EQ(CosmosConsistencyLevel::consistentPrefix,
+              cc.readConsistency({.operation        = siddiqsoft::CosmosOperation::query,
+                                  .consistencyLevel = CosmosConsistencyLevel::consistentPrefix}));
+    EXPECT_EQ(CosmosConsistencyLevel::session,
+              cc.readConsistency({.operation = siddiqsoft::CosmosOperation::find, .consistencyLevel = CosmosConsistencyLevel::session}));
+    EXPECT_THROW(cc.readConsistency({.operation = siddiqsoft::CosmosOperation::find, .consistencyLevel = CosmosConsistencyLevel::strong}),
+                 std::invalid_argument);
+    EXPECT_THROW(cc.findDocument({.database         = "db",
+                                  .collection       = "col",
+                                  .id               = "id",
+                                  .partitionKey     = "pk",
+                                  .consistencyLevel = CosmosConsistencyLevel::boundedStaleness}),
+                 std::invalid_argument);
+}
+
+
+/// @brief Checks a moved client keeps its consistency, its sized caches, its limits and its batch handler
+/// NOTE: The members are protected and this test declares the macro `COSMOSCLIENT_TESTING_MODE`
+TEST(CosmosClient, moveConstructor)
+{
+    using siddiqsoft::CosmosConsistencyLevel;
+
+    siddiqsoft::CosmosClient src;
+    src.config["partitionKeyNames"]  = {"__pk"};
+    src.config["negativeCacheSize"]  = 2;
+    src.config["asyncConcurrency"]   = 3;
+    src.config["completionThreads"]  = 1;
+    src.applyConfiguration();
+    src.accountConsistency = CosmosConsistencyLevel::session;
+    src.defaultConsistency = CosmosConsistencyLevel::eventual;
+
+    std::atomic_int completions {0};
+    src.setBatchHandler([&](std::span<const siddiqsoft::CosmosCompletionType> batch) { completions += int(batch.size()); },
+                        2,
+                        std::chrono::milliseconds(5));
+
+    siddiqsoft::CosmosClient cc {std::move(src)};
+
+    EXPECT_EQ(CosmosConsistencyLevel::eventual, cc.readConsistency({.operation = siddiqsoft::CosmosOperation::find}));
+    EXPECT_THROW(cc.readConsistency({.operation = siddiqsoft::CosmosOperation::find, .consistencyLevel = CosmosConsistencyLevel::strong}),
+                 std::invalid_argument);
+    EXPECT_EQ(3, cc.concurrencyLimit.limit());
+    EXPECT_TRUE(cc.completionPool);
+
+    for (auto i = 0; i < 3; i++) cc.negativeCache.put(std::format("key{}", i), CosmosConsistencyLevel::eventual, std::chrono::minutes(1));
+    EXPECT_EQ(2, cc.negativeCache.size());
+
+    // The completions of the moved client reach the moved handler
+    for (int i = 0; i < 5; i++) {
+        cc.async({.operation    = siddiqsoft::CosmosOperation::find,
+                  .database     = "db",
+                  .collection   = "coll",
+                  .id           = std::format("doc{}", i),
+                  .partitionKey = "p"});
+    }
+    EXPECT_EQ(200, cc.drain(std::chrono::steady_clock::now() + std::chrono::seconds(5)).statusCode);
+    EXPECT_EQ(5, completions.load());
+}
+
+
+/// @brief Checks the client caches only serve the reads of the same or a weaker consistency
+/// NOTE: The caches are protected and this test declares the macro `COSMOSCLIENT_TESTING_MODE`
+TEST(CosmosClient, consistencyLevel_caches)
+{
+    using siddiqsoft::CosmosConsistencyLevel;
+
+    siddiqsoft::CosmosClient cc;
+    cc.config["partitionKeyNames"] = {"__pk"};
+    cc.config["negativeCacheTtl"]  = 60000;
+    cc.config["pointReadCacheTtl"] = 60000;
+    cc.accountConsistency          = CosmosConsistencyLevel::session;
+
+    // A miss and a document read with the eventual consistency
+    auto missing = cc.documentKey("db", "col", "pk", "missing");
+    cc.negativeCache.put(missing, CosmosConsistencyLevel::eventual, std::chrono::minutes(1));
+    cc.negativeFilter.add(missing);
+    cc.pointReadCache.put(cc.documentKey("db", "col", "pk", "id"),
+                          {std::make_shared<const nlohmann::json>(nlohmann::json {{"id", "id"}}), CosmosConsistencyLevel::eventual},
+                          std::chrono::minutes(1));
+
+    siddiqsoft::CosmosArgumentType eventual {
+            .database = "db", .collection = "col", .id = "id", .partitionKey = "pk", .consistencyLevel = CosmosConsistencyLevel::eventual};
+    EXPECT_EQ(200, cc.findDocument(eventual).statusCode);
+    eventual.id = "missing";
+    EXPECT_EQ(404, cc.findDocument(eventual).statusCode);
+
+    // The session reads (the account default) are sent to the service (the test has no service)
+    siddiqsoft::CosmosArgumentType session {.database = "db", .collection = "col", .id = "id", .partitionKey = "pk"};
+    EXPECT_NE(200, cc.findDocument(session).statusCode);
+    session.id = "missing";
+    EXPECT_NE(404, cc.findDocument(session).statusCode);
+
+    EXPECT_EQ(CosmosConsistencyLevel::session, cc.cachedConsistency(CosmosConsistencyLevel::account));
+    cc.accountConsistency = CosmosConsistencyLevel::account;
+    EXPECT_EQ(CosmosConsistencyLevel::strong, cc.cachedConsistency(CosmosConsistencyLevel::account));
+}
+
+
+/// @brief Checks the integrated cache request headers and the cache hit indicator
+/// NOTE: The `applyIntegratedCache` is protected and this test declares the macro `COSMOSCLIENT_TESTING_MODE`
+TEST(CosmosClient, integratedCache)
+{
+    siddiqsoft::CosmosClient cc;
+    cc.config["maxIntegratedCacheStalenessInMs"] = 30000;
+
+    nlohmann::json headers = nlohmann::json::object();
+    cc.applyIntegratedCache(headers, {.operation = siddiqsoft::CosmosOperation::find});
+    EXPECT_EQ("30000", headers.value("x-ms-dedicatedgateway-max-age", ""));
+
+    headers = nlohmann::json::object();
+    cc.applyIntegratedCache(headers, {.operation = siddiqsoft::CosmosOperation::query, .maxIntegratedCacheStalenessInMs = 500});
+    EXPECT_EQ("500", headers.value("x-ms-dedicatedgateway-max-age", ""));
+
+    headers = nlohmann::json::object();
+    cc.applyIntegratedCache(headers, {.operation = siddiqsoft::CosmosOperation::find, .bypassIntegratedCache = true});
+    EXPECT_EQ("true", headers.value("x-ms-dedicatedgateway-bypass-cache", ""));
+    EXPECT_FALSE(headers.contains("x-ms-dedicatedgateway-max-age"));
+
+    // Bypassing reads are not shared with the cached reads
+    EXPECT_NE(siddiqsoft::CosmosClient::readOptionsKey({.bypassIntegratedCache = true}, {}),
+              siddiqsoft::CosmosClient::readOptionsKey({}, {}));
+
+    siddiqsoft::CosmosResponseHeaders hit {{{"x-ms-cosmos-cachehit", "True"}}};
+    siddiqsoft::CosmosResponseHeaders miss {{{"x-ms-cosmos-cachehit", "False"}}};
+    siddiqsoft::CosmosResponseHeaders direct {{{"x-ms-request-charge", "1"}}};
+    EXPECT_EQ(true, hit.cacheHit());
+    EXPECT_EQ(false, miss.cacheHit());
+    EXPECT_FALSE(direct.cacheHit().has_value());
+
+    auto metrics = cc.metrics();
+    EXPECT_EQ(0, metrics.value("cacheHits", 1));
+    EXPECT_DOUBLE_EQ(0.0, metrics.value("cacheHitRate", 1.0));
+}
+
+
+/// @brief Checks a read bypassing the integrated cache is not answered from the client caches
+/// NOTE: The caches are protected and this test declares the macro `COSMOSCLIENT_TESTING_MODE`
+TEST(CosmosClient, integratedCacheBypass)
+{
+    siddiqsoft::CosmosClient cc;
+    cc.config["partitionKeyNames"] = {"__pk"};
+    cc.config["pointReadCacheTtl"] = 60000;
+    cc.config["queryCacheTtl"]     = 60000;
+
+    siddiqsoft::CosmosArgumentType find {.database = "db", .collection = "col", .id = "id", .partitionKey = "pk"};
+    cc.pointReadCache.put(cc.documentKey("db", "col", "pk", "id"),
+                          {std::make_shared<const nlohmann::json>(nlohmann::json {{"id", "id"}}), siddiqsoft::CosmosConsistencyLevel::strong},
+                          std::chrono::minutes(1));
+    EXPECT_EQ(200, cc.findDocument(find).statusCode);
+
+    // The bypassing read goes to the service (the test has no service) and does not replace the cached document
+    find.bypassIntegratedCache = true;
+    EXPECT_NE(200, cc.findDocument(find).statusCode);
+    find.bypassIntegratedCache = false;
+    EXPECT_EQ(200, cc.findDocument(find).statusCode);
+
+    siddiqsoft::CosmosArgumentType query {.database = "db", .collection = "col", .partitionKey = "pk", .queryStatement = "SELECT * FROM c"};
+    auto entry               = std::make_shared<siddiqsoft::CosmosClient::QueryCacheEntry>();
+    entry->database          = "db";
+    entry->collection        = "col";
+    entry->partitionKey      = "pk";
+    entry->queryStatement    = "SELECT * FROM c";
+    entry->consistency       = siddiqsoft::CosmosConsistencyLevel::strong;
+    entry->result.statusCode = 200;
+    cc.queryCache.put(siddiqsoft::CosmosClient::queryKey(query), entry, std::chrono::minutes(1));
+    EXPECT_EQ(&entry->result, cc.queryAllDocuments(query).get());
+
+    query.bypassIntegratedCache = true;
+    EXPECT_NE(&entry->result, cc.queryAllDocuments(query).get());
+    query.bypassIntegratedCache = false;
+    EXPECT_EQ(&entry->result, cc.queryAllDocuments(query).get());
+}
+
+
+/// @brief Cross-partition query with the continuation token limited to 1KB
+TEST(CosmosClient, queryDocument_continuationLimit)
+{
+    // These are pulled from Azure Pipelines mapped as secret variables into the following environment variables.
+    // WARNING!
+    // DO NOT DISPLAY the contents as they will expose the secrets in the Azure pipeline logs!
+    std::string priConnStr = std::getenv("CCTEST_PRIMARY_CS");
+    std::string secConnStr = std::getenv("CCTEST_SECONDARY_CS");
+
+    ASSERT_FALSE(priConnStr.empty())
+            << "Missing environment variable CCTEST_PRIMARY_CS; Set it to Primary Connection string from Azure portal.";
+
+    siddiqsoft::CosmosClient cc;
+
+    cc.configure({{"partitionKeyNames", {"__pk"}},
+                  {"connectionStrings", {priConnStr, secConnStr}},
+                  {"continuationTokenLimitInKb", 1}});
+
+    auto rc = cc.listDatabases();
+    EXPECT_EQ(200, rc.statusCode);
+    auto dbName = rc.document.value("/Databases/0/id"_json_pointer, "");
+
+    auto rc2 = cc.listCollections({.database = dbName});
+    EXPECT_EQ(200, rc2.statusCode);
+    auto collectionName = rc2.document.value("/DocumentCollections/0/id"_json_pointer, "");
+
+    siddiqsoft::CosmosIterableResponseType irt {};
+    auto                                   iteration = 5;
+    do {
+        irt = cc.queryDocuments({.database          = dbName,
+                                 .collection        = collectionName,
+                                 .partitionKey      = "*",
+                                 .continuationToken = std::move(irt.continuationToken),
+                                 .queryStatement    = "SELECT * FROM c",
+                                 .maxItemCount      = 1});
+        EXPECT_EQ(200, irt.statusCode);
+        EXPECT_GE(1024, irt.continuationToken.size());
+    } while (!irt.continuationToken.empty() && --iteration > 0);
+}
+
+
+/// @brief Concurrent callers with the same key share a single request; later callers issue a new one
+TEST(CosmosClient, singleFlight)
+{
+    siddiqsoft::CosmosClient cc;
+    std::atomic_uint         sends {0};
+    std::latch               ready {8};
+
+    auto send = [&]() -> siddiqsoft::CosmosIterableResponseType {
+        sends++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        return {200, {{"id", "doc"}}, std::chrono::microseconds(250000)};
+    };
+
+    std::vector<std::jthread> callers {};
+    for (auto i = 0; i < 8; i++) {
+        callers.emplace_back([&]() {
+            ready.arrive_and_wait();
+            auto resp = cc.singleFlight("find\ndb\ncoll\npk\ndoc", send);
+            EXPECT_EQ(200, resp.statusCode);
+            EXPECT_EQ("doc", resp.document.value("id", ""));
+        });
+    }
+    callers.clear();
+
+    EXPECT_EQ(1, sends.load());
+    EXPECT_TRUE(cc.inflight.empty());
+
+    // The completed request is not cached
+    cc.singleFlight("find\ndb\ncoll\npk\ndoc", send);
+    EXPECT_EQ(2, sends.load());
+
+    // Failures propagate to the caller
+    EXPECT_THROW(cc.singleFlight("find\ndb\ncoll\npk\nbad",
+                                 []() -> siddiqsoft::CosmosIterableResponseType { throw std::runtime_error("failed"); }),
+                 std::runtime_error);
+    EXPECT_TRUE(cc.inflight.empty());
+}
+
+
+/// @brief The lookup cache evicts the least recently used entries and expires entries after their ttl
+TEST(CosmosLruCache, getPut)
+{
+    siddiqsoft::CosmosLruCache<std::string, int> cache {2};
+
+    cache.put("a", 1, std::chrono::seconds(60));
+    cache.put("b", 2, std::chrono::seconds(60));
+    EXPECT_EQ(1, cache.get("a").value_or(0)); // "a" is now the most recent
+    cache.put("c", 3, std::chrono::seconds(60));
+    EXPECT_FALSE(cache.get("b"));
+    EXPECT_EQ(1, cache.get("a").value_or(0));
+    EXPECT_EQ(3, cache.get("c").value_or(0));
+
+    EXPECT_TRUE(cache.erase("a"));
+    EXPECT_FALSE(cache.get("a"));
+
+    cache.put("d", 4, std::chrono::milliseconds(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_FALSE(cache.get("d"));
+    EXPECT_EQ(1, cache.size());
+
+    siddiqsoft::CosmosBloomFilter filter {};
+    for (auto i = 0; i < 1000; i++) filter.add(std::format("present.{}", i));
+    for (auto i = 0; i < 1000; i++) EXPECT_TRUE(filter.mayContain(std::format("present.{}", i)));
+    auto falsePositives = 0;
+    for (auto i = 0; i < 1000; i++) falsePositives += filter.mayContain(std::format("absent.{}", i));
+    EXPECT_GT(50, falsePositives);
+    filter.clear();
+    EXPECT_FALSE(filter.mayContain("present.1"));
+
+    // Filled to its capacity the filter stays near 1% false positives
+    for (size_t i = 0; i < filter.capacity(); i++) filter.add(std::format("present.{}", i));
+    falsePositives = 0;
+    for (auto i = 0; i < 10000; i++) falsePositives += filter.mayContain(std::format("absent.{}", i));
+    EXPECT_GT(150, falsePositives);
+}
+
+
+/// @brief Missing documents are remembered until this client creates them
+TEST(CosmosClient, findDocument_negativeCache)
+{
+    // These are pulled from Azure Pipelines mapped as secret variables into the following environment variables.
+    // WARNING!
+    // DO NOT DISPLAY the contents as they will expose the secrets in the Azure pipeline logs!
+    std::string priConnStr = std::getenv("CCTEST_PRIMARY_CS");
+    std::string secConnStr = std::getenv("CCTEST_SECONDARY_CS");
+
+    ASSERT_FALSE(priConnStr.empty())
+            << "Missing environment variable CCTEST_PRIMARY_CS; Set it to Primary Connection string from Azure portal.";
+
+    siddiqsoft::CosmosClient cc;
+
+    cc.configure({{"partitionKeyNames", {"__pk"}},
+                  {"connectionStrings", {priConnStr, secConnStr}},
+                  {"negativeCacheTtl", 60000},
+                  {"pointReadCacheTtl", 60000}});
+
+    auto rc = cc.listDatabases();
+    EXPECT_EQ(200, rc.statusCode);
+    auto dbName = rc.document.value("/Databases/0/id"_json_pointer, "");
+
+    auto rc2 = cc.listCollections({.database = dbName});
+    EXPECT_EQ(200, rc2.statusCode);
+    auto collectionName = rc2.document.value("/DocumentCollections/0/id"_json_pointer, "");
+
+    auto docId = std::format("azure-cosmos-restcl.{}", std::chrono::system_clock().now().time_since_epoch().count());
+    siddiqsoft::CosmosArgumentType findArgs {
+            .database = dbName, .collection = collectionName, .id = docId, .partitionKey = "siddiqsoft.com"};
+
+    EXPECT_EQ(404, cc.findDocument(findArgs).statusCode);
+    auto cached = cc.findDocument(findArgs);
+    EXPECT_EQ(404, cached.statusCode);
+    EXPECT_TRUE(cached.document.value("_cached", false));
+
+    // Our own create invalidates the cached 404
+    EXPECT_EQ(201,
+              cc.createDocument({.database   = dbName,
+                                 .collection = collectionName,
+                                 .document   = {{"id", docId}, {"ttl", 360}, {"__pk", "siddiqsoft.com"}}})
+                      .statusCode);
+    EXPECT_EQ(200, cc.findDocument(findArgs).statusCode);
+    // Served from the point read cache
+    auto hit = cc.findDocument(findArgs);
+    EXPECT_EQ(200, hit.statusCode);
+    EXPECT_EQ(0, hit.ttx.count());
+
+    EXPECT_EQ(204, cc.removeDocument(findArgs));
+    EXPECT_EQ(404, cc.findDocument(findArgs).statusCode);
+}
+
+
+/// @brief The complete query result is cached and invalidated by this client's write to the partition
+TEST(CosmosClient, queryAllDocuments_cache)
+{
+    // These are pulled from Azure Pipelines mapped as secret variables into the following environment variables.
+    // WARNING!
+    // DO NOT DISPLAY the contents as they will expose the secrets in the Azure pipeline logs!
+    std::string priConnStr = std::getenv("CCTEST_PRIMARY_CS");
+    std::string secConnStr = std::getenv("CCTEST_SECONDARY_CS");
+
+    ASSERT_FALSE(priConnStr.empty())
+            << "Missing environment variable CCTEST_PRIMARY_CS; Set it to Primary Connection string from Azure portal.";
+
+    siddiqsoft::CosmosClient cc;
+
+    cc.configure({{"partitionKeyNames", {"__pk"}}, {"connectionStrings", {priConnStr, secConnStr}}, {"queryCacheTtl", 60000}});
+
+    auto rc = cc.listDatabases();
+    EXPECT_EQ(200, rc.statusCode);
+    auto dbName = rc.document.value("/Databases/0/id"_json_pointer, "");
+
+    auto rc2 = cc.listCollections({.database = dbName});
+    EXPECT_EQ(200, rc2.statusCode);
+    auto collectionName = rc2.document.value("/DocumentCollections/0/id"_json_pointer, "");
+
+    siddiqsoft::CosmosArgumentType query {.database        = dbName,
+                                          .collection      = collectionName,
+                                          .partitionKey    = "siddiqsoft.com",
+                                          .queryStatement  = "SELECT * FROM c WHERE c.source=@v1",
+                                          .queryParameters = {{{"name", "@v1"}, {"value", "queryAllDocuments_cache"}}}};
+
+    auto first = cc.queryAllDocuments(query);
+    EXPECT_EQ(200, first->statusCode);
+    EXPECT_EQ(first.get(), cc.queryAllDocuments(query).get());
+
+    // Our write to the partition invalidates the cached result
+    auto docId = std::format("azure-cosmos-restcl.{}", std::chrono::system_clock().now().time_since_epoch().count());
+    EXPECT_EQ(201,
+              cc.createDocument({.database   = dbName,
+                                 .collection = collectionName,
+                                 .document   = {{"id", docId}, {"ttl", 360}, {"__pk", "siddiqsoft.com"}, {"source", "queryAllDocuments_cache"}}})
+                      .statusCode);
+    auto second = cc.queryAllDocuments(query);
+    EXPECT_NE(first.get(), second.get());
+    EXPECT_EQ(first->document.value("_count", 0) + 1, second->document.value("_count", 0));
+
+    EXPECT_EQ(204, cc.removeDocument({.database = dbName, .collection = collectionName, .id = docId, .partitionKey = "siddiqsoft.com"}));
+}
+
+
+/// @brief The document range yields every document of every page and works with the range adaptors
+TEST(CosmosDocumentRange, pages)
+{
+    std::atomic_int                requests {0};
+    siddiqsoft::CosmosDocumentRange range {[&](siddiqsoft::CosmosArgumentType const& ctx) -> siddiqsoft::CosmosIterableResponseType {
+                                               auto page = ctx.continuationToken.empty() ? 0 : std::stoi(ctx.continuationToken);
+                                               requests++;
+                                               nlohmann::json docs = nlohmann::json::array();
+                                               for (auto i = 0; i < 10; i++) docs.push_back({{"id", page * 10 + i}});
+                                               return {{200, {{"Documents", docs}, {"_count", 10}}, std::chrono::microseconds(0)},
+                                                       page < 4 ? std::to_string(page + 1) : std::string {}};
+                                           },
+                                           {.database = "db", .collection = "coll"}};
+
+    auto expected = 0;
+    for (auto& doc : range | std::views::filter([](auto const& d) { return d.value("id", 0) % 2 == 0; })) {
+        EXPECT_EQ(expected, doc.value("id", -1));
+        expected += 2;
+    }
+    EXPECT_EQ(50, expected);
+    EXPECT_EQ(5, requests.load());
+    EXPECT_EQ(200, range.status().statusCode);
+
+    // A failed page ends the iteration and is reported by the status
+    siddiqsoft::CosmosDocumentRange failed {[](siddiqsoft::CosmosArgumentType const& ctx) -> siddiqsoft::CosmosIterableResponseType {
+                                                if (!ctx.continuationToken.empty()) return {429, {{"message", "throttled"}}};
+                                                return {{200, {{"Documents", {{{"id", 1}}}}}, std::chrono::microseconds(0)}, "next"};
+                                            },
+                                            {.database = "db", .collection = "coll"}};
+    auto                            count = std::ranges::distance(failed);
+    EXPECT_EQ(1, count);
+    EXPECT_EQ(429, failed.status().statusCode);
+}
+
+
+/// @brief Walks every document in the collection with range-for
+TEST(CosmosClient, documents_range)
+{
+    // These are pulled from Azure Pipelines mapped as secret variables into the following environment variables.
+    // WARNING!
+    // DO NOT DISPLAY the contents as they will expose the secrets in the Azure pipeline logs!
+    std::string priConnStr = std::getenv("CCTEST_PRIMARY_CS");
+    std::string secConnStr = std::getenv("CCTEST_SECONDARY_CS");
+
+    ASSERT_FALSE(priConnStr.empty())
+            << "Missing environment variable CCTEST_PRIMARY_CS; Set it to Primary Connection string from Azure portal.";
+
+    siddiqsoft::CosmosClient cc;
+
+    cc.configure({{"partitionKeyNames", {"__pk"}}, {"connectionStrings", {priConnStr, secConnStr}}});
+
+    auto rc = cc.listDatabases();
+    EXPECT_EQ(200, rc.statusCode);
+    auto dbName = rc.document.value("/Databases/0/id"_json_pointer, "");
+
+    auto rc2 = cc.listCollections({.database = dbName});
+    EXPECT_EQ(200, rc2.statusCode);
+    auto collectionName = rc2.document.value("/DocumentCollections/0/id"_json_pointer, "");
+
+    auto documents = cc.documents({.database = dbName, .collection = collectionName, .maxItemCount = 10});
+    auto count     = 0;
+    for (auto& doc : documents | std::views::take(100)) {
+        EXPECT_FALSE(doc.value("id", "").empty());
+        count++;
+    }
+    EXPECT_GE(100, count);
+    EXPECT_EQ(200, documents.status().statusCode);
+}
+
+
+/// @brief Hierarchical partition keys use every configured level
+TEST(CosmosClient, hierarchicalPartitionKey)
+{
+    siddiqsoft::CosmosClient cc;
+
+    // Single level (default) uses the first name only
+    cc.config["partitionKeyNames"] = {"tenant", "user"};
+    EXPECT_EQ(1, cc.partitionKeyLevels());
+    EXPECT_EQ(nlohmann::json({"t1"}), cc.documentPartitionKey({{"id", "1"}, {"tenant", "t1"}}));
+    EXPECT_TRUE(cc.completePartitionKey({.partitionKey = "t1"}));
+
+    cc.config["partitionKeyKind"] = "MultiHash";
+    EXPECT_EQ(2, cc.partitionKeyLevels());
+    EXPECT_TRUE(cc.documentPartitionKey({{"id", "1"}, {"tenant", "t1"}}).is_null());
+    EXPECT_EQ(nlohmann::json({"t1", "u1"}), cc.documentPartitionKey({{"id", "1"}, {"tenant", "t1"}, {"user", "u1"}}));
+
+    // Point operations require every level
+    EXPECT_FALSE(cc.completePartitionKey({.partitionKey = "t1"}));
+    EXPECT_FALSE(cc.completePartitionKey({.partitionKeys = {"t1"}}));
+    EXPECT_TRUE(cc.completePartitionKey({.partitionKeys = {"t1", "u1"}}));
+    EXPECT_THROW(cc.findDocument({.database = "db", .collection = "coll", .id = "1", .partitionKeys = {"t1"}}),
+                 std::invalid_argument);
+
+    EXPECT_EQ("t1", siddiqsoft::CosmosClient::partitionKeyString(nlohmann::json {"t1"}));
+    EXPECT_EQ("t1\x1fu1", siddiqsoft::CosmosClient::partitionKeyString(nlohmann::json {"t1", "u1"}));
+
+    // A prefix query targets the prefix and allows the query to span the matching partitions
+    nlohmann::json headers {};
+    siddiqsoft::CosmosPreparedQuery::applyPartitionKey(headers, std::vector<std::string> {"t1"});
+    EXPECT_EQ(nlohmann::json({"t1"}), headers["x-ms-documentdb-partitionkey"]);
+    EXPECT_EQ("true", headers.value("x-ms-documentdb-query-enablecrosspartition", ""));
+}
+
+
+/// @brief Removes every document in a partition
+TEST(CosmosClient, removeAll)
+{
+    // These are pulled from Azure Pipelines mapped as secret variables into the following environment variables.
+    // WARNING!
+    // DO NOT DISPLAY the contents as they will expose the secrets in the Azure pipeline logs!
+    std::string priConnStr = std::getenv("CCTEST_PRIMARY_CS");
+    std::string secConnStr = std::getenv("CCTEST_SECONDARY_CS");
+
+    ASSERT_FALSE(priConnStr.empty())
+            << "Missing environment variable CCTEST_PRIMARY_CS; Set it to Primary Connection string from Azure portal.";
+
+    siddiqsoft::CosmosClient cc;
+
+    cc.configure({{"partitionKeyNames", {"__pk"}}, {"connectionStrings", {priConnStr, secConnStr}}});
+
+    auto rc = cc.listDatabases();
+    EXPECT_EQ(200, rc.statusCode);
+    auto dbName = rc.document.value("/Databases/0/id"_json_pointer, "");
+
+    auto rc2 = cc.listCollections({.database = dbName});
+    EXPECT_EQ(200, rc2.statusCode);
+    auto collectionName = rc2.document.value("/DocumentCollections/0/id"_json_pointer, "");
+
+    // A partition used only by this test
+    auto pkId = std::format("removeAll.{}", std::chrono::system_clock().now().time_since_epoch().count());
+    for (auto i = 0; i < 25; i++) {
+        EXPECT_EQ(201,
+                  cc.createDocument({.database   = dbName,
+                                     .collection = collectionName,
+                                     .document   = {{"id", std::format("{}.{}", pkId, i)}, {"ttl", 360}, {"__pk", pkId}}})
+                          .statusCode);
+    }
+
+    auto resp = cc.removeAll({.database = dbName, .collection = collectionName, .partitionKey = pkId});
+    EXPECT_TRUE(resp.success()) << resp.document.dump();
+    // The partition delete completes in the background; the streaming delete reports every document
+    if (resp.document.value("method", "") == "query") {
+        EXPECT_EQ(25, resp.document.value("removed", 0));
+        EXPECT_EQ(0, resp.document.value("failed", -1));
+        EXPECT_EQ(404, cc.findDocument({.database = dbName, .collection = collectionName, .id = pkId + ".0", .partitionKey = pkId}).statusCode);
+    }
+}
+
+
+/// @brief The stored procedure result converts to the requested type and the request charge is parsed from the headers
+TEST(CosmosClient, storedProcedureResponse)
+{
+    siddiqsoft::CosmosStoredProcedureResponseType resp {{200, {{"updated", 3}, {"continuation", "c1"}}}, 4.25};
+
+    EXPECT_EQ(3, resp.result<nlohmann::json>().value("updated", 0));
+    EXPECT_EQ((std::map<std::string, nlohmann::json> {{"continuation", "c1"}, {"updated", 3}}),
+              (resp.result<std::map<std::string, nlohmann::json>>()));
+    EXPECT_DOUBLE_EQ(4.25, nlohmann::json(resp).value("requestCharge", 0.0));
+
+    EXPECT_DOUBLE_EQ(12.5, siddiqsoft::CosmosClient::requestCharge({{"x-ms-request-charge", "12.5"}}));
+    EXPECT_DOUBLE_EQ(0, siddiqsoft::CosmosClient::requestCharge(nlohmann::json {}));
+
+    siddiqsoft::CosmosClient cc;
+    EXPECT_THROW(cc.executeStoredProcedure({.database = "db", .collection = "coll", .partitionKey = "pk"}), std::invalid_argument);
+    EXPECT_THROW(cc.executeStoredProcedure({.database = "db", .collection = "coll", .id = "bulkUpdate", .partitionKey = "pk", .document = {{"a", 1}}}),
+                 std::invalid_argument);
+}
+
+
+/// @brief Writes to a partition evict its documents (found and missing) from the lookup caches
+TEST(CosmosClient, invalidatePartition)
+{
+    siddiqsoft::CosmosClient cc;
+    cc.config["negativeCacheTtl"]  = 60000;
+    cc.config["pointReadCacheTtl"] = 60000;
+
+    for (auto const& pk : {"pk", "pk2"}) {
+        cc.negativeCache.put(cc.documentKey("db", "col", pk, "missing"), siddiqsoft::CosmosConsistencyLevel::strong, std::chrono::minutes(1));
+        cc.pointReadCache.put(cc.documentKey("db", "col", pk, "id"),
+                              {std::make_shared<const nlohmann::json>(nlohmann::json {{"id", "id"}}), siddiqsoft::CosmosConsistencyLevel::strong},
+                              std::chrono::minutes(1));
+    }
+
+    cc.invalidatePartition("db", "col", "pk");
+    EXPECT_FALSE(cc.negativeCache.get(cc.documentKey("db", "col", "pk", "missing")));
+    EXPECT_FALSE(cc.pointReadCache.get(cc.documentKey("db", "col", "pk", "id")));
+    // Other partitions are kept
+    EXPECT_TRUE(cc.negativeCache.get(cc.documentKey("db", "col", "pk2", "missing")));
+    EXPECT_TRUE(cc.pointReadCache.get(cc.documentKey("db", "col", "pk2", "id")));
+
+    // Every invalidation starts a new generation so the reads in flight do not fill the caches
+    auto generation = cc.cacheGeneration.load();
+    cc.invalidateDocument("db", "col", "pk2", "id");
+    EXPECT_EQ(generation + 1, cc.cacheGeneration.load());
+    cc.invalidatePartition("db", "col", "pk2");
+    EXPECT_EQ(generation + 2, cc.cacheGeneration.load());
+    cc.invalidateQueryCache("db", "col");
+    EXPECT_EQ(generation + 3, cc.cacheGeneration.load());
+}
+
+
+/// @brief Executing a stored procedure (and the continuing overload) evicts the partition from the lookup caches
+TEST(CosmosClient, executeStoredProcedure_invalidates)
+{
+    // These are pulled from Azure Pipelines mapped as secret variables into the following environment variables.
+    // WARNING!
+    // DO NOT DISPLAY the contents as they will expose the secrets in the Azure pipeline logs!
+    std::string priConnStr = std::getenv("CCTEST_PRIMARY_CS");
+    std::string secConnStr = std::getenv("CCTEST_SECONDARY_CS");
+
+    ASSERT_FALSE(priConnStr.empty())
+            << "Missing environment variable CCTEST_PRIMARY_CS; Set it to Primary Connection string from Azure portal.";
+
+    siddiqsoft::CosmosClient cc;
+
+    cc.configure({{"partitionKeyNames", {"__pk"}}, {"connectionStrings", {priConnStr, secConnStr}}, {"negativeCacheTtl", 60000}});
+
+    auto rc = cc.listDatabases();
+    EXPECT_EQ(200, rc.statusCode);
+    auto dbName = rc.document.value("/Databases/0/id"_json_pointer, "");
+
+    auto rc2 = cc.listCollections({.database = dbName});
+    EXPECT_EQ(200, rc2.statusCode);
+    auto collectionName = rc2.document.value("/DocumentCollections/0/id"_json_pointer, "");
+
+    auto pkId = std::format("sproc.{}", std::chrono::system_clock().now().time_since_epoch().count());
+    siddiqsoft::CosmosArgumentType missing {.database = dbName, .collection = collectionName, .id = pkId, .partitionKey = pkId};
+    // The stored procedure is not registered; the execution fails but the partition is still evicted
+    siddiqsoft::CosmosArgumentType sproc {
+            .database = dbName, .collection = collectionName, .id = pkId, .partitionKey = pkId, .document = nlohmann::json::array({1})};
+
+    EXPECT_EQ(404, cc.findDocument(missing).statusCode);
+    EXPECT_EQ(1, cc.negativeCache.size());
+    auto resp = cc.executeStoredProcedure(sproc);
+    EXPECT_EQ(404, resp.statusCode);
+    EXPECT_FALSE(resp.document.empty());
+    EXPECT_EQ(0, cc.negativeCache.size());
+
+    // The continuation is only requested for successful executions
+    EXPECT_EQ(404, cc.findDocument(missing).statusCode);
+    EXPECT_EQ(1, cc.negativeCache.size());
+    int continued {0};
+    resp = cc.executeStoredProcedure(sproc, [&](auto const&) -> std::optional<nlohmann::json> {
+        continued++;
+        return std::nullopt;
+    });
+    EXPECT_EQ(404, resp.statusCode);
+    EXPECT_EQ(0, continued);
+    EXPECT_GE(resp.requestCharge, 0);
+    EXPECT_EQ(0, cc.negativeCache.size());
+}
+
+
+/// @brief Clients constructed on a shared transport use the same REST client and executor
+TEST(CosmosClient, sharedTransport)
+{
+    auto transport = siddiqsoft::CosmosClient::makeTransport(4);
+    {
+        siddiqsoft::CosmosClient tenantA {transport};
+        siddiqsoft::CosmosClient tenantB {transport};
+
+        EXPECT_EQ(&tenantA.restClient, &tenantB.restClient);
+        EXPECT_EQ(&transport->restClient, &tenantA.restClient);
+        EXPECT_EQ(3, transport.use_count());
+        EXPECT_EQ(5, nlohmann::json(tenantA).size());
+    }
+    // The clients release the transport
+    EXPECT_EQ(1, transport.use_count());
+
+    // Each default client has its own transport
+    siddiqsoft::CosmosClient c1, c2;
+    EXPECT_NE(&c1.restClient, &c2.restClient);
+}
+
+
+TEST(CosmosRouter, route)
+{
+    auto transport = siddiqsoft::CosmosClient::makeTransport();
+    auto east      = std::make_shared<siddiqsoft::CosmosClient>(transport);
+    auto west      = std::make_shared<siddiqsoft::CosmosClient>(transport);
+    auto north     = std::make_shared<siddiqsoft::CosmosClient>(transport);
+
+    siddiqsoft::CosmosRouter router {{{"east", east}, {"west", west}, {"north", north}}, {{"bigTenant", "north"}}};
+    EXPECT_EQ(3, router.size());
+    EXPECT_EQ(north.get(), &router.route("bigTenant"));
+
+    // Every account receives a share of the tenants
+    std::map<std::string, std::string> before {};
+    std::map<std::string, size_t>      share {};
+    for (int i = 0; i < 3000; i++) {
+        auto tenant    = std::format("tenant-{}", i);
+        before[tenant] = router.accountFor(tenant);
+        share[before[tenant]]++;
+    }
+    EXPECT_EQ(3, share.size());
+    for (auto const& [name, count] : share) EXPECT_GT(count, 500) << name;
+
+    // Removing an account only moves its own tenants
+    router.publish({{"east", east}, {"west", west}});
+    for (auto const& [tenant, name] : before) {
+        if (name != "north") {
+            EXPECT_EQ(name, router.accountFor(tenant)) << tenant;
+        }
+    }
+    EXPECT_NE(north.get(), &router.route("bigTenant"));
+
+    // The routes taken from a replaced map remain valid
+    auto& routed = router.route("bigTenant");
+    router.assign("bigTenant", "west");
+    EXPECT_EQ(west.get(), &router.route("bigTenant"));
+    EXPECT_EQ(0, routed.metrics().value("requests", -1));
+    EXPECT_THROW(router.assign("bigTenant", "north"), std::invalid_argument);
+    EXPECT_THROW(router.publish({{"east", east}, {"east", west}}), std::invalid_argument);
+
+    // Rebalancing frees the replaced maps and keeps each account once
+    for (int i = 0; i < 1000; i++) router.assign(std::format("tenant-{}", i), (i % 2) ? "east" : "west");
+    EXPECT_EQ(3, router.retained.size());
+    EXPECT_EQ(1001, router.current().assignments.size());
+
+    auto metrics = router.metrics();
+    EXPECT_EQ(2, metrics["accounts"].size());
+    EXPECT_EQ(0, metrics["total"].value("requests", -1));
+
+    router.publish({});
+    EXPECT_THROW(router.route("bigTenant"), std::invalid_argument);
+}
+
+
+/// @brief The ring does not depend on the standard library so every build routes a tenant to the same account
+TEST(CosmosRouter, stableRing)
+{
+    EXPECT_EQ(0xF52A15E9A9B5E89Bull, siddiqsoft::CosmosRouter::ringPoint(""));
+    EXPECT_EQ(0x02C0BDBF481420F8ull, siddiqsoft::CosmosRouter::ringPoint("a"));
+
+    auto transport = siddiqsoft::CosmosClient::makeTransport();
+    auto east      = std::make_shared<siddiqsoft::CosmosClient>(transport);
+    auto west      = std::make_shared<siddiqsoft::CosmosClient>(transport);
+    auto north     = std::make_shared<siddiqsoft::CosmosClient>(transport);
+
+    siddiqsoft::CosmosRouter router {{{"east", east}, {"west", west}, {"north", north}}};
+    EXPECT_EQ("west", router.accountFor("tenant-0"));
+    EXPECT_EQ("north", router.accountFor("tenant-1"));
+    EXPECT_EQ("east", router.accountFor("tenant-2"));
+    EXPECT_EQ("west", router.accountFor("contoso.com"));
+    EXPECT_EQ("west", router.accountFor("siddiqsoft.com"));
+}
+
+
+TEST(CosmosConcurrencyLimit, aimd)
+{
+    using namespace std::chrono_literals;
+
+    siddiqsoft::CosmosConcurrencyLimit limit {};
+    limit.configure(4, 8, 100ms, 0.5);
+    EXPECT_EQ(4, limit.limit());
+
+    // Excess requests must wait
+    for (int i = 0; i < 4; i++) EXPECT_TRUE(limit.tryAcquire());
+    EXPECT_FALSE(limit.tryAcquire());
+
+    // Fast responses while the limit is in use grow it by about one per window of responses up to the maximum
+    for (int i = 0; i < 4; i++) limit.sample(10ms, false);
+    EXPECT_EQ(4, limit.limit());
+    limit.sample(10ms, false);
+    EXPECT_EQ(5, limit.limit());
+    for (int i = 0; i < 40; i++) limit.sample(10ms, false);
+    EXPECT_EQ(8, limit.limit());
+    EXPECT_TRUE(limit.tryAcquire());
+    EXPECT_EQ(5, limit.maxActive());
+
+    // Throttles halve it once per latency target
+    limit.sample(10ms, true);
+    EXPECT_EQ(4, limit.limit());
+    limit.sample(10ms, true);
+    limit.sample(500ms, false);
+    EXPECT_EQ(4, limit.limit());
+    std::this_thread::sleep_for(110ms);
+    limit.sample(500ms, false);
+    EXPECT_EQ(2, limit.limit());
+
+    for (int i = 0; i < 5; i++) limit.release();
+    EXPECT_EQ(0, limit.active());
+
+    // Idle samples do not grow the limit
+    limit.sample(10ms, false);
+    EXPECT_EQ(2, limit.limit());
+}
+
+
+TEST(CosmosClient, drain)
+{
+    siddiqsoft::CosmosClient cc;
+
+    std::atomic_int responses {0};
+    cc.config["partitionKeyNames"] = {"__pk"};
+    cc.config["writeBehindWindow"] = 60000;
+    cc.async({.operation  = siddiqsoft::CosmosOperation::upsert,
+              .database   = "db",
+              .collection = "coll",
+              .document   = {{"id", "a"}, {"__pk", "p"}},
+              .onResponse = [&](auto const&, auto const&) { responses++; }});
+
+    // The buffered upsert is flushed even though its window has not elapsed
+    auto resp = cc.drain(std::chrono::steady_clock::now());
+    EXPECT_EQ(200, resp.statusCode);
+    EXPECT_EQ(1, resp.document.value("completed", 0));
+    EXPECT_EQ(0, resp.document.value("dropped", 1));
+    EXPECT_EQ(1, responses.load());
+
+    // No further requests are accepted
+    EXPECT_THROW(cc.async({.operation = siddiqsoft::CosmosOperation::listDatabases, .onResponse = [](auto const&, auto const&) {}}),
+                 std::invalid_argument);
+
+    // Requests which have not started are dropped with their continuation
+    cc.cancelling = true;
+    cc.pendingTasks++;
+    cc.runTask({.operation = siddiqsoft::CosmosOperation::listDocuments, .database = "db", .collection = "coll", .continuationToken = "next"});
+    resp = cc.drain(std::chrono::steady_clock::now());
+    EXPECT_EQ(207, resp.statusCode);
+    EXPECT_EQ(1, resp.document.value("dropped", 0));
+    EXPECT_EQ("next", resp.document["droppedRequests"][0].value("continuationToken", ""));
+}
+
+
+/// @brief A throwing callback on an async lane does not terminate the process and the lane keeps running
+TEST(CosmosClient, async_laneCallbackThrows)
+{
+    siddiqsoft::CosmosClient cc;
+
+    std::atomic_int responses {0};
+    cc.config["partitionKeyNames"] = {"__pk"};
+    cc.config["asyncLanes"]        = 1;
+    cc.async({.operation  = siddiqsoft::CosmosOperation::upsert,
+              .database   = "db",
+              .collection = "coll",
+              .document   = {{"id", "a"}, {"__pk", "p"}},
+              .onResponse = [](auto const&, auto const&) { throw std::runtime_error("callback failure"); }});
+    cc.async({.operation  = siddiqsoft::CosmosOperation::upsert,
+              .database   = "db",
+              .collection = "coll",
+              .document   = {{"id", "b"}, {"__pk", "p"}},
+              .onResponse = [&](auto const&, auto const&) { responses++; }});
+
+    auto resp = cc.drain(std::chrono::steady_clock::now() + std::chrono::seconds(30));
+    EXPECT_EQ(200, resp.statusCode);
+    EXPECT_EQ(2, resp.document.value("completed", 0));
+    EXPECT_EQ(1, responses.load());
+}
+
+
+/// @brief The destructor cancels the requests still queued after `shutdownTimeout` rather than waiting for them
+TEST(CosmosClient, drain_destructorTimeout)
+{
+    auto start = std::chrono::steady_clock::now();
+    {
+        siddiqsoft::CosmosClient cc;
+        cc.config["shutdownTimeout"] = 100;
+        // A request waiting for the concurrency limit which would never be started
+        cc.pendingTasks++;
+        cc.limitedRequests.push_back({.operation = siddiqsoft::CosmosOperation::listDatabases});
+    }
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+}
+
+
+TEST(CosmosClient, completionExecutor)
+{
+    siddiqsoft::CosmosClient           cc;
+    std::mutex                         tasksMutex {};
+    std::vector<std::function<void()>> tasks {};
+    std::latch                         queued {1};
+    std::atomic_int                    responses {0};
+
+    // The executor is invoked from the worker thread
+    cc.setCompletionExecutor([&](std::function<void()>&& task) {
+        {
+            std::scoped_lock l(tasksMutex);
+            tasks.push_back(std::move(task));
+        }
+        queued.count_down();
+    });
+    cc.async({.operation  = siddiqsoft::CosmosOperation::execute,
+              .database   = "db",
+              .collection = "coll",
+              .id         = "sproc",
+              .partitionKey = "p",
+              .onResponse = [&](auto const& ctx, auto const& resp) {
+                  EXPECT_EQ("sproc", ctx.id);
+                  // The derived response type is preserved
+                  EXPECT_GE(static_cast<siddiqsoft::CosmosStoredProcedureResponseType const&>(resp).requestCharge, 0);
+                  responses++;
+              }});
+
+    // The callback is delivered by the executor rather than the worker and is awaited by drain
+    queued.wait();
+    std::vector<std::function<void()>> ready {};
+    {
+        std::scoped_lock l(tasksMutex);
+        ready.swap(tasks);
+    }
+    ASSERT_EQ(1, ready.size());
+    EXPECT_EQ(0, responses.load());
+    EXPECT_LE(1, cc.pendingTasks.load());
+    for (auto& task : ready) task();
+    EXPECT_EQ(1, responses.load());
+    EXPECT_EQ(200, cc.drain(std::chrono::steady_clock::now() + std::chrono::seconds(5)).statusCode);
+    EXPECT_EQ(0, cc.pendingTasks.load());
+}
+
+
+TEST(CosmosClient, batchHandler)
+{
+    siddiqsoft::CosmosClient cc;
+    std::mutex               batchesMutex {};
+    std::vector<size_t>      batches {};
+    std::atomic_int          callbacks {0};
+
+    cc.setBatchHandler(
+            [&](std::span<const siddiqsoft::CosmosCompletionType> completions) {
+                // The requests are moved into the batch intact and the responses keep their type
+                for (auto const& [req, resp] : completions) {
+                    EXPECT_EQ("coll", req.collection);
+                    if (req.operation == siddiqsoft::CosmosOperation::listDocuments) {
+                        EXPECT_TRUE(std::holds_alternative<siddiqsoft::CosmosIterableResponseType>(resp));
+                        continue;
+                    }
+                    EXPECT_EQ(siddiqsoft::CosmosOperation::find, req.operation);
+                    EXPECT_TRUE(req.id.starts_with("doc"));
+                    EXPECT_TRUE(std::holds_alternative<siddiqsoft::CosmosResponseType>(resp));
+                    EXPECT_NE(0, std::visit([](auto const& r) { return r.statusCode; }, resp));
+                }
+                std::scoped_lock l(batchesMutex);
+                batches.push_back(completions.size());
+            },
+            3,
+            std::chrono::milliseconds(20));
+
+    for (int i = 0; i < 7; i++) {
+        cc.async({.operation    = siddiqsoft::CosmosOperation::find,
+                  .database     = "db",
+                  .collection   = "coll",
+                  .id           = std::format("doc{}", i),
+                  .partitionKey = "p"});
+    }
+    cc.async({.operation = siddiqsoft::CosmosOperation::listDocuments, .database = "db", .collection = "coll"});
+    // Requests with a callback are not batched
+    cc.async({.operation    = siddiqsoft::CosmosOperation::find,
+              .database     = "db",
+              .collection   = "coll",
+              .id           = "single",
+              .partitionKey = "p",
+              .onResponse   = [&](auto const&, auto const&) { callbacks++; }});
+
+    // The last partial batch is delivered once it is due
+    EXPECT_EQ(200, cc.drain(std::chrono::steady_clock::now() + std::chrono::seconds(5)).statusCode);
+    std::scoped_lock l(batchesMutex);
+    size_t           total {0};
+    for (auto count : batches) total += count;
+    EXPECT_EQ(8, total);
+    EXPECT_LE(*std::ranges::max_element(batches), 3);
+    EXPECT_EQ(1, callbacks.load());
+    EXPECT_THROW(cc.setBatchHandler([](auto) {}), std::invalid_argument);
+}
@@ -235,6 +235,51 @@ TEST(CosmosClient, async_listDocuments)
 }
 
 
+/// @brief drain waits for every continuation page of an async listing and the client then rejects new requests
+TEST(CosmosClient, async_drain)
+{
+    // These are pulled from Azure Pipelines mapped as secret variables into the following environment variables.
+    // WARNING!
+    // DO NOT DISPLAY the contents as they will expose the secrets in the Azure pipeline logs!
+    std::string priConnStr = std::getenv("CCTEST_PRIMARY_CS");
+    std::string secConnStr = std::getenv("CCTEST_SECONDARY_CS");
+
+    ASSERT_FALSE(priConnStr.empty())
+            << "Missing environment variable CCTEST_PRIMARY_CS; Set it to Primary Connection string from Azure portal.";
+
+    siddiqsoft::CosmosClient cc;
+
+    cc.configure({{"partitionKeyNames", {"__pk"}}, {"connectionStrings", {priConnStr, secConnStr}}});
+
+    auto rc = cc.listDatabases();
+    EXPECT_EQ(200, rc.statusCode);
+
+    auto rc2 = cc.listCollections({.database = rc.document.value("/Databases/0/id"_json_pointer, "")});
+    EXPECT_EQ(200, rc2.statusCode);
+
+    std::atomic_uint32_t pages {0};
+    bool                 lastPage {false};
+    cc.async({.operation    = siddiqsoft::CosmosOperation::listDocuments,
+              .database     = rc.document.value("/Databases/0/id"_json_pointer, ""),
+              .collection   = rc2.document.value("/DocumentCollections/0/id"_json_pointer, ""),
+              .maxItemCount = 5,
+              .onResponse   = [&](auto const& ctx, auto const& resp) {
+                  EXPECT_TRUE(resp.success());
+                  pages++;
+                  lastPage = static_cast<siddiqsoft::CosmosIterableResponseType const&>(resp).continuationToken.empty();
+              }});
+
+    // Wait for every page of the listing; the client stops accepting requests
+    auto drained = cc.drain(std::chrono::steady_clock::now() + std::chrono::seconds(30));
+    EXPECT_EQ(200, drained.statusCode);
+    EXPECT_EQ(0, drained.document.value("dropped", 1));
+    EXPECT_LE(1, pages.load());
+    EXPECT_TRUE(lastPage);
+    EXPECT_THROW(cc.async({.operation = siddiqsoft::CosmosOperation::listDatabases, .onResponse = [](auto const&, auto const&) {}}),
+                 std::invalid_argument);
+}
+
+
 /// @brief Test createDocument document with missing "id" field in the document
 TEST(CosmosClient, async_createDocument_MissingId)
 {
@@ -635,3 +680,192 @@ TEST(CosmosClient, async_queryDocument)
         EXPECT_EQ(204, rc);
     }
 }
+
+
+/// @brief Upserts to the same document within the write-behind window are coalesced into a single write
+TEST(CosmosClient, async_writeBehind)
+{
+    // These are pulled from Azure Pipelines mapped as secret variables into the following environment variables.
+    // WARNING!
+    // DO NOT DISPLAY the contents as they will expose the secrets in the Azure pipeline logs!
+    std::string priConnStr = std::getenv("CCTEST_PRIMARY_CS");
+    std::string secConnStr = std::getenv("CCTEST_SECONDARY_CS");
+
+    ASSERT_FALSE(priConnStr.empty())
+            << "Missing environment variable CCTEST_PRIMARY_CS; Set it to Primary Connection string from Azure portal.";
+
+    siddiqsoft::CosmosClient cc;
+
+    cc.configure({{"partitionKeyNames", {"__pk"}}, {"connectionStrings", {priConnStr, secConnStr}}, {"writeBehindWindow", 500}});
+
+    auto rc = cc.listDatabases();
+    EXPECT_EQ(200, rc.statusCode);
+    auto dbName = rc.document.value("/Databases/0/id"_json_pointer, "");
+
+    auto rc2 = cc.listCollections({.database = dbName});
+    EXPECT_EQ(200, rc2.statusCode);
+    auto collectionName = rc2.document.value("/DocumentCollections/0/id"_json_pointer, "");
+
+    auto            docId = std::format("azure-cosmos-restcl.{}", std::chrono::system_clock().now().time_since_epoch().count());
+    std::atomic_int superseded {0}, committed {0};
+    std::latch      done {10};
+
+    for (auto i = 0; i < 10; i++) {
+        cc.async({.operation  = siddiqsoft::CosmosOperation::upsert,
+                  .database   = dbName,
+                  .collection = collectionName,
+                  .document   = {{"id", docId}, {"ttl", 360}, {"__pk", "siddiqsoft.com"}, {"counter", i}},
+                  .onResponse = [&](const auto& ctx, const auto& resp) {
+                      EXPECT_TRUE(resp.success());
+                      if (resp.document.value("_superseded", false))
+                          superseded++;
+                      else {
+                          committed++;
+                          EXPECT_EQ(9, resp.document.value("counter", -1));
+                      }
+                      done.count_down();
+                  }});
+    }
+    done.wait();
+
+    EXPECT_EQ(9, superseded.load());
+    EXPECT_EQ(1, committed.load());
+
+    EXPECT_EQ(204, cc.removeDocument({.database = dbName, .collection = collectionName, .id = docId, .partitionKey = "siddiqsoft.com"}));
+
+    // Different documents of the same partition are flushed as one batch; each caller receives its own document
+    std::latch batched {5};
+    for (auto i = 0; i < 5; i++) {
+        cc.async({.operation  = siddiqsoft::CosmosOperation::upsert,
+                  .database   = dbName,
+                  .collection = collectionName,
+                  .document   = {{"id", std::format("{}.{}", docId, i)}, {"ttl", 360}, {"__pk", "siddiqsoft.com"}},
+                  .onResponse = [&batched](const auto& ctx, const auto& resp) {
+                      EXPECT_TRUE(resp.success()) << resp.document.dump();
+                      EXPECT_EQ(ctx.document.value("id", ""), resp.document.value("id", "-"));
+                      batched.count_down();
+                  }});
+    }
+    batched.wait();
+
+    for (auto i = 0; i < 5; i++) {
+        EXPECT_EQ(204,
+                  cc.removeDocument({.database     = dbName,
+                                     .collection   = collectionName,
+                                     .id           = std::format("{}.{}", docId, i),
+                                     .partitionKey = "siddiqsoft.com"}));
+    }
+}
+
+
+/// @brief Requests with the same partition key complete in submission order when the async lanes are configured
+TEST(CosmosClient, async_orderedLanes)
+{
+    // These are pulled from Azure Pipelines mapped as secret variables into the following environment variables.
+    // WARNING!
+    // DO NOT DISPLAY the contents as they will expose the secrets in the Azure pipeline logs!
+    std::string priConnStr = std::getenv("CCTEST_PRIMARY_CS");
+    std::string secConnStr = std::getenv("CCTEST_SECONDARY_CS");
+
+    ASSERT_FALSE(priConnStr.empty())
+            << "Missing environment variable CCTEST_PRIMARY_CS; Set it to Primary Connection string from Azure portal.";
+
+    siddiqsoft::CosmosClient cc;
+
+    cc.configure({{"partitionKeyNames", {"__pk"}}, {"connectionStrings", {priConnStr, secConnStr}}, {"asyncLanes", 4}});
+
+    auto rc = cc.listDatabases();
+    EXPECT_EQ(200, rc.statusCode);
+    auto dbName = rc.document.value("/Databases/0/id"_json_pointer, "");
+
+    auto rc2 = cc.listCollections({.database = dbName});
+    EXPECT_EQ(200, rc2.statusCode);
+    auto collectionName = rc2.document.value("/DocumentCollections/0/id"_json_pointer, "");
+
+    auto       docId = std::format("azure-cosmos-restcl.{}", std::chrono::system_clock().now().time_since_epoch().count());
+    std::mutex completedMutex {};
+    std::vector<int> completed {};
+    std::latch       done {20};
+
+    for (auto i = 0; i < 20; i++) {
+        cc.async({.operation  = siddiqsoft::CosmosOperation::upsert,
+                  .database   = dbName,
+                  .collection = collectionName,
+                  .document   = {{"id", docId}, {"ttl", 360}, {"__pk", "siddiqsoft.com"}, {"counter", i}},
+                  .onResponse = [&](const auto& ctx, const auto& resp) {
+                      // The first upsert creates the document (201); the rest replace it (200)
+                      EXPECT_TRUE(resp.success()) << resp.statusCode;
+                      std::scoped_lock l(completedMutex);
+                      completed.push_back(resp.document.value("counter", -1));
+                      done.count_down();
+                  }});
+    }
+    done.wait();
+
+    // Every upsert for the partition executed in the order submitted
+    EXPECT_TRUE(std::ranges::is_sorted(completed));
+    EXPECT_EQ(19, cc.findDocument({.database = dbName, .collection = collectionName, .id = docId, .partitionKey = "siddiqsoft.com"})
+                          .document.value("counter", -1));
+
+    EXPECT_EQ(204, cc.removeDocument({.database = dbName, .collection = collectionName, .id = docId, .partitionKey = "siddiqsoft.com"}));
+}
+
+
+TEST(CosmosClient, async_concurrencyLimit)
+{
+    // These are pulled from Azure Pipelines mapped as secret variables into the following environment variables.
+    // WARNING!
+    // DO NOT DISPLAY the contents as they will expose the secrets in the Azure pipeline logs!
+    std::string priConnStr = std::getenv("CCTEST_PRIMARY_CS");
+    std::string secConnStr = std::getenv("CCTEST_SECONDARY_CS");
+
+    ASSERT_FALSE(priConnStr.empty())
+            << "Missing environment variable CCTEST_PRIMARY_CS; Set it to Primary Connection string from Azure portal.";
+
+    siddiqsoft::CosmosClient cc;
+
+    cc.configure({{"partitionKeyNames", {"__pk"}},
+                  {"connectionStrings", {priConnStr, secConnStr}},
+                  {"asyncConcurrency", 2},
+                  {"asyncConcurrencyMax", 8}});
+
+    auto rc = cc.listDatabases();
+    EXPECT_EQ(200, rc.statusCode);
+    auto dbName = rc.document.value("/Databases/0/id"_json_pointer, "");
+
+    auto rc2 = cc.listCollections({.database = dbName});
+    EXPECT_EQ(200, rc2.statusCode);
+    auto collectionName = rc2.document.value("/DocumentCollections/0/id"_json_pointer, "");
+
+    auto       prefix = std::format("azure-cosmos-restcl.{}", std::chrono::system_clock().now().time_since_epoch().count());
+    std::latch done {40};
+
+    for (auto i = 0; i < 40; i++) {
+        cc.async({.operation  = siddiqsoft::CosmosOperation::upsert,
+                  .database   = dbName,
+                  .collection = collectionName,
+                  .document   = {{"id", std::format("{}.{}", prefix, i)}, {"ttl", 360}, {"__pk", "siddiqsoft.com"}},
+                  .onResponse = [&](const auto& ctx, const auto& resp) {
+                      // Every upsert creates its document (201)
+                      EXPECT_TRUE(resp.success()) << resp.statusCode;
+                      done.count_down();
+                  }});
+    }
+    done.wait();
+
+    // Every request completed without the requests in flight exceeding the adaptive limit
+    auto metrics = cc.metrics();
+    EXPECT_GE(metrics.value("asyncConcurrencyPeak", 0), 1);
+    EXPECT_LE(metrics.value("asyncConcurrencyPeak", 0), 8);
+    EXPECT_GE(metrics.value("asyncConcurrency", 0), 1);
+    EXPECT_LE(metrics.value("asyncConcurrency", 0), 8);
+
+    // Remove the documents
+    for (auto i = 0; i < 40; i++) {
+        EXPECT_EQ(204,
+                  cc.removeDocument({.database     = dbName,
+                                     .collection   = collectionName,
+                                     .id           = std::format("{}.{}", prefix, i),
+                                     .partitionKey = "siddiqsoft.com"}));
+    }
+}